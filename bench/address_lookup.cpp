@@ -0,0 +1,75 @@
+// Compares the search tree used by the module map and the symbol index with
+// std::upper_bound over the sorted range table, for single addresses and for
+// batches the size of a stacktrace.
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include "fbbe/stacktrace.h"
+
+using fbbe::__detail::_Address_table;
+using fbbe::__detail::_Symbol_index_range;
+
+static volatile std::size_t g_sink = 0;
+
+template <typename F> static double ns_per_query(std::size_t queries, F f) {
+  const auto start = std::chrono::steady_clock::now();
+  f();
+  const auto elapsed = std::chrono::steady_clock::now() - start;
+  return std::chrono::duration<double, std::nano>(elapsed).count() / queries;
+}
+
+auto main() -> int {
+  constexpr std::size_t queries = 1 << 20;
+  constexpr std::size_t frames = 32;
+  std::printf("%10s %18s %16s %16s\n", "ranges", "upper_bound [ns]",
+              "tree [ns]", "batched [ns]");
+  std::mt19937_64 random(1);
+  for (const std::size_t n : {1000, 100000, 1000000, 4000000}) {
+    // Laid out like the ranges of a symbol index file.
+    std::vector<_Symbol_index_range> ranges(n);
+    std::uint64_t start = 0x400000;
+    for (auto &r : ranges) {
+      r = {};
+      r._M_start = start += 4 + random() % 256;
+    }
+    _Address_table table;
+    table._M_assign(n, [&](std::size_t i) { return ranges[i]._M_start; });
+    std::vector<std::uint64_t> pcs(queries);
+    for (auto &pc : pcs)
+      pc = 0x400000 + random() % (start - 0x400000);
+
+    const auto by_upper_bound = ns_per_query(queries, [&] {
+      std::size_t sum = 0;
+      for (const auto pc : pcs)
+        sum += std::upper_bound(ranges.begin(), ranges.end(), pc,
+                                [](std::uint64_t x, const auto &r) {
+                                  return x < r._M_start;
+                                }) -
+               ranges.begin();
+      g_sink = sum;
+    });
+    const auto by_tree = ns_per_query(queries, [&] {
+      std::size_t sum = 0;
+      for (const auto pc : pcs)
+        sum += table._M_find(pc);
+      g_sink = sum;
+    });
+    const auto by_batch = ns_per_query(queries, [&] {
+      std::size_t sum = 0;
+      std::size_t ranks[frames];
+      for (std::size_t i = 0; i < queries; i += frames) {
+        table._M_find(pcs.data() + i, frames, ranks);
+        for (const auto rank : ranks)
+          sum += rank;
+      }
+      g_sink = sum;
+    });
+    std::printf("%10zu %18.1f %16.1f %16.1f\n", n, by_upper_bound, by_tree,
+                by_batch);
+  }
+  return 0;
+}
@@ -0,0 +1,109 @@
+// Compares the allocations per capture, the bytes a trace keeps allocated
+// and the time per capture of basic_stacktrace::current() with the growing
+// (default) and the exact capture policy.
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+#include "fbbe/stacktrace.h"
+
+// Every block remembers its size in front of it, to count the live bytes.
+static long g_allocations = 0;
+static long g_live_bytes = 0;
+
+static void *allocate(std::size_t size) noexcept {
+  auto *p = static_cast<std::max_align_t *>(
+      std::malloc(sizeof(std::max_align_t) + size));
+  if (!p)
+    return nullptr;
+  ++g_allocations;
+  g_live_bytes += long(size);
+  *reinterpret_cast<std::size_t *>(p) = size;
+  return p + 1;
+}
+
+static void deallocate(void *ptr) noexcept {
+  if (!ptr)
+    return;
+  auto *p = static_cast<std::max_align_t *>(ptr) - 1;
+  g_live_bytes -= long(*reinterpret_cast<std::size_t *>(p));
+  std::free(p);
+}
+
+void *operator new(std::size_t size) {
+  if (void *p = allocate(size))
+    return p;
+  throw std::bad_alloc();
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept {
+  return allocate(size);
+}
+
+void *operator new[](std::size_t size) { return operator new(size); }
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept {
+  return allocate(size);
+}
+
+void operator delete(void *p) noexcept { deallocate(p); }
+void operator delete(void *p, std::size_t) noexcept { deallocate(p); }
+void operator delete[](void *p) noexcept { deallocate(p); }
+void operator delete[](void *p, std::size_t) noexcept { deallocate(p); }
+
+struct result {
+  double allocations; // per capture
+  double retained;    // bytes per capture still allocated by the trace
+  double used;        // bytes per capture of the frames
+  double ns;          // per capture
+};
+
+static volatile int g_sink = 0;
+
+template <typename Policy>
+[[gnu::noinline]] static result capture_at(int depth, Policy policy,
+                                           int iterations) {
+  if (depth > 0) {
+    const auto r = capture_at(depth - 1, policy, iterations);
+    g_sink = g_sink + 1; // no tail call
+    return r;
+  }
+  long allocations = 0;
+  long retained = 0;
+  long used = 0;
+  const auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; ++i) {
+    const long allocations_before = g_allocations;
+    const long live_before = g_live_bytes;
+    const auto trace = fbbe::stacktrace::current(policy);
+    allocations += g_allocations - allocations_before;
+    retained += g_live_bytes - live_before;
+    used += long(trace.size() * sizeof(fbbe::stacktrace_entry));
+    g_sink = g_sink + trace.size();
+  }
+  const auto elapsed = std::chrono::steady_clock::now() - start;
+  return {double(allocations) / iterations, double(retained) / iterations,
+          double(used) / iterations,
+          std::chrono::duration<double, std::nano>(elapsed).count() /
+              iterations};
+}
+
+auto main() -> int {
+  constexpr int iterations = 20000;
+  std::printf("%6s %10s %12s %14s %12s %10s\n", "depth", "policy",
+              "allocations", "retained [B]", "frames [B]", "time [ns]");
+  for (const int depth : {8, 40, 100, 200}) {
+    // warm up, also grows the buffer of exact_capture
+    capture_at(depth, fbbe::growing_capture, 100);
+    capture_at(depth, fbbe::exact_capture, 100);
+
+    const auto growing = capture_at(depth, fbbe::growing_capture, iterations);
+    const auto exact = capture_at(depth, fbbe::exact_capture, iterations);
+    std::printf("%6d %10s %12.2f %14.0f %12.0f %10.1f\n", depth, "growing",
+                growing.allocations, growing.retained, growing.used,
+                growing.ns);
+    std::printf("%6d %10s %12.2f %14.0f %12.0f %10.1f\n", depth, "exact",
+                exact.allocations, exact.retained, exact.used, exact.ns);
+  }
+  return 0;
+}
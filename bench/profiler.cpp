@@ -0,0 +1,62 @@
+// Measures the slowdown of a CPU-bound workload on every core while the
+// profiler samples it, at 100 Hz and at 1000 Hz.
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#include "fbbe/stacktrace.h"
+
+static volatile unsigned long g_sink = 0;
+
+[[gnu::noinline]] static unsigned long work(unsigned long n) {
+  unsigned long x = 0;
+  for (unsigned long i = 0; i < n; ++i)
+    x = x * 6364136223846793005ul + i;
+  return x;
+}
+
+// Wall time of the same work on every core.
+static double run(unsigned threads, unsigned long n) {
+  const auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> workers;
+  for (unsigned i = 0; i < threads; ++i)
+    workers.emplace_back([n] { g_sink = g_sink + work(n); });
+  for (auto &t : workers)
+    t.join();
+  const auto elapsed = std::chrono::steady_clock::now() - start;
+  return std::chrono::duration<double, std::milli>(elapsed).count();
+}
+
+static double best_of(unsigned threads, unsigned long n, int runs) {
+  double best = 1e300;
+  for (int i = 0; i < runs; ++i)
+    best = std::min(best, run(threads, n));
+  return best;
+}
+
+auto main() -> int {
+  const unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+  constexpr unsigned long n = 400000000;
+  constexpr int runs = 5;
+  best_of(threads, n / 10, 1); // warm up
+
+  const double base = best_of(threads, n, runs);
+  std::printf("%8s %8s %12s %10s %10s %8s\n", "threads", "Hz", "time [ms]",
+              "overhead", "samples", "lost");
+  std::printf("%8u %8s %12.1f %10s %10s %8s\n", threads, "off", base, "-", "-",
+              "-");
+  for (const int hz : {100, 1000}) {
+    fbbe::profiler_options options;
+    options.frequency = hz;
+    fbbe::profiler::start(options);
+    const double sampled = best_of(threads, n, runs);
+    fbbe::profiler::stop();
+    const auto p = fbbe::profiler::snapshot();
+    std::printf("%8u %8d %12.1f %9.2f%% %10llu %8llu\n", threads, hz, sampled,
+                100 * (sampled - base) / base,
+                static_cast<unsigned long long>(p.samples),
+                static_cast<unsigned long long>(p.lost));
+  }
+  return 0;
+}
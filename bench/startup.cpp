@@ -0,0 +1,64 @@
+// Measures the latency of the first symbolized stacktrace of a process, with
+// and without fbbe::stacktrace_preload() called during startup. Each case
+// runs in a fresh child process.
+#include <chrono>
+#include <cstdio>
+#include <thread>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "fbbe/stacktrace.h"
+
+using clock_type = std::chrono::steady_clock;
+
+static double ms_since(clock_type::time_point start) {
+  return std::chrono::duration<double, std::milli>(clock_type::now() - start)
+      .count();
+}
+
+// Simulated startup work, e.g. reading configuration.
+static void startup_work() {
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+}
+
+static void first_trace(const char *name, bool preload) {
+  auto start = clock_type::now();
+  if (preload)
+    fbbe::stacktrace_preload();
+  const auto preload_ms = ms_since(start);
+  startup_work();
+
+  start = clock_type::now();
+  const auto text = fbbe::to_string(fbbe::stacktrace::current());
+  const auto first_ms = ms_since(start);
+
+  start = clock_type::now();
+  const auto again = fbbe::to_string(fbbe::stacktrace::current());
+  const auto second_ms = ms_since(start);
+
+  std::printf("%-10s %14.3f %14.3f %14.3f\n", name, preload_ms, first_ms,
+              second_ms);
+  std::fflush(stdout);
+  (void)text;
+  (void)again;
+}
+
+template <typename F> static void in_child(F f) {
+  const auto pid = fork();
+  if (pid == 0) {
+    f();
+    _exit(0);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+}
+
+auto main() -> int {
+  std::printf("%-10s %14s %14s %14s\n", "", "preload [ms]", "first [ms]",
+              "second [ms]");
+  std::fflush(stdout);
+  in_child([] { first_trace("lazy", false); });
+  in_child([] { first_trace("preloaded", true); });
+  return 0;
+}
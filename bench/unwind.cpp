@@ -0,0 +1,48 @@
+// Compares the cost of basic_stacktrace::current() with the default
+// (libbacktrace) unwinder, the frame pointer unwinder and the unwinder using
+// the compact tables built from .eh_frame.
+#include <chrono>
+#include <cstdio>
+
+#include "fbbe/stacktrace.h"
+
+static volatile int g_sink = 0;
+
+template <typename Unwinder>
+[[gnu::noinline]] static double capture_at(int depth, Unwinder unwinder,
+                                           int iterations) {
+  if (depth > 0) {
+    const auto ns = capture_at(depth - 1, unwinder, iterations);
+    g_sink = g_sink + 1; // no tail call
+    return ns;
+  }
+  const auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; ++i) {
+    const auto trace = fbbe::stacktrace::current(unwinder);
+    g_sink = g_sink + trace.size();
+  }
+  const auto elapsed = std::chrono::steady_clock::now() - start;
+  return std::chrono::duration<double, std::nano>(elapsed).count() /
+         iterations;
+}
+
+auto main() -> int {
+  constexpr int iterations = 20000;
+  std::printf("%8s %16s %16s %16s\n", "depth", "default [ns]",
+              "frame ptr [ns]", "orc [ns]");
+  for (const int depth : {8, 32, 128}) {
+    // warm up
+    capture_at(depth, fbbe::default_unwinder, 100);
+    capture_at(depth, fbbe::frame_pointer_unwinder, 100);
+    capture_at(depth, fbbe::orc_unwinder, 100);
+
+    const auto by_default =
+        capture_at(depth, fbbe::default_unwinder, iterations);
+    const auto by_frame_pointer =
+        capture_at(depth, fbbe::frame_pointer_unwinder, iterations);
+    const auto by_orc = capture_at(depth, fbbe::orc_unwinder, iterations);
+    std::printf("%8d %16.1f %16.1f %16.1f\n", depth, by_default,
+                by_frame_pointer, by_orc);
+  }
+  return 0;
+}
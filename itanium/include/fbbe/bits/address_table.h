@@ -0,0 +1,240 @@
+// Copyright Fabian Keßler 2022 - 2023.
+
+// Search tree over sorted addresses -*- C++ -*-
+// Internal header, included by fbbe/stacktrace.h. Do not include directly.
+
+// Finds the range containing an address among sorted range starts, for the
+// module map and the symbol index. A binary search over a large sorted array
+// misses the cache at almost every step. Here the keys are laid out as an
+// implicit B-tree with one 64-byte node per cache line (eight keys, nine
+// children), so a search touches one line per level and the keys of a node
+// are compared at once. The batched search advances many queries a level at a
+// time and prefetches the next node of each, so the misses of the different
+// queries overlap. The layout can be stored in a file and searched where it
+// is mapped, see _Address_tree.
+
+#pragma once
+#ifndef _FBBE_BITS_ADDRESS_TABLE_H
+#define _FBBE_BITS_ADDRESS_TABLE_H 1
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+namespace fbbe {
+
+namespace __detail {
+
+// Eight keys, in one cache line.
+struct alignas(64) _Address_node {
+  std::uint64_t _M_keys[8];
+};
+
+// Searches a tree laid out by _Address_table in memory it does not own,
+// e.g. mapped from a file.
+class _Address_tree {
+public:
+  static constexpr std::size_t _S_npos = std::size_t(-1);
+  static constexpr std::size_t _S_width = 8;
+
+  _Address_tree() = default;
+
+  // __ranks holds the rank of the key in each of the __blocks * _S_width
+  // slots of __nodes, __last the greatest of the __size keys.
+  _Address_tree(const _Address_node *__nodes, std::size_t __blocks,
+                const std::uint32_t *__ranks, std::size_t __size,
+                std::uint64_t __last) noexcept
+      : _M_nodes(__nodes), _M_blocks(__blocks), _M_ranks(__ranks),
+        _M_size(__size), _M_last(__last) {}
+
+  std::size_t _M_count() const noexcept { return _M_size; }
+
+  // Returns the rank of the last key <= __x, or _S_npos.
+  std::size_t _M_find(std::uint64_t __x) const noexcept {
+    if (_M_size == 0)
+      return _S_npos;
+    if (__x >= _M_last) // also keeps the padding out of the search
+      return _M_size - 1;
+    std::size_t __best = _S_npos;
+    for (std::size_t __k = 0; __k < _M_blocks;)
+      __k = _M_step(__k, __x, __best);
+    return __best == _S_npos ? _S_npos : _M_ranks[__best];
+  }
+
+  // Like _M_find for each of __n addresses, stores the ranks in __out.
+  template <typename _Addr>
+  void _M_find(const _Addr *__x, std::size_t __n,
+               std::size_t *__out) const noexcept {
+    for (std::size_t __i = 0; __i < __n; __i += _S_batch) {
+      const std::size_t __m = __n - __i < _S_batch ? __n - __i : _S_batch;
+      _M_find_batch(__x + __i, __m, __out + __i);
+    }
+  }
+
+  static std::size_t _S_child(std::size_t __k, unsigned __i) noexcept {
+    return __k * (_S_width + 1) + __i + 1;
+  }
+
+private:
+  // Queries searched side by side.
+  static constexpr std::size_t _S_batch = 16;
+
+  const _Address_node *_M_nodes = nullptr;
+  std::size_t _M_blocks = 0;
+  const std::uint32_t *_M_ranks = nullptr;
+  std::size_t _M_size = 0;
+  std::uint64_t _M_last = 0;
+
+  // Number of keys <= __x in the node.
+  static unsigned _S_rank_in(const _Address_node &__node,
+                             std::uint64_t __x) noexcept {
+#if defined(__AVX2__)
+    // AVX2 compares signed 64-bit lanes only, so both sides are shifted.
+    const auto __bias = _mm256_set1_epi64x(INT64_MIN);
+    const auto __v = _mm256_xor_si256(
+        _mm256_set1_epi64x(static_cast<long long>(__x)), __bias);
+    const auto *__p = reinterpret_cast<const __m256i *>(__node._M_keys);
+    const auto __lo = _mm256_cmpgt_epi64(
+        _mm256_xor_si256(_mm256_load_si256(__p), __bias), __v);
+    const auto __hi = _mm256_cmpgt_epi64(
+        _mm256_xor_si256(_mm256_load_si256(__p + 1), __bias), __v);
+    const unsigned __greater =
+        __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(__lo))) +
+        __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(__hi)));
+    return _S_width - __greater;
+#else
+    // Branch free, so the compiler can vectorize it.
+    unsigned __count = 0;
+    for (unsigned __i = 0; __i < _S_width; ++__i)
+      __count += __node._M_keys[__i] <= __x;
+    return __count;
+#endif
+  }
+
+  // Descends one level from node __k, remembering the slot of the last key
+  // <= __x seen so far.
+  std::size_t _M_step(std::size_t __k, std::uint64_t __x,
+                      std::size_t &__best) const noexcept {
+    const unsigned __i = _S_rank_in(_M_nodes[__k], __x);
+    if (__i)
+      __best = __k * _S_width + __i - 1;
+    return _S_child(__k, __i);
+  }
+
+  template <typename _Addr>
+  void _M_find_batch(const _Addr *__x, std::size_t __n,
+                     std::size_t *__out) const noexcept {
+    std::size_t __node[_S_batch];
+    std::size_t __best[_S_batch];
+    bool __more = false;
+    for (std::size_t __i = 0; __i < __n; ++__i) {
+      __best[__i] = _S_npos;
+      // Queries answered without a search start past the last node.
+      const bool __search = _M_size && std::uint64_t(__x[__i]) < _M_last;
+      __node[__i] = __search ? 0 : _M_blocks;
+      __more |= __node[__i] < _M_blocks;
+    }
+    while (__more) {
+      __more = false;
+      for (std::size_t __i = 0; __i < __n; ++__i) {
+        if (__node[__i] >= _M_blocks)
+          continue;
+        __node[__i] =
+            _M_step(__node[__i], std::uint64_t(__x[__i]), __best[__i]);
+        if (__node[__i] < _M_blocks) {
+          __builtin_prefetch(&_M_nodes[__node[__i]]);
+          __more = true;
+        }
+      }
+    }
+    for (std::size_t __i = 0; __i < __n; ++__i) {
+      if (_M_size && std::uint64_t(__x[__i]) >= _M_last)
+        __out[__i] = _M_size - 1;
+      else if (__best[__i] == _S_npos)
+        __out[__i] = _S_npos;
+      else
+        __out[__i] = _M_ranks[__best[__i]];
+    }
+  }
+};
+
+// Builds and owns a tree.
+class _Address_table {
+public:
+  static constexpr std::size_t _S_npos = _Address_tree::_S_npos;
+
+  // Builds the tree from __n keys in ascending order; __key(__i) returns the
+  // key of rank __i.
+  template <typename _Key> void _M_assign(std::size_t __n, _Key __key) {
+    constexpr auto __width = _Address_tree::_S_width;
+    _M_size = __n;
+    _M_nodes.assign((__n + __width - 1) / __width, _Address_node());
+    _M_ranks.assign(_M_nodes.size() * __width, std::uint32_t(-1));
+    std::size_t __rank = 0;
+    _M_fill(0, __rank, __key);
+    _M_last = __n ? std::uint64_t(__key(__n - 1)) : 0;
+  }
+
+  std::size_t _M_count() const noexcept { return _M_size; }
+
+  std::size_t _M_find(std::uint64_t __x) const noexcept {
+    return _M_tree()._M_find(__x);
+  }
+
+  template <typename _Addr>
+  void _M_find(const _Addr *__x, std::size_t __n,
+               std::size_t *__out) const noexcept {
+    _M_tree()._M_find(__x, __n, __out);
+  }
+
+  // The layout, e.g. to write it to a file.
+  const std::vector<_Address_node> &_M_node_data() const noexcept {
+    return _M_nodes;
+  }
+  const std::vector<std::uint32_t> &_M_rank_data() const noexcept {
+    return _M_ranks;
+  }
+
+  _Address_tree _M_tree() const noexcept {
+    return {_M_nodes.data(), _M_nodes.size(), _M_ranks.data(), _M_size,
+            _M_last};
+  }
+
+private:
+  std::vector<_Address_node> _M_nodes;
+  // Rank of the key in each slot of _M_nodes.
+  std::vector<std::uint32_t> _M_ranks;
+  std::size_t _M_size = 0;
+  std::uint64_t _M_last = 0;
+
+  // In-order traversal, so every subtree holds the keys between its
+  // neighbouring keys in the parent. The slots past the last key are padded.
+  template <typename _Key>
+  void _M_fill(std::size_t __k, std::size_t &__rank, _Key &__key) {
+    constexpr auto __width = _Address_tree::_S_width;
+    if (__k >= _M_nodes.size())
+      return;
+    for (unsigned __i = 0; __i <= __width; ++__i) {
+      _M_fill(_Address_tree::_S_child(__k, __i), __rank, __key);
+      if (__i == __width)
+        break;
+      auto &__slot = _M_nodes[__k]._M_keys[__i];
+      if (__rank < _M_size) {
+        __slot = std::uint64_t(__key(__rank));
+        _M_ranks[__k * __width + __i] = std::uint32_t(__rank++);
+      } else {
+        __slot = std::uint64_t(-1);
+      }
+    }
+  }
+};
+
+} // namespace __detail
+
+} // namespace fbbe
+
+#endif // _FBBE_BITS_ADDRESS_TABLE_H
@@ -0,0 +1,233 @@
+// Copyright Fabian Keßler 2022 - 2023.
+
+// Compact stacktrace storage -*- C++ -*-
+// Internal header, included by fbbe/stacktrace.h. Do not include directly.
+
+// compact_stacktrace keeps the frames of a trace for long-term storage. Each
+// program counter is stored as the difference to the previous one, zigzag
+// encoded and written as a LEB128 varint. Frames of one module are a few
+// kilobytes to megabytes apart, so most take two to four bytes instead of
+// eight. The encoding is canonical: equal traces have equal bytes, so
+// comparison and hashing work on the bytes without decoding them.
+
+#pragma once
+#ifndef _FBBE_BITS_COMPACT_STACKTRACE_H
+#define _FBBE_BITS_COMPACT_STACKTRACE_H 1
+
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <new>
+
+namespace fbbe {
+
+// [fbbe.compact], compact stacktrace storage
+
+class compact_stacktrace {
+public:
+  using size_type = unsigned short;
+
+  compact_stacktrace() noexcept = default;
+
+  // Empty if the memory could not be allocated.
+  explicit compact_stacktrace(stacktrace_view __frames) noexcept {
+    const size_t __n = std::min<size_t>(__frames.size(), size_type(-1));
+    // The upper bound, 10 bytes per frame, lives on the stack.
+    constexpr size_t __chunk = 64;
+    unsigned char __buf[__chunk * _S_max_varint];
+    size_t __bytes = 0;
+    for (size_t __i = 0; __i < __n; __i += __chunk)
+      __bytes += _S_encode(__frames, __i, std::min(__n, __i + __chunk), __buf);
+    if (__bytes == 0)
+      return;
+    _M_data.reset(new (std::nothrow) unsigned char[__bytes]);
+    if (!_M_data)
+      return;
+    for (size_t __i = 0, __pos = 0; __i < __n; __i += __chunk) {
+      const auto __m =
+          _S_encode(__frames, __i, std::min(__n, __i + __chunk), __buf);
+      std::memcpy(_M_data.get() + __pos, __buf, __m);
+      __pos += __m;
+    }
+    _M_bytes = std::uint32_t(__bytes);
+    _M_size = size_type(__n);
+  }
+
+  template <typename _Allocator>
+  explicit compact_stacktrace(const basic_stacktrace<_Allocator> &__st) noexcept
+      : compact_stacktrace(stacktrace_view(__st.begin(), __st.size())) {}
+
+  compact_stacktrace(const compact_stacktrace &__other) noexcept {
+    *this = __other;
+  }
+
+  compact_stacktrace(compact_stacktrace &&__other) noexcept
+      : _M_data(std::move(__other._M_data)),
+        _M_bytes(std::exchange(__other._M_bytes, 0)),
+        _M_size(std::exchange(__other._M_size, 0)) {}
+
+  compact_stacktrace &operator=(const compact_stacktrace &__other) noexcept {
+    if (this == &__other)
+      return *this;
+    std::unique_ptr<unsigned char[]> __data;
+    if (__other._M_bytes) {
+      __data.reset(new (std::nothrow) unsigned char[__other._M_bytes]);
+      if (!__data) {
+        clear();
+        return *this;
+      }
+      std::memcpy(__data.get(), __other._M_data.get(), __other._M_bytes);
+    }
+    _M_data = std::move(__data);
+    _M_bytes = __other._M_bytes;
+    _M_size = __other._M_size;
+    return *this;
+  }
+
+  compact_stacktrace &operator=(compact_stacktrace &&__other) noexcept {
+    _M_data = std::move(__other._M_data);
+    _M_bytes = std::exchange(__other._M_bytes, 0);
+    _M_size = std::exchange(__other._M_size, 0);
+    return *this;
+  }
+
+  [[nodiscard]] bool empty() const noexcept { return _M_size == 0; }
+  size_type size() const noexcept { return _M_size; }
+
+  // Size of the encoded frames.
+  size_t encoded_size() const noexcept { return _M_bytes; }
+
+  // Writes the program counters of at most __size frames to __buffer and
+  // returns how many were written. Does not allocate.
+  size_t decode(stacktrace_entry::native_handle_type *__buffer,
+                size_t __size) const noexcept {
+    const size_t __n = std::min<size_t>(__size, _M_size);
+    _Reader{_M_data.get(), 0}._M_read(__buffer, __n);
+    return __n;
+  }
+
+  // Decodes the frames into a basic_stacktrace, which is empty if the
+  // memory could not be allocated.
+  template <typename _Allocator = std::allocator<stacktrace_entry>>
+  basic_stacktrace<_Allocator>
+  to_stacktrace(const _Allocator &__alloc = _Allocator()) const noexcept {
+    basic_stacktrace<_Allocator> __st(__alloc);
+    if (empty())
+      return __st;
+    auto __cb = __st._M_prepare(_M_size);
+    if (!__cb)
+      return __st;
+    constexpr size_t __chunk = 64;
+    stacktrace_entry::native_handle_type __pcs[__chunk];
+    _Reader __r{_M_data.get(), 0};
+    for (size_t __i = 0; __i < _M_size; __i += __chunk) {
+      const size_t __m = std::min<size_t>(__chunk, _M_size - __i);
+      __r._M_read(__pcs, __m);
+      for (size_t __j = 0; __j < __m; ++__j)
+        if (__cb(&__st, __pcs[__j]) != 0)
+          return __st;
+    }
+    return __st;
+  }
+
+  void clear() noexcept {
+    _M_data.reset();
+    _M_bytes = 0;
+    _M_size = 0;
+  }
+
+  void swap(compact_stacktrace &__other) noexcept {
+    std::swap(_M_data, __other._M_data);
+    std::swap(_M_bytes, __other._M_bytes);
+    std::swap(_M_size, __other._M_size);
+  }
+
+  friend bool operator==(const compact_stacktrace &__x,
+                         const compact_stacktrace &__y) noexcept {
+    return __x._M_size == __y._M_size && __x._M_bytes == __y._M_bytes &&
+           (__x._M_bytes == 0 ||
+            std::memcmp(__x._M_data.get(), __y._M_data.get(), __x._M_bytes) ==
+                0);
+  }
+
+  friend bool operator!=(const compact_stacktrace &__x,
+                         const compact_stacktrace &__y) noexcept {
+    return !(__x == __y);
+  }
+
+private:
+  template <typename> friend struct std::hash;
+
+  static constexpr size_t _S_max_varint = 10;
+
+  std::unique_ptr<unsigned char[]> _M_data;
+  std::uint32_t _M_bytes = 0;
+  size_type _M_size = 0;
+
+  size_t _M_hash() const noexcept {
+    std::uint64_t __h = _M_size * 0x9e3779b97f4a7c15ull;
+    for (size_t __i = 0; __i < _M_bytes; __i += 8) {
+      std::uint64_t __w = 0;
+      std::memcpy(&__w, _M_data.get() + __i,
+                  std::min<size_t>(8, _M_bytes - __i));
+      __h ^= __w;
+      __h *= 0xff51afd7ed558ccdull;
+      __h ^= __h >> 32;
+    }
+    return size_t(__h);
+  }
+
+  struct _Reader {
+    const unsigned char *_M_pos;
+    std::uint64_t _M_pc;
+
+    void _M_read(stacktrace_entry::native_handle_type *__out,
+                 size_t __n) noexcept {
+      for (size_t __i = 0; __i < __n; ++__i) {
+        std::uint64_t __v = 0;
+        for (unsigned __shift = 0;; __shift += 7) {
+          const unsigned char __byte = *_M_pos++;
+          __v |= std::uint64_t(__byte & 0x7f) << __shift;
+          if (!(__byte & 0x80))
+            break;
+        }
+        _M_pc += (__v >> 1) ^ -(__v & 1);
+        __out[__i] = stacktrace_entry::native_handle_type(_M_pc);
+      }
+    }
+  };
+
+  // Encodes the frames [__first, __last) into __out, returns the bytes.
+  static size_t _S_encode(stacktrace_view __frames, size_t __first,
+                          size_t __last, unsigned char *__out) noexcept {
+    std::uint64_t __prev =
+        __first ? std::uint64_t(__frames[__first - 1].native_handle()) : 0;
+    unsigned char *__p = __out;
+    for (size_t __i = __first; __i < __last; ++__i) {
+      const auto __pc = std::uint64_t(__frames[__i].native_handle());
+      const auto __delta = std::int64_t(__pc - __prev);
+      std::uint64_t __v =
+          (std::uint64_t(__delta) << 1) ^ std::uint64_t(__delta >> 63);
+      for (; __v >= 0x80; __v >>= 7)
+        *__p++ = static_cast<unsigned char>(__v | 0x80);
+      *__p++ = static_cast<unsigned char>(__v);
+      __prev = __pc;
+    }
+    return size_t(__p - __out);
+  }
+};
+
+inline void swap(compact_stacktrace &__a, compact_stacktrace &__b) noexcept {
+  __a.swap(__b);
+}
+
+} // namespace fbbe
+
+template <> struct std::hash<fbbe::compact_stacktrace> {
+  size_t operator()(const fbbe::compact_stacktrace &__st) const noexcept {
+    return __st._M_hash();
+  }
+};
+
+#endif // _FBBE_BITS_COMPACT_STACKTRACE_H
@@ -0,0 +1,273 @@
+// Copyright Fabian Keßler 2022 - 2023.
+
+// Fatal signal handler -*- C++ -*-
+// Internal header, included by fbbe/stacktrace.h. Do not include directly.
+
+// crash_handler writes the stack of a thread that received a fatal signal to
+// a file descriptor opened in advance, then hands the signal on to the
+// handler installed before it (or to the default action). Everything the
+// handler needs is set up by install(): the alternate signal stack, the
+// frame buffer, the module map used for the raw output, and libgcc's
+// unwinder, whose first use may load a library. The handler itself then
+// only unwinds into static storage and calls write(2).
+
+#pragma once
+#ifndef _FBBE_BITS_CRASH_HANDLER_H
+#define _FBBE_BITS_CRASH_HANDLER_H 1
+
+#if _FBBE_MODULES && __has_include(<signal.h>) &&                             \
+    __has_include(<sys/mman.h>) && __has_include(<unistd.h>)
+#define _FBBE_CRASH_HANDLER 1
+#else
+#define _FBBE_CRASH_HANDLER 0
+#endif
+
+#if _FBBE_CRASH_HANDLER
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <iterator>
+
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace fbbe {
+
+// [fbbe.crash], fatal signal handler
+
+struct crash_handler_options {
+  // Receives the report; must stay open.
+  int fd = STDERR_FILENO;
+  // Resolve function names, files and lines. This reads the debug
+  // information and allocates, which is not async-signal-safe and can hang
+  // if the crash happened inside malloc. Without it, frames are written as
+  // "0x<pc> <module>+0x<offset>" for fbbe_symbolize or addr2line.
+  bool symbolize = false;
+  size_t max_frames = 128;
+  // Size of the alternate signal stack of each prepared thread.
+  size_t alternate_stack_size = 64 * 1024;
+};
+
+class crash_handler {
+public:
+  // Installs the handler for SIGSEGV, SIGBUS, SIGFPE, SIGILL and SIGABRT
+  // and prepares the calling thread. Installing again replaces the options.
+  // Returns false if a handler could not be installed.
+  static bool install(const crash_handler_options &__options = {}) {
+    auto &__s = _S_state();
+    __s._M_options = __options;
+    __s._M_options.max_frames = std::min(__options.max_frames, _S_max_frames);
+    // Warm up everything the handler uses.
+    stacktrace_entry::native_handle_type __pc;
+    capture_current(&__pc, 1);
+    module_map::current();
+#if _FBBE_ORC_UNWINDER
+    __detail::_Orc_registry::_S_instance()._M_load_all();
+#endif
+    if (__s._M_options.symbolize)
+      stacktrace_preload();
+    if (!prepare_thread())
+      return false;
+
+    bool __ok = true;
+    for (size_t __i = 0; __i < _S_signal_count; ++__i) {
+      if (__s._M_installed[__i])
+        continue;
+      struct sigaction __action;
+      std::memset(&__action, 0, sizeof(__action));
+      __action.sa_sigaction = _S_handle;
+      __action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+      sigemptyset(&__action.sa_mask);
+      __s._M_installed[__i] = ::sigaction(_S_signals[__i], &__action,
+                                          &__s._M_previous[__i]) == 0;
+      __ok &= __s._M_installed[__i];
+    }
+    return __ok;
+  }
+
+  // Restores the handlers that were installed before install().
+  static void uninstall() noexcept {
+    auto &__s = _S_state();
+    for (size_t __i = 0; __i < _S_signal_count; ++__i)
+      if (__s._M_installed[__i]) {
+        ::sigaction(_S_signals[__i], &__s._M_previous[__i], nullptr);
+        __s._M_installed[__i] = false;
+      }
+  }
+
+  // Gives the calling thread an alternate signal stack, so a stack overflow
+  // can be reported. The alternate stack is per thread: call this at the
+  // start of every thread that should survive one. install() prepares the
+  // thread that calls it.
+  static bool prepare_thread() {
+    thread_local _Alternate_stack __stack;
+#if _FBBE_CONTEXT_UNWIND
+    // Looks up the stack bounds of the thread, which may allocate.
+    ucontext_t __uc;
+    stacktrace_entry::native_handle_type __pc;
+    if (::getcontext(&__uc) == 0)
+      capture_from_context(__uc, &__pc, 1);
+#endif
+    return __stack._M_prepare(_S_state()._M_options.alternate_stack_size);
+  }
+
+private:
+  static constexpr int _S_signals[] = {SIGSEGV, SIGBUS, SIGFPE, SIGILL,
+                                       SIGABRT};
+  static constexpr size_t _S_signal_count = std::size(_S_signals);
+  static constexpr size_t _S_max_frames = 256;
+
+  struct _State {
+    crash_handler_options _M_options;
+    struct sigaction _M_previous[_S_signal_count];
+    bool _M_installed[_S_signal_count] = {};
+    // Set by the first thread that reports a crash.
+    std::atomic<bool> _M_crashing{false};
+    stacktrace_entry::native_handle_type _M_pcs[_S_max_frames];
+    stacktrace_entry _M_frames[_S_max_frames];
+  };
+
+  // Never destroyed, a crash may happen while the program exits.
+  static _State &_S_state() {
+    static _State *__state = new _State();
+    return *__state;
+  }
+
+  class _Alternate_stack {
+    void *_M_memory = nullptr;
+    size_t _M_size = 0;
+
+  public:
+    bool _M_prepare(size_t __size) {
+      if (_M_memory)
+        return true;
+      stack_t __current;
+      if (::sigaltstack(nullptr, &__current) == 0 &&
+          !(__current.ss_flags & SS_DISABLE))
+        return true; // the thread has one already
+      __size = std::max<size_t>(__size, MINSIGSTKSZ);
+      void *__p = ::mmap(nullptr, __size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (__p == MAP_FAILED)
+        return false;
+      stack_t __stack;
+      __stack.ss_sp = __p;
+      __stack.ss_size = __size;
+      __stack.ss_flags = 0;
+      if (::sigaltstack(&__stack, nullptr) != 0) {
+        ::munmap(__p, __size);
+        return false;
+      }
+      _M_memory = __p;
+      _M_size = __size;
+      return true;
+    }
+
+    ~_Alternate_stack() {
+      if (!_M_memory)
+        return;
+      stack_t __stack;
+      std::memset(&__stack, 0, sizeof(__stack));
+      __stack.ss_flags = SS_DISABLE;
+      ::sigaltstack(&__stack, nullptr);
+      ::munmap(_M_memory, _M_size);
+    }
+  };
+
+  static const char *_S_name(int __sig) noexcept {
+    switch (__sig) {
+    case SIGSEGV:
+      return "SIGSEGV";
+    case SIGBUS:
+      return "SIGBUS";
+    case SIGFPE:
+      return "SIGFPE";
+    case SIGILL:
+      return "SIGILL";
+    case SIGABRT:
+      return "SIGABRT";
+    }
+    return "signal";
+  }
+
+  static size_t _S_capture(_State &__s, const void *__context) noexcept {
+    const size_t __max = __s._M_options.max_frames;
+#if _FBBE_CONTEXT_UNWIND
+    // Looking up the stack bounds of a thread that was not prepared could
+    // lock or allocate.
+    if (__context)
+      return orc_unwinder_t::_S_capture(
+          *static_cast<const ucontext_t *>(__context), __s._M_pcs, __max,
+          false);
+#endif
+    // Includes the handler and the signal trampoline.
+    return capture_current(__s._M_pcs, __max);
+  }
+
+  static void _S_report(_State &__s, int __sig, const siginfo_t *__info,
+                        const void *__context) noexcept {
+    const int __fd = __s._M_options.fd;
+    __detail::_Fd_writer __w(__fd);
+    auto __out = __detail::_Format::_S_padded(__w._M_out(), "*** ", 0);
+    __out = __detail::_Format::_S_padded(__out, _S_name(__sig), 0);
+    __out = __detail::_Format::_S_padded(__out, " (", 0);
+    __out = __detail::_Format::_S_number(__out, __sig, 0);
+    __out = __detail::_Format::_S_padded(__out, ") at ", 0);
+    __out = __detail::_Format::_S_address(
+        __out, reinterpret_cast<__UINTPTR_TYPE__>(__info ? __info->si_addr
+                                                         : nullptr));
+    __out = __detail::_Format::_S_padded(__out, ", pid ", 0);
+    __out = __detail::_Format::_S_number(__out, ::getpid(), 0);
+    __detail::_Format::_S_padded(__out, " ***\n", 0);
+    __w._M_flush();
+
+    // The report starts at the interrupted function.
+    const size_t __n = _S_capture(__s, __context);
+    for (size_t __i = 0; __i < __n; ++__i)
+      __s._M_frames[__i]._M_pc = __s._M_pcs[__i];
+
+    write_options __options;
+    __options.raw = !__s._M_options.symbolize;
+    __detail::_S_write_stacktrace(__fd, __s._M_frames, __n, __options);
+  }
+
+  static void _S_handle(int __sig, siginfo_t *__info, void *__context) {
+    const int __saved_errno = errno;
+    auto &__s = _S_state();
+    if (!__s._M_crashing.exchange(true))
+      _S_report(__s, __sig, __info, __context);
+
+    // Hand the signal on to the previous handler.
+    size_t __i = 0;
+    while (__i + 1 < _S_signal_count && _S_signals[__i] != __sig)
+      ++__i;
+    const struct sigaction &__previous = __s._M_previous[__i];
+    errno = __saved_errno;
+    if (__previous.sa_flags & SA_SIGINFO) {
+      if (__previous.sa_sigaction) {
+        __previous.sa_sigaction(__sig, __info, __context);
+        return;
+      }
+    } else if (__previous.sa_handler != SIG_DFL &&
+               __previous.sa_handler != SIG_IGN) {
+      __previous.sa_handler(__sig);
+      return;
+    }
+    // Default action: a fault happens again when the instruction is
+    // retried, other signals are raised again once this handler returns.
+    ::sigaction(__sig, &__previous, nullptr);
+    if (__previous.sa_handler == SIG_IGN)
+      ::signal(__sig, SIG_DFL);
+    ::raise(__sig);
+  }
+};
+
+} // namespace fbbe
+
+#endif // _FBBE_CRASH_HANDLER
+
+#endif // _FBBE_BITS_CRASH_HANDLER_H
@@ -0,0 +1,301 @@
+// Copyright Fabian Keßler 2022 - 2023.
+
+// Loaded modules of the process -*- C++ -*-
+// Internal header, included by fbbe/stacktrace.h. Do not include directly.
+
+// Describes the executable and shared libraries mapped into the process, so
+// program counters can be stored relative to the module containing them and
+// resolved later against the file on disk.
+//
+// The modules are kept in an immutable snapshot sorted by address, which is
+// published through an atomic pointer. Lookups in a snapshot take no locks.
+// A new snapshot is only built when the loader reports that a module was
+// loaded or unloaded (glibc's dlpi_adds and dlpi_subs). Replaced snapshots
+// are never freed, so a snapshot obtained once stays valid; only the (rare)
+// dlopen() and dlclose() calls make the memory used grow.
+
+#pragma once
+#ifndef _FBBE_BITS_MODULES_H
+#define _FBBE_BITS_MODULES_H 1
+
+#if __has_include(<link.h>)
+#include <link.h>
+#define _FBBE_MODULES 1
+#else
+#define _FBBE_MODULES 0
+#endif
+
+#if _FBBE_MODULES
+
+#include "address_table.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#if __has_include(<unistd.h>)
+#include <unistd.h>
+#endif
+
+namespace fbbe {
+
+namespace __detail {
+
+// Appends the lowercase hex digits of __size bytes.
+inline void _S_append_hex(std::string &__out, const unsigned char *__p,
+                          std::size_t __size) {
+  constexpr char __digits[] = "0123456789abcdef";
+  for (std::size_t __i = 0; __i < __size; ++__i) {
+    __out += __digits[__p[__i] >> 4];
+    __out += __digits[__p[__i] & 0xf];
+  }
+}
+
+// Returns the GNU build-id found in a PT_NOTE segment, as hex digits, or an
+// empty string.
+inline std::string _S_build_id(const unsigned char *__notes,
+                               std::size_t __size) {
+  constexpr auto __align = [](std::size_t __n) {
+    return (__n + 3) & ~std::size_t(3);
+  };
+  std::size_t __pos = 0;
+  while (__pos + 12 <= __size) {
+    std::uint32_t __namesz, __descsz, __type;
+    std::memcpy(&__namesz, __notes + __pos, 4);
+    std::memcpy(&__descsz, __notes + __pos + 4, 4);
+    std::memcpy(&__type, __notes + __pos + 8, 4);
+    const auto __name = __pos + 12;
+    const auto __desc = __name + __align(__namesz);
+    const auto __next = __desc + __align(__descsz);
+    if (__next > __size || __next <= __pos)
+      break;
+    if (__type == 3 /* NT_GNU_BUILD_ID */ && __namesz == 4 &&
+        std::memcmp(__notes + __name, "GNU", 4) == 0) {
+      std::string __id;
+      _S_append_hex(__id, __notes + __desc, __descsz);
+      return __id;
+    }
+    __pos = __next;
+  }
+  return {};
+}
+
+// Number of modules loaded and unloaded since the program started, or zeros
+// if the loader does not tell.
+struct _Load_counters {
+  unsigned long long _M_adds = 0;
+  unsigned long long _M_subs = 0;
+
+  static _Load_counters _S_read() noexcept {
+    _Load_counters __c;
+#if defined(__GLIBC__)
+    dl_iterate_phdr(
+        [](dl_phdr_info *__info, size_t __size, void *__data) -> int {
+          if (__size >= offsetof(dl_phdr_info, dlpi_subs) +
+                            sizeof(__info->dlpi_subs)) {
+            auto &__c = *static_cast<_Load_counters *>(__data);
+            __c._M_adds = __info->dlpi_adds;
+            __c._M_subs = __info->dlpi_subs;
+          }
+          return 1;
+        },
+        &__c);
+#endif
+    return __c;
+  }
+
+  friend bool operator==(const _Load_counters &__x,
+                         const _Load_counters &__y) noexcept {
+    return __x._M_adds == __y._M_adds && __x._M_subs == __y._M_subs;
+  }
+};
+
+} // namespace __detail
+
+// [fbbe.modules], loaded modules
+
+struct module_info {
+  std::string path;
+  // GNU build-id as hex digits, empty if the module has none.
+  std::string build_id;
+  // Difference between the run-time and the link-time addresses.
+  std::uintptr_t base = 0;
+  // Run-time address range [start, end) spanned by the loadable segments.
+  std::uintptr_t start = 0;
+  std::uintptr_t end = 0;
+};
+
+// Immutable snapshot of the modules loaded into the process.
+class module_map {
+public:
+  using const_iterator = std::vector<module_info>::const_iterator;
+
+  // Returns the current snapshot, building a new one if modules were loaded
+  // or unloaded since the last call. The snapshot stays valid until the end
+  // of the program. Without glibc, changes are only picked up by refresh().
+  static const module_map &current() {
+    const auto *__map = _S_current.load(std::memory_order_acquire);
+    if (__map && __map->_M_counters == __detail::_Load_counters::_S_read())
+      return *__map;
+    return _S_registry()._M_rebuild(__map);
+  }
+
+  // Builds a new snapshot unconditionally.
+  static const module_map &refresh() {
+    return _S_registry()._M_rebuild(
+        _S_current.load(std::memory_order_acquire));
+  }
+
+  // Returns the snapshot built last, without checking whether modules were
+  // loaded since, or nullptr if none was built yet. Takes no locks and does
+  // not allocate, so it can be called from signal handlers.
+  static const module_map *last() noexcept {
+    return _S_current.load(std::memory_order_acquire);
+  }
+
+  // Like find() for each of the __n addresses, but searches the snapshot
+  // built last and only asks the loader for changes, like current(), when
+  // an address is in none of its modules. Modules unloaded since stay
+  // found, as traces captured before the dlclose() expect. Returns the
+  // snapshot searched. Meant for callers that look up many addresses, as
+  // current() takes the loader's lock on every call.
+  static const module_map &find_cached(const std::uintptr_t *__pcs,
+                                       std::size_t __n,
+                                       const module_info **__out) {
+    const auto *__map = last();
+    if (!__map)
+      __map = &current();
+    __map->find(__pcs, __n, __out);
+    if (std::find(__out, __out + __n, nullptr) == __out + __n)
+      return *__map;
+    const auto *__next = &current();
+    if (__next != __map)
+      __next->find(__pcs, __n, __out);
+    return *__next;
+  }
+
+  // Returns the module containing __pc, or nullptr.
+  const module_info *find(std::uintptr_t __pc) const noexcept {
+    return _M_at(_M_table._M_find(__pc), __pc);
+  }
+
+  // Like find() for each of the __n addresses at __pcs, e.g. the frames of
+  // a stacktrace, stores the modules in __out. Searches the addresses side
+  // by side, which hides most of the cache misses.
+  void find(const std::uintptr_t *__pcs, std::size_t __n,
+            const module_info **__out) const {
+    constexpr std::size_t __chunk = 64;
+    std::size_t __ranks[__chunk];
+    for (std::size_t __i = 0; __i < __n; __i += __chunk) {
+      const auto __m = std::min(__chunk, __n - __i);
+      _M_table._M_find(__pcs + __i, __m, __ranks);
+      for (std::size_t __j = 0; __j < __m; ++__j)
+        __out[__i + __j] = _M_at(__ranks[__j], __pcs[__i + __j]);
+    }
+  }
+
+  const_iterator begin() const noexcept { return _M_modules.begin(); }
+  const_iterator end() const noexcept { return _M_modules.end(); }
+  std::size_t size() const noexcept { return _M_modules.size(); }
+
+private:
+  std::vector<module_info> _M_modules;
+  // Start addresses, laid out so the search touches few cache lines.
+  __detail::_Address_table _M_table;
+  __detail::_Load_counters _M_counters;
+  const module_map *_M_previous = nullptr;
+
+  const module_info *_M_at(std::size_t __rank,
+                           std::uintptr_t __pc) const noexcept {
+    if (__rank == __detail::_Address_table::_S_npos)
+      return nullptr;
+    const auto &__m = _M_modules[__rank];
+    return __pc < __m.end ? &__m : nullptr;
+  }
+
+  // Constant initialized, so last() works at any time.
+  static inline std::atomic<const module_map *> _S_current{nullptr};
+
+  struct _Registry {
+    std::mutex _M_mutex;
+
+    const module_map &_M_rebuild(const module_map *__stale) {
+      std::lock_guard<std::mutex> __lock(_M_mutex);
+      const auto *__map = _S_current.load(std::memory_order_relaxed);
+      // Another thread may have rebuilt it in the meantime.
+      if (__map && __map != __stale &&
+          __map->_M_counters == __detail::_Load_counters::_S_read())
+        return *__map;
+      auto *__next = new module_map;
+      __next->_M_build();
+      __next->_M_previous = __map;
+      _S_current.store(__next, std::memory_order_release);
+      return *__next;
+    }
+  };
+
+  // Never destroyed, so snapshots can be used while the program exits.
+  static _Registry &_S_registry() {
+    static _Registry *__registry = new _Registry;
+    return *__registry;
+  }
+
+  void _M_build() {
+    _M_counters = __detail::_Load_counters::_S_read();
+    dl_iterate_phdr(
+        [](dl_phdr_info *__info, size_t, void *__data) -> int {
+          module_info __m;
+          __m.base = __info->dlpi_addr;
+          __m.start = std::uintptr_t(-1);
+          for (int __i = 0; __i < __info->dlpi_phnum; ++__i) {
+            const auto &__ph = __info->dlpi_phdr[__i];
+            const auto __addr = __info->dlpi_addr + __ph.p_vaddr;
+            if (__ph.p_type == PT_LOAD) {
+              __m.start = std::min<std::uintptr_t>(__m.start, __addr);
+              __m.end =
+                  std::max<std::uintptr_t>(__m.end, __addr + __ph.p_memsz);
+            } else if (__ph.p_type == PT_NOTE && __m.build_id.empty()) {
+              __m.build_id = __detail::_S_build_id(
+                  reinterpret_cast<const unsigned char *>(__addr),
+                  __ph.p_memsz);
+            }
+          }
+          if (__m.start >= __m.end)
+            return 0;
+          if (__info->dlpi_name && __info->dlpi_name[0])
+            __m.path = __info->dlpi_name;
+#if __has_include(<unistd.h>) && defined(__linux__)
+          else {
+            char __buf[4096];
+            const auto __n =
+                ::readlink("/proc/self/exe", __buf, sizeof(__buf));
+            if (__n > 0)
+              __m.path.assign(__buf, __n);
+          }
+#endif
+          static_cast<module_map *>(__data)->_M_modules.push_back(
+              std::move(__m));
+          return 0;
+        },
+        this);
+    std::sort(_M_modules.begin(), _M_modules.end(),
+              [](const module_info &__x, const module_info &__y) {
+                return __x.start < __y.start;
+              });
+    _M_table._M_assign(_M_modules.size(), [this](std::size_t __i) {
+      return _M_modules[__i].start;
+    });
+  }
+};
+
+} // namespace fbbe
+
+#endif // _FBBE_MODULES
+
+#endif // _FBBE_BITS_MODULES_H
@@ -0,0 +1,123 @@
+// Copyright Fabian Keßler 2022 - 2023.
+
+// Interned demangled names -*- C++ -*-
+// Internal header, included by fbbe/stacktrace.h. Do not include directly.
+
+// Symbol names handed out by libbacktrace stay valid for the lifetime of the
+// process, so they are used as keys directly. Each name is demangled once and
+// copied into an append-only arena; later queries return a view into it
+// without calling __cxa_demangle or allocating.
+
+#pragma once
+#ifndef _FBBE_BITS_NAME_POOL_H
+#define _FBBE_BITS_NAME_POOL_H 1
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace __cxxabiv1 {
+extern "C" char *__cxa_demangle(const char *__mangled_name,
+                                char *__output_buffer, size_t *__length,
+                                int *__status);
+}
+
+#if __has_builtin(__builtin_free)
+#define _FBBE_GNU_FREE __builtin_free
+#else
+#define _FBBE_GNU_FREE std::free
+#endif
+
+namespace fbbe {
+
+namespace __detail {
+
+class _Name_pool {
+  static constexpr std::size_t _S_shards = 16;
+  static constexpr std::size_t _S_chunk_size = 64 * 1024;
+
+  struct alignas(64) _Shard {
+    std::shared_mutex _M_mutex;
+    std::unordered_map<const char *, std::string_view> _M_map;
+  };
+
+  _Shard _M_shards[_S_shards];
+
+  std::mutex _M_arena_mutex;
+  std::vector<std::unique_ptr<char[]>> _M_chunks;
+  char *_M_cur = nullptr;
+  std::size_t _M_left = 0;
+
+  _Shard &_M_shard(const char *__name) noexcept {
+    const auto __h = (reinterpret_cast<std::uintptr_t>(__name) >> 3) *
+                     0x9e3779b97f4a7c15ull;
+    return _M_shards[__h >> 60];
+  }
+
+  // Copies __s into the arena. Names larger than a quarter of a chunk get
+  // their own block, so starting a new chunk never wastes more than a
+  // quarter of the old one.
+  std::string_view _M_store(const char *__s, std::size_t __n) {
+    std::lock_guard<std::mutex> __lock(_M_arena_mutex);
+    char *__p;
+    if (__n > _S_chunk_size / 4) {
+      _M_chunks.emplace_back(new char[__n]);
+      __p = _M_chunks.back().get();
+    } else {
+      if (__n > _M_left) {
+        _M_chunks.emplace_back(new char[_S_chunk_size]);
+        _M_cur = _M_chunks.back().get();
+        _M_left = _S_chunk_size;
+      }
+      __p = _M_cur;
+      _M_cur += __n;
+      _M_left -= __n;
+    }
+    std::memcpy(__p, __s, __n);
+    return {__p, __n};
+  }
+
+public:
+  static _Name_pool &_S_instance() noexcept {
+    static _Name_pool __pool;
+    return __pool;
+  }
+
+  // Returns the demangled form of __name, or __name itself if it is not a
+  // mangled name. __name must outlive the pool.
+  std::string_view _M_demangle(const char *__name) {
+    auto &__shard = _M_shard(__name);
+    {
+      std::shared_lock<std::shared_mutex> __lock(__shard._M_mutex);
+      const auto __it = __shard._M_map.find(__name);
+      if (__it != __shard._M_map.end())
+        return __it->second;
+    }
+
+    std::string_view __view = __name;
+    int __status;
+    char *__str =
+        __cxxabiv1::__cxa_demangle(__name, nullptr, nullptr, &__status);
+    if (__status == 0)
+      __view = _M_store(__str, std::strlen(__str));
+    _FBBE_GNU_FREE(__str);
+
+    // A concurrent caller may have won; its view is as good as ours, the
+    // copy in the arena is simply never referenced.
+    std::unique_lock<std::shared_mutex> __lock(__shard._M_mutex);
+    return __shard._M_map.try_emplace(__name, __view).first->second;
+  }
+};
+
+} // namespace __detail
+
+} // namespace fbbe
+
+#endif // _FBBE_BITS_NAME_POOL_H
@@ -0,0 +1,857 @@
+// Copyright Fabian Keßler 2022 - 2023.
+
+// Compact unwind tables for fbbe::orc_unwinder -*- C++ -*-
+// Internal header, included by fbbe/stacktrace.h. Do not include directly.
+
+// The .eh_frame call frame information of every loaded module is translated
+// once, on first use, into a sorted table of rows in the spirit of the Linux
+// kernel's ORC unwinder: every row states for a range of instructions how
+// to compute the canonical frame address (CFA) from the stack or frame
+// pointer, and where the return address and the caller's frame pointer are
+// saved relative to the CFA. Unwinding a frame is then a binary search and
+// up to two loads, instead of interpreting the CFI program each time.
+// Frames that cannot be described this way (CFA expressions, signal
+// trampolines, registers saved in other registers) are marked and handed
+// back to the default unwinder.
+
+#pragma once
+#ifndef _FBBE_BITS_ORC_UNWIND_H
+#define _FBBE_BITS_ORC_UNWIND_H 1
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#include <link.h>
+#include <time.h>
+
+#include "modules.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+#define _FBBE_ORC_UNWINDER 1
+
+namespace fbbe::__detail {
+
+struct _Orc_row {
+  enum : std::uint8_t {
+    _S_unknown = 0, // no usable unwind information, use the default unwinder
+    _S_frame = 1,   // regular frame
+    _S_end = 2,     // outermost frame, the return address is undefined
+  };
+
+  // DWARF register numbers on x86-64
+  enum : std::uint8_t { _S_rbp = 6, _S_rsp = 7, _S_ra = 16 };
+
+  std::int16_t _M_cfa_offset = 0; // CFA = _M_cfa_reg + _M_cfa_offset
+  std::int16_t _M_ra_offset = 0;  // return address at CFA + _M_ra_offset
+  std::int16_t _M_bp_offset = 0;  // saved rbp at CFA + offset, 0: unchanged
+  std::uint8_t _M_cfa_reg = 0;
+  std::uint8_t _M_kind = _S_unknown;
+
+  friend bool operator==(const _Orc_row &__x, const _Orc_row &__y) noexcept {
+    return __x._M_cfa_offset == __y._M_cfa_offset &&
+           __x._M_ra_offset == __y._M_ra_offset &&
+           __x._M_bp_offset == __y._M_bp_offset &&
+           __x._M_cfa_reg == __y._M_cfa_reg && __x._M_kind == __y._M_kind;
+  }
+};
+
+// Unwind table of one loaded module. _M_ips holds the start of every row
+// relative to _M_base, each row ends where the next one starts.
+struct _Orc_module {
+  std::uintptr_t _M_low = 0; // executable address range of the module
+  std::uintptr_t _M_high = 0;
+  std::uintptr_t _M_base = 0;
+  std::uint32_t _M_size = 0;
+  const std::uint32_t *_M_ips = nullptr;
+  const _Orc_row *_M_rows = nullptr;
+
+  const _Orc_row *_M_find(std::uintptr_t __pc) const noexcept {
+    const auto __ip = static_cast<std::uint32_t>(__pc - _M_base);
+    const auto __it = std::upper_bound(_M_ips, _M_ips + _M_size, __ip);
+    if (__it == _M_ips)
+      return nullptr;
+    return _M_rows + (__it - _M_ips - 1);
+  }
+};
+
+// Reads the DWARF encoded values of .eh_frame and .eh_frame_hdr.
+struct _Cfi_reader {
+  const unsigned char *_M_p;
+  const unsigned char *_M_end;
+  bool _M_ok = true;
+
+  bool _M_has(std::size_t __n) noexcept {
+    if (static_cast<std::size_t>(_M_end - _M_p) < __n)
+      _M_ok = false;
+    return _M_ok;
+  }
+
+  template <typename _Tp> _Tp _M_read() noexcept {
+    _Tp __v{};
+    if (_M_has(sizeof(_Tp))) {
+      std::memcpy(&__v, _M_p, sizeof(_Tp));
+      _M_p += sizeof(_Tp);
+    }
+    return __v;
+  }
+
+  std::uint64_t _M_uleb() noexcept {
+    std::uint64_t __v = 0;
+    for (unsigned __shift = 0; _M_has(1); __shift += 7) {
+      const unsigned char __b = *_M_p++;
+      if (__shift < 64)
+        __v |= std::uint64_t(__b & 0x7f) << __shift;
+      if (!(__b & 0x80))
+        break;
+    }
+    return __v;
+  }
+
+  std::int64_t _M_sleb() noexcept {
+    std::int64_t __v = 0;
+    unsigned __shift = 0;
+    unsigned char __b = 0;
+    while (_M_has(1)) {
+      __b = *_M_p++;
+      if (__shift < 64)
+        __v |= std::int64_t(__b & 0x7f) << __shift;
+      __shift += 7;
+      if (!(__b & 0x80))
+        break;
+    }
+    if (__shift < 64 && (__b & 0x40))
+      __v |= -(std::int64_t(1) << __shift);
+    return __v;
+  }
+
+  // DW_EH_PE_* pointer encodings
+  std::uintptr_t _M_pointer(std::uint8_t __enc,
+                            std::uintptr_t __datarel = 0) noexcept {
+    if (__enc == 0xff) // DW_EH_PE_omit
+      return 0;
+    std::uintptr_t __base = 0;
+    switch (__enc & 0x70) {
+    case 0x00: // DW_EH_PE_absptr
+      break;
+    case 0x10: // DW_EH_PE_pcrel
+      __base = reinterpret_cast<std::uintptr_t>(_M_p);
+      break;
+    case 0x30: // DW_EH_PE_datarel
+      __base = __datarel;
+      break;
+    case 0x50: { // DW_EH_PE_aligned
+      const auto __p = reinterpret_cast<std::uintptr_t>(_M_p);
+      const auto __a = (__p + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+      _M_has(__a - __p);
+      _M_p += __a - __p;
+      break;
+    }
+    default: // DW_EH_PE_textrel, DW_EH_PE_funcrel
+      _M_ok = false;
+      return 0;
+    }
+    std::uintptr_t __v = 0;
+    switch (__enc & 0x0f) {
+    case 0x00:
+      __v = _M_read<std::uintptr_t>();
+      break;
+    case 0x01:
+      __v = _M_uleb();
+      break;
+    case 0x02:
+      __v = _M_read<std::uint16_t>();
+      break;
+    case 0x03:
+      __v = _M_read<std::uint32_t>();
+      break;
+    case 0x04:
+      __v = _M_read<std::uint64_t>();
+      break;
+    case 0x09:
+      __v = _M_sleb();
+      break;
+    case 0x0a:
+      __v = _M_read<std::int16_t>();
+      break;
+    case 0x0b:
+      __v = _M_read<std::int32_t>();
+      break;
+    case 0x0c:
+      __v = _M_read<std::int64_t>();
+      break;
+    default:
+      _M_ok = false;
+      return 0;
+    }
+    if (!_M_ok)
+      return 0;
+    __v += __base;
+    if (__enc & 0x80) // DW_EH_PE_indirect
+      std::memcpy(&__v, reinterpret_cast<const void *>(__v), sizeof(__v));
+    return __v;
+  }
+
+  void _M_skip(std::size_t __n) noexcept {
+    if (_M_has(__n))
+      _M_p += __n;
+  }
+};
+
+// Translates the CFI of one module into table rows.
+class _Orc_builder {
+  enum _Rule : std::uint8_t { _S_same, _S_offset, _S_undefined, _S_other };
+
+  struct _State {
+    std::uint64_t _M_cfa_reg = _Orc_row::_S_rsp;
+    std::int64_t _M_cfa_offset = 0;
+    bool _M_cfa_expr = false;
+    _Rule _M_ra_rule = _S_other;
+    std::int64_t _M_ra_offset = 0;
+    _Rule _M_bp_rule = _S_same;
+    std::int64_t _M_bp_offset = 0;
+  };
+
+  struct _Cie {
+    std::uint64_t _M_code_align = 1;
+    std::int64_t _M_data_align = 1;
+    std::uint64_t _M_ra_reg = _Orc_row::_S_ra;
+    std::uint8_t _M_fde_enc = 0;
+    bool _M_has_aug_data = false;
+    bool _M_signal_frame = false;
+    const unsigned char *_M_insns = nullptr;
+    const unsigned char *_M_insns_end = nullptr;
+  };
+
+  struct _Entry {
+    std::uintptr_t _M_pc;
+    _Orc_row _M_row;
+  };
+
+  std::vector<_Entry> _M_entries;
+  std::vector<_Entry> _M_fde_entries;
+  std::vector<_State> _M_stack;
+
+  // Reads the length of a CIE or FDE and returns the end of the record.
+  static const unsigned char *_S_record(_Cfi_reader &__r,
+                                        bool &__is64) noexcept {
+    std::uint64_t __len = __r._M_read<std::uint32_t>();
+    __is64 = __len == 0xffffffff;
+    if (__is64)
+      __len = __r._M_read<std::uint64_t>();
+    if (!__r._M_ok || __len == 0 || !__r._M_has(__len))
+      return nullptr;
+    return __r._M_p + __len;
+  }
+
+  static bool _S_parse_cie(const unsigned char *__p, _Cie &__cie) noexcept {
+    _Cfi_reader __r{__p, reinterpret_cast<const unsigned char *>(-1)};
+    bool __is64;
+    const auto __end = _S_record(__r, __is64);
+    if (!__end)
+      return false;
+    __r._M_end = __end;
+    const std::uint64_t __id = __is64 ? __r._M_read<std::uint64_t>()
+                                      : __r._M_read<std::uint32_t>();
+    if (__id != 0)
+      return false;
+    const auto __version = __r._M_read<std::uint8_t>();
+    const auto *__aug = reinterpret_cast<const char *>(__r._M_p);
+    while (__r._M_has(1) && *__r._M_p)
+      ++__r._M_p;
+    __r._M_skip(1);
+    if (__aug[0] == 'e' && __aug[1] == 'h')
+      __r._M_skip(sizeof(void *));
+    if (__version >= 4)
+      __r._M_skip(2); // address_size, segment_size
+    __cie._M_code_align = __r._M_uleb();
+    __cie._M_data_align = __r._M_sleb();
+    __cie._M_ra_reg = __version == 1 ? __r._M_read<std::uint8_t>()
+                                     : __r._M_uleb();
+    const unsigned char *__aug_end = nullptr;
+    for (const char *__c = __aug; *__c && __r._M_ok; ++__c) {
+      if (*__c == 'z') {
+        __cie._M_has_aug_data = true;
+        const auto __len = __r._M_uleb();
+        __aug_end = __r._M_p + __len;
+      } else if (*__c == 'L') {
+        __r._M_read<std::uint8_t>();
+      } else if (*__c == 'P') {
+        __r._M_pointer(__r._M_read<std::uint8_t>() & 0x7f);
+      } else if (*__c == 'R') {
+        __cie._M_fde_enc = __r._M_read<std::uint8_t>();
+      } else if (*__c == 'S') {
+        __cie._M_signal_frame = true;
+      } else if (*__c != 'e' && *__c != 'h') {
+        // Unknown augmentation, the rest of the data can only be skipped.
+        if (!__aug_end)
+          return false;
+        break;
+      }
+    }
+    if (__aug_end)
+      __r._M_p = __aug_end;
+    if (!__r._M_ok || __r._M_p > __end)
+      return false;
+    __cie._M_insns = __r._M_p;
+    __cie._M_insns_end = __end;
+    return true;
+  }
+
+  static void _S_set(_Rule &__rule, std::int64_t &__offset, _Rule __new_rule,
+                     std::int64_t __new_offset = 0) noexcept {
+    __rule = __new_rule;
+    __offset = __new_offset;
+  }
+
+  static void _S_set_reg(_State &__s, const _Cie &__cie, std::uint64_t __reg,
+                         _Rule __rule, std::int64_t __offset = 0) noexcept {
+    if (__reg == __cie._M_ra_reg)
+      _S_set(__s._M_ra_rule, __s._M_ra_offset, __rule, __offset);
+    else if (__reg == _Orc_row::_S_rbp)
+      _S_set(__s._M_bp_rule, __s._M_bp_offset, __rule, __offset);
+  }
+
+  static void _S_restore_reg(_State &__s, const _State &__initial,
+                             const _Cie &__cie, std::uint64_t __reg) noexcept {
+    if (__reg == __cie._M_ra_reg)
+      _S_set(__s._M_ra_rule, __s._M_ra_offset, __initial._M_ra_rule,
+             __initial._M_ra_offset);
+    else if (__reg == _Orc_row::_S_rbp)
+      _S_set(__s._M_bp_rule, __s._M_bp_offset, __initial._M_bp_rule,
+             __initial._M_bp_offset);
+  }
+
+  static bool _S_fits(std::int64_t __v) noexcept {
+    return __v >= INT16_MIN && __v <= INT16_MAX;
+  }
+
+  static _Orc_row _S_row(const _State &__s, const _Cie &__cie) noexcept {
+    _Orc_row __row;
+    if (__cie._M_signal_frame || __s._M_cfa_expr ||
+        (__s._M_cfa_reg != _Orc_row::_S_rsp &&
+         __s._M_cfa_reg != _Orc_row::_S_rbp) ||
+        !_S_fits(__s._M_cfa_offset))
+      return __row;
+    if (__s._M_ra_rule == _S_undefined) {
+      __row._M_kind = _Orc_row::_S_end;
+      return __row;
+    }
+    if (__s._M_ra_rule != _S_offset || !_S_fits(__s._M_ra_offset))
+      return __row;
+    if (__s._M_bp_rule == _S_offset) {
+      if (__s._M_bp_offset == 0 || !_S_fits(__s._M_bp_offset))
+        return __row;
+      __row._M_bp_offset = static_cast<std::int16_t>(__s._M_bp_offset);
+    } else if (__s._M_bp_rule == _S_other) {
+      return __row;
+    }
+    __row._M_cfa_reg = static_cast<std::uint8_t>(__s._M_cfa_reg);
+    __row._M_cfa_offset = static_cast<std::int16_t>(__s._M_cfa_offset);
+    __row._M_ra_offset = static_cast<std::int16_t>(__s._M_ra_offset);
+    __row._M_kind = _Orc_row::_S_frame;
+    return __row;
+  }
+
+  void _M_emit(std::uintptr_t __pc, const _Orc_row &__row) {
+    if (!_M_fde_entries.empty() && _M_fde_entries.back()._M_pc == __pc)
+      _M_fde_entries.back()._M_row = __row;
+    else
+      _M_fde_entries.push_back({__pc, __row});
+  }
+
+  // Runs a CFA program. Rows are emitted for FDE programs only.
+  bool _M_execute(_Cfi_reader __r, const _Cie &__cie, _State &__s,
+                  const _State &__initial, std::uintptr_t &__loc,
+                  bool __emit) {
+    _M_stack.clear();
+    auto __advance = [&](std::uintptr_t __new_loc) {
+      if (__emit)
+        _M_emit(__loc, _S_row(__s, __cie));
+      __loc = __new_loc;
+    };
+    while (__r._M_ok && __r._M_p < __r._M_end) {
+      const auto __op = __r._M_read<std::uint8_t>();
+      const auto __low = __op & 0x3f;
+      switch (__op & 0xc0) {
+      case 0x40: // DW_CFA_advance_loc
+        __advance(__loc + __low * __cie._M_code_align);
+        continue;
+      case 0x80: // DW_CFA_offset
+        _S_set_reg(__s, __cie, __low, _S_offset,
+                   std::int64_t(__r._M_uleb()) * __cie._M_data_align);
+        continue;
+      case 0xc0: // DW_CFA_restore
+        _S_restore_reg(__s, __initial, __cie, __low);
+        continue;
+      }
+      switch (__op) {
+      case 0x00: // DW_CFA_nop
+        break;
+      case 0x01: // DW_CFA_set_loc
+        __advance(__r._M_pointer(__cie._M_fde_enc));
+        break;
+      case 0x02: // DW_CFA_advance_loc1
+        __advance(__loc + __r._M_read<std::uint8_t>() * __cie._M_code_align);
+        break;
+      case 0x03: // DW_CFA_advance_loc2
+        __advance(__loc + __r._M_read<std::uint16_t>() * __cie._M_code_align);
+        break;
+      case 0x04: // DW_CFA_advance_loc4
+        __advance(__loc + __r._M_read<std::uint32_t>() * __cie._M_code_align);
+        break;
+      case 0x05: { // DW_CFA_offset_extended
+        const auto __reg = __r._M_uleb();
+        _S_set_reg(__s, __cie, __reg, _S_offset,
+                   std::int64_t(__r._M_uleb()) * __cie._M_data_align);
+        break;
+      }
+      case 0x06: // DW_CFA_restore_extended
+        _S_restore_reg(__s, __initial, __cie, __r._M_uleb());
+        break;
+      case 0x07: // DW_CFA_undefined
+        _S_set_reg(__s, __cie, __r._M_uleb(), _S_undefined);
+        break;
+      case 0x08: // DW_CFA_same_value
+        _S_set_reg(__s, __cie, __r._M_uleb(), _S_same);
+        break;
+      case 0x09: { // DW_CFA_register
+        const auto __reg = __r._M_uleb();
+        __r._M_uleb();
+        _S_set_reg(__s, __cie, __reg, _S_other);
+        break;
+      }
+      case 0x0a: // DW_CFA_remember_state
+        _M_stack.push_back(__s);
+        break;
+      case 0x0b: // DW_CFA_restore_state
+        if (_M_stack.empty())
+          return false;
+        __s = _M_stack.back();
+        _M_stack.pop_back();
+        break;
+      case 0x0c: // DW_CFA_def_cfa
+        __s._M_cfa_reg = __r._M_uleb();
+        __s._M_cfa_offset = std::int64_t(__r._M_uleb());
+        __s._M_cfa_expr = false;
+        break;
+      case 0x0d: // DW_CFA_def_cfa_register
+        __s._M_cfa_reg = __r._M_uleb();
+        __s._M_cfa_expr = false;
+        break;
+      case 0x0e: // DW_CFA_def_cfa_offset
+        __s._M_cfa_offset = std::int64_t(__r._M_uleb());
+        break;
+      case 0x0f: // DW_CFA_def_cfa_expression
+        __r._M_skip(__r._M_uleb());
+        __s._M_cfa_expr = true;
+        break;
+      case 0x10:   // DW_CFA_expression
+      case 0x16: { // DW_CFA_val_expression
+        const auto __reg = __r._M_uleb();
+        __r._M_skip(__r._M_uleb());
+        _S_set_reg(__s, __cie, __reg, _S_other);
+        break;
+      }
+      case 0x11: { // DW_CFA_offset_extended_sf
+        const auto __reg = __r._M_uleb();
+        _S_set_reg(__s, __cie, __reg, _S_offset,
+                   __r._M_sleb() * __cie._M_data_align);
+        break;
+      }
+      case 0x12: // DW_CFA_def_cfa_sf
+        __s._M_cfa_reg = __r._M_uleb();
+        __s._M_cfa_offset = __r._M_sleb() * __cie._M_data_align;
+        __s._M_cfa_expr = false;
+        break;
+      case 0x13: // DW_CFA_def_cfa_offset_sf
+        __s._M_cfa_offset = __r._M_sleb() * __cie._M_data_align;
+        break;
+      case 0x14:   // DW_CFA_val_offset
+      case 0x15: { // DW_CFA_val_offset_sf
+        const auto __reg = __r._M_uleb();
+        if (__op == 0x14)
+          __r._M_uleb();
+        else
+          __r._M_sleb();
+        _S_set_reg(__s, __cie, __reg, _S_other);
+        break;
+      }
+      case 0x2e: // DW_CFA_GNU_args_size
+        __r._M_uleb();
+        break;
+      case 0x2f: { // DW_CFA_GNU_negative_offset_extended
+        const auto __reg = __r._M_uleb();
+        _S_set_reg(__s, __cie, __reg, _S_offset,
+                   -std::int64_t(__r._M_uleb()) * __cie._M_data_align);
+        break;
+      }
+      default:
+        return false;
+      }
+    }
+    return __r._M_ok;
+  }
+
+  // Adds the rows of the FDE at __p. Returns false if the record is
+  // malformed and the rest of the section cannot be trusted.
+  bool _M_add_fde(const unsigned char *__p) {
+    _Cfi_reader __r{__p, reinterpret_cast<const unsigned char *>(-1)};
+    bool __is64;
+    const auto __end = _S_record(__r, __is64);
+    if (!__end)
+      return false;
+    __r._M_end = __end;
+    const auto *__id_field = __r._M_p;
+    const std::uint64_t __id = __is64 ? __r._M_read<std::uint64_t>()
+                                      : __r._M_read<std::uint32_t>();
+    if (__id == 0) // a CIE
+      return true;
+    _Cie __cie;
+    if (!_S_parse_cie(__id_field - __id, __cie))
+      return true;
+    const auto __begin = __r._M_pointer(__cie._M_fde_enc);
+    const auto __range = __r._M_pointer(__cie._M_fde_enc & 0x0f);
+    if (__cie._M_has_aug_data)
+      __r._M_skip(__r._M_uleb());
+    if (!__r._M_ok || __range == 0)
+      return true;
+
+    _State __initial;
+    std::uintptr_t __loc = __begin;
+    _M_fde_entries.clear();
+    bool __ok =
+        _M_execute({__cie._M_insns, __cie._M_insns_end}, __cie, __initial,
+                   __initial, __loc, false);
+    _State __s = __initial;
+    __ok = __ok && _M_execute(__r, __cie, __s, __initial, __loc, true);
+    if (__ok) {
+      _M_emit(__loc, _S_row(__s, __cie));
+    } else {
+      _M_fde_entries.clear();
+      _M_fde_entries.push_back({__begin, _Orc_row{}});
+    }
+    _M_entries.insert(_M_entries.end(), _M_fde_entries.begin(),
+                      _M_fde_entries.end());
+    // Instructions after the FDE are not covered, unless another FDE starts
+    // there.
+    _M_entries.push_back({__begin + __range, _Orc_row{}});
+    return true;
+  }
+
+public:
+  // Builds the table from the .eh_frame_hdr at __hdr.
+  _Orc_module *_M_build(const unsigned char *__hdr, std::uintptr_t __low,
+                        std::uintptr_t __high, std::uintptr_t __base) {
+    _Cfi_reader __r{__hdr, __hdr + 4};
+    const auto __hdr_addr = reinterpret_cast<std::uintptr_t>(__hdr);
+    const auto __version = __r._M_read<std::uint8_t>();
+    const auto __eh_frame_enc = __r._M_read<std::uint8_t>();
+    const auto __count_enc = __r._M_read<std::uint8_t>();
+    const auto __table_enc = __r._M_read<std::uint8_t>();
+    if (__version != 1)
+      return nullptr;
+    __r._M_end = reinterpret_cast<const unsigned char *>(-1);
+    const auto __eh_frame = __r._M_pointer(__eh_frame_enc, __hdr_addr);
+    if (__count_enc != 0xff && __table_enc == 0x3b) {
+      // Binary search table of DW_EH_PE_datarel | DW_EH_PE_sdata4 pairs.
+      const auto __count = __r._M_pointer(__count_enc, __hdr_addr);
+      for (std::uintptr_t __i = 0; __i < __count && __r._M_ok; ++__i) {
+        __r._M_read<std::int32_t>();
+        const auto __fde = __hdr_addr + __r._M_read<std::int32_t>();
+        if (!_M_add_fde(reinterpret_cast<const unsigned char *>(__fde)))
+          break;
+      }
+    } else {
+      // Walk the section up to its zero terminator.
+      const auto *__p = reinterpret_cast<const unsigned char *>(__eh_frame);
+      while (__p && _M_add_fde(__p)) {
+        _Cfi_reader __len{__p, reinterpret_cast<const unsigned char *>(-1)};
+        bool __is64;
+        __p = _S_record(__len, __is64);
+      }
+    }
+
+    // Sort by address. Where an FDE starts at the end of another one, its
+    // first row replaces the end marker of the other.
+    std::sort(_M_entries.begin(), _M_entries.end(),
+              [](const _Entry &__x, const _Entry &__y) {
+                if (__x._M_pc != __y._M_pc)
+                  return __x._M_pc < __y._M_pc;
+                return __x._M_row._M_kind == _Orc_row::_S_unknown &&
+                       __y._M_row._M_kind != _Orc_row::_S_unknown;
+              });
+    std::vector<std::uint32_t> __ips;
+    std::vector<_Orc_row> __rows;
+    for (const auto &__e : _M_entries) {
+      if (__e._M_pc < __base || __e._M_pc - __base > UINT32_MAX)
+        continue;
+      const auto __ip = static_cast<std::uint32_t>(__e._M_pc - __base);
+      if (!__ips.empty() && __ips.back() == __ip)
+        __rows.back() = __e._M_row;
+      else if (__rows.empty() || !(__rows.back() == __e._M_row)) {
+        __ips.push_back(__ip);
+        __rows.push_back(__e._M_row);
+      }
+    }
+    _M_entries = {};
+
+    auto *__module = new _Orc_module;
+    __module->_M_low = __low;
+    __module->_M_high = __high;
+    __module->_M_base = __base;
+    __module->_M_size = static_cast<std::uint32_t>(__ips.size());
+    auto *__ip_table = new std::uint32_t[__ips.size()];
+    std::copy(__ips.begin(), __ips.end(), __ip_table);
+    auto *__row_table = new _Orc_row[__rows.size()];
+    std::copy(__rows.begin(), __rows.end(), __row_table);
+    __module->_M_ips = __ip_table;
+    __module->_M_rows = __row_table;
+    return __module;
+  }
+};
+
+// Process-wide set of unwind tables, built on demand. The tables are
+// published in an immutable snapshot sorted by address, so lookups take no
+// locks. When the loader reports that a module was unloaded, the next
+// _M_refresh() or _M_load() starts over with an empty snapshot, since
+// another module may be mapped at the same addresses since. Asking the
+// loader takes its lock, so _M_refresh() does it at most once per
+// _S_refresh_interval for the whole process, and _M_load() only when a
+// lookup misses. Snapshots and tables are never freed, a signal handler
+// may still be reading them.
+class _Orc_registry {
+  static constexpr std::size_t _S_max_modules = 1024;
+  static constexpr std::int64_t _S_refresh_interval = 10'000'000; // ns
+
+  struct _Snapshot {
+    // _Load_counters::_M_subs when the snapshot was built.
+    unsigned long long _M_subs = 0;
+    std::vector<const _Orc_module *> _M_modules; // sorted by _M_low
+
+    const _Orc_module *_M_find(std::uintptr_t __pc) const noexcept {
+      const auto __it = std::upper_bound(
+          _M_modules.begin(), _M_modules.end(), __pc,
+          [](std::uintptr_t __x, const _Orc_module *__m) {
+            return __x < __m->_M_low;
+          });
+      if (__it == _M_modules.begin() || __pc >= __it[-1]->_M_high)
+        return nullptr;
+      return __it[-1];
+    }
+  };
+
+  std::atomic<const _Snapshot *> _M_snapshot{nullptr};
+  // CLOCK_MONOTONIC_COARSE time at which _M_refresh() asks the loader next.
+  std::atomic<std::int64_t> _M_next_refresh{0};
+  std::mutex _M_mutex;
+
+  // Read from the vDSO, without a system call or a lock.
+  static std::int64_t _S_now() noexcept {
+    timespec __ts;
+    if (clock_gettime(CLOCK_MONOTONIC_COARSE, &__ts) != 0)
+      return 0;
+    return std::int64_t(__ts.tv_sec) * 1'000'000'000 + __ts.tv_nsec;
+  }
+
+  // The snapshot if no module was unloaded since it was built.
+  const _Snapshot *_M_valid(unsigned long long __subs) const noexcept {
+    const auto *__s = _M_snapshot.load(std::memory_order_acquire);
+    return __s && __s->_M_subs == __subs ? __s : nullptr;
+  }
+
+  // Publishes the tables of __old, if any, and the __n tables at __added.
+  // Called with _M_mutex held.
+  void _M_publish(const _Snapshot *__old, unsigned long long __subs,
+                  const _Orc_module *const *__added,
+                  std::size_t __n) noexcept {
+    _FBBE_TRY {
+      auto *__next = new _Snapshot;
+      __next->_M_subs = __subs;
+      if (__old)
+        __next->_M_modules = __old->_M_modules;
+      __next->_M_modules.insert(__next->_M_modules.end(), __added,
+                                __added + __n);
+      std::sort(__next->_M_modules.begin(), __next->_M_modules.end(),
+                [](const _Orc_module *__x, const _Orc_module *__y) {
+                  return __x->_M_low < __y->_M_low;
+                });
+      _M_snapshot.store(__next, std::memory_order_release);
+    }
+    _FBBE_CATCH(const std::bad_alloc &) {}
+  }
+
+  // Builds the table of the module containing __pc, or returns nullptr.
+  static const _Orc_module *_S_build(std::uintptr_t __pc) noexcept {
+    struct _Data {
+      std::uintptr_t _M_pc;
+      std::uintptr_t _M_low = 0;
+      std::uintptr_t _M_high = 0;
+      std::uintptr_t _M_base = 0;
+      const unsigned char *_M_hdr = nullptr;
+      bool _M_found = false;
+    } __data{__pc};
+
+    auto __cb = [](dl_phdr_info *__info, size_t, void *__p) -> int {
+      auto &__d = *static_cast<_Data *>(__p);
+      std::uintptr_t __low = UINTPTR_MAX, __high = 0;
+      const unsigned char *__hdr = nullptr;
+      bool __contains = false;
+      for (ElfW(Half) __i = 0; __i < __info->dlpi_phnum; ++__i) {
+        const auto &__ph = __info->dlpi_phdr[__i];
+        const std::uintptr_t __start = __info->dlpi_addr + __ph.p_vaddr;
+        if (__ph.p_type == PT_LOAD && (__ph.p_flags & PF_X)) {
+          __low = std::min(__low, __start);
+          __high = std::max<std::uintptr_t>(__high, __start + __ph.p_memsz);
+          if (__d._M_pc >= __start && __d._M_pc < __start + __ph.p_memsz)
+            __contains = true;
+        } else if (__ph.p_type == PT_GNU_EH_FRAME) {
+          __hdr = reinterpret_cast<const unsigned char *>(__start);
+        }
+      }
+      if (!__contains)
+        return 0;
+      __d._M_low = __low;
+      __d._M_high = __high;
+      __d._M_base = __info->dlpi_addr;
+      __d._M_hdr = __hdr;
+      __d._M_found = true;
+      return 1;
+    };
+    dl_iterate_phdr(+__cb, &__data);
+    if (!__data._M_found)
+      return nullptr;
+
+    _Orc_module *__module = nullptr;
+    _FBBE_TRY {
+      if (__data._M_hdr)
+        __module = _Orc_builder()._M_build(__data._M_hdr, __data._M_low,
+                                           __data._M_high, __data._M_base);
+      if (!__module) {
+        // Remember modules without usable unwind information as well.
+        __module = new _Orc_module;
+        __module->_M_low = __data._M_low;
+        __module->_M_high = __data._M_high;
+        __module->_M_base = __data._M_base;
+      }
+    }
+    _FBBE_CATCH(const std::bad_alloc &) { return nullptr; }
+    return __module;
+  }
+
+  const _Orc_module *_M_load(std::uintptr_t __pc) noexcept {
+    std::lock_guard<std::mutex> __lock(_M_mutex);
+    const auto __subs = _Load_counters::_S_read()._M_subs;
+    const auto *__s = _M_valid(__subs);
+    if (const auto *__m = __s ? __s->_M_find(__pc) : nullptr)
+      return __m;
+    if (__s && __s->_M_modules.size() >= _S_max_modules)
+      return nullptr;
+    const auto *__module = _S_build(__pc);
+    if (__module)
+      _M_publish(__s, __subs, &__module, 1);
+    return __module;
+  }
+
+public:
+  static _Orc_registry &_S_instance() noexcept {
+    static _Orc_registry __registry;
+    return __registry;
+  }
+
+  // Builds the tables of all loaded modules now, so later walks through
+  // them neither lock nor allocate.
+  void _M_load_all() noexcept {
+    std::uintptr_t __starts[_S_max_modules];
+    struct _Data {
+      std::uintptr_t *_M_starts;
+      std::size_t _M_count;
+    } __data = {__starts, 0};
+    std::lock_guard<std::mutex> __lock(_M_mutex);
+    const auto __subs = _Load_counters::_S_read()._M_subs;
+    dl_iterate_phdr(
+        [](dl_phdr_info *__info, size_t, void *__p) -> int {
+          auto &__d = *static_cast<_Data *>(__p);
+          for (ElfW(Half) __i = 0; __i < __info->dlpi_phnum; ++__i) {
+            const auto &__ph = __info->dlpi_phdr[__i];
+            if (__ph.p_type == PT_LOAD && (__ph.p_flags & PF_X)) {
+              __d._M_starts[__d._M_count++] =
+                  __info->dlpi_addr + __ph.p_vaddr;
+              break;
+            }
+          }
+          return __d._M_count == _S_max_modules;
+        },
+        &__data);
+    const auto *__s = _M_valid(__subs);
+    _FBBE_TRY {
+      std::vector<const _Orc_module *> __added;
+      for (std::size_t __i = 0; __i < __data._M_count; ++__i)
+        if (!__s || !__s->_M_find(__starts[__i]))
+          if (const auto *__m = _S_build(__starts[__i]))
+            __added.push_back(__m);
+      if (!__added.empty() || !__s)
+        _M_publish(__s, __subs, __added.data(), __added.size());
+    }
+    _FBBE_CATCH(const std::bad_alloc &) {}
+  }
+
+  // Drops the tables if a module was unloaded since they were built. Called
+  // once per walk, but asks the loader, under its lock, at most once per
+  // _S_refresh_interval; takes no lock of its own unless a module was
+  // unloaded.
+  void _M_refresh() noexcept {
+    if (!_M_snapshot.load(std::memory_order_relaxed))
+      return;
+    const auto __now = _S_now();
+    auto __due = _M_next_refresh.load(std::memory_order_relaxed);
+    if (__now < __due ||
+        !_M_next_refresh.compare_exchange_strong(
+            __due, __now + _S_refresh_interval, std::memory_order_relaxed))
+      return; // checked recently, or being checked by another thread
+    _M_drop_unloaded();
+  }
+
+  // Like _M_refresh(), but asks the loader now.
+  void _M_drop_unloaded() noexcept {
+    const auto *__s = _M_snapshot.load(std::memory_order_acquire);
+    if (!__s)
+      return;
+    const auto __subs = _Load_counters::_S_read()._M_subs;
+    if (__s->_M_subs == __subs)
+      return;
+    std::lock_guard<std::mutex> __lock(_M_mutex);
+    if (!_M_valid(__subs))
+      _M_publish(nullptr, __subs, nullptr, 0);
+  }
+
+  // Returns the table of the module containing __pc if it was built, or
+  // nullptr. Takes no locks and does not allocate, so it can be called from
+  // signal handlers.
+  const _Orc_module *_M_find_loaded(std::uintptr_t __pc) const noexcept {
+    const auto *__s = _M_snapshot.load(std::memory_order_acquire);
+    return __s ? __s->_M_find(__pc) : nullptr;
+  }
+
+  // Returns the row describing the frame of the instruction at __pc, or
+  // nullptr if __pc does not belong to a loaded module. Without __load, only
+  // the tables built already are searched, as _M_find_loaded() does.
+  const _Orc_row *_M_find(std::uintptr_t __pc, bool __load = true) noexcept {
+    const _Orc_module *__m = _M_find_loaded(__pc);
+    if (!__m && __load) [[unlikely]]
+      __m = _M_load(__pc);
+    return __m ? __m->_M_find(__pc) : nullptr;
+  }
+};
+
+} // namespace fbbe::__detail
+
+#else
+#define _FBBE_ORC_UNWINDER 0
+#endif
+
+#endif // _FBBE_BITS_ORC_UNWIND_H
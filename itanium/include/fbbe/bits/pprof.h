@@ -0,0 +1,414 @@
+// Copyright Fabian Keßler 2022 - 2023.
+
+// pprof profile export -*- C++ -*-
+// Internal header, included by fbbe/stacktrace.h. Do not include directly.
+
+// pprof_builder collects stacks with their values and writes them as a
+// profile.proto message, the format read by pprof. The message is encoded by
+// hand, so no protobuf library is needed. It is wrapped in gzip: deflated
+// with zlib if FBBE_USE_ZLIB is defined (see the CMake option of the same
+// name), otherwise in stored, uncompressed deflate blocks.
+//
+// add() only records the program counters. serialize() resolves every
+// distinct program counter once, in one batch, and builds the mapping table
+// from module_map, the location table with one location per program counter
+// and the function table with one function per name and source file.
+
+#pragma once
+#ifndef _FBBE_BITS_PPROF_H
+#define _FBBE_BITS_PPROF_H 1
+
+#if _FBBE_MODULES
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#if __has_include(<sys/auxv.h>)
+#include <sys/auxv.h>
+#endif
+
+#if defined(FBBE_USE_ZLIB) && __has_include(<zlib.h>)
+#include <zlib.h>
+#define _FBBE_ZLIB 1
+#else
+#define _FBBE_ZLIB 0
+#endif
+
+namespace fbbe {
+
+namespace __detail {
+
+// Writes protocol buffer fields. Fields holding their default value are
+// omitted, as proto3 encoders do.
+class _Proto_writer {
+  std::string _M_out;
+
+public:
+  std::string &_M_str() noexcept { return _M_out; }
+
+  void _M_varint(std::uint64_t __v) {
+    for (; __v >= 0x80; __v >>= 7)
+      _M_out += char(__v | 0x80);
+    _M_out += char(__v);
+  }
+
+  void _M_tag(unsigned __field, unsigned __wire_type) {
+    _M_varint(std::uint64_t(__field) << 3 | __wire_type);
+  }
+
+  // uint64, int64 (two's complement) and bool fields.
+  void _M_uint(unsigned __field, std::uint64_t __v) {
+    if (__v == 0)
+      return;
+    _M_tag(__field, 0);
+    _M_varint(__v);
+  }
+
+  // string, bytes and embedded message fields.
+  void _M_bytes(unsigned __field, const char *__data, size_t __size) {
+    _M_tag(__field, 2);
+    _M_varint(__size);
+    _M_out.append(__data, __size);
+  }
+
+  void _M_bytes(unsigned __field, const std::string &__s) {
+    _M_bytes(__field, __s.data(), __s.size());
+  }
+
+  // A packed repeated varint field.
+  template <typename _Int>
+  void _M_packed(unsigned __field, const _Int *__first, size_t __n) {
+    if (__n == 0)
+      return;
+    size_t __size = 0;
+    for (size_t __i = 0; __i < __n; ++__i)
+      __size += _S_varint_size(std::uint64_t(__first[__i]));
+    _M_tag(__field, 2);
+    _M_varint(__size);
+    for (size_t __i = 0; __i < __n; ++__i)
+      _M_varint(std::uint64_t(__first[__i]));
+  }
+
+  static size_t _S_varint_size(std::uint64_t __v) noexcept {
+    size_t __n = 1;
+    for (; __v >= 0x80; __v >>= 7)
+      ++__n;
+    return __n;
+  }
+};
+
+inline std::uint32_t _S_crc32(std::uint32_t __crc, const unsigned char *__p,
+                              size_t __n) noexcept {
+  static constexpr auto __table = [] {
+    struct {
+      std::uint32_t _M_v[256] = {};
+    } __t;
+    for (std::uint32_t __i = 0; __i < 256; ++__i) {
+      std::uint32_t __c = __i;
+      for (int __k = 0; __k < 8; ++__k)
+        __c = __c & 1 ? 0xedb88320u ^ (__c >> 1) : __c >> 1;
+      __t._M_v[__i] = __c;
+    }
+    return __t;
+  }();
+  __crc = ~__crc;
+  for (size_t __i = 0; __i < __n; ++__i)
+    __crc = __table._M_v[(__crc ^ __p[__i]) & 0xff] ^ (__crc >> 8);
+  return ~__crc;
+}
+
+// Wraps __data in a gzip member.
+inline std::string _S_gzip(const std::string &__data) {
+#if _FBBE_ZLIB
+  z_stream __z{};
+  // 16 + 15 window bits select the gzip wrapper.
+  if (deflateInit2(&__z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + 15, 8,
+                   Z_DEFAULT_STRATEGY) == Z_OK) {
+    std::string __out(deflateBound(&__z, uLong(__data.size())), '\0');
+    __z.next_in =
+        reinterpret_cast<Bytef *>(const_cast<char *>(__data.data()));
+    __z.avail_in = uInt(__data.size());
+    __z.next_out = reinterpret_cast<Bytef *>(&__out[0]);
+    __z.avail_out = uInt(__out.size());
+    const int __r = deflate(&__z, Z_FINISH);
+    __out.resize(__z.total_out);
+    deflateEnd(&__z);
+    if (__r == Z_STREAM_END)
+      return __out;
+  }
+#endif
+  const auto *__p = reinterpret_cast<const unsigned char *>(__data.data());
+  const size_t __n = __data.size();
+  std::string __out;
+  __out.reserve(18 + __n + 5 * (__n / 65535 + 1));
+  auto __le = [&__out](std::uint32_t __v, int __bytes) {
+    for (int __i = 0; __i < __bytes; ++__i)
+      __out += char(__v >> (8 * __i));
+  };
+  // Magic, deflate, no flags, no time, no extra flags, unknown OS.
+  __out.append("\x1f\x8b\x08\x00\x00\x00\x00\x00\x00\xff", 10);
+  size_t __pos = 0;
+  do {
+    const size_t __m = std::min<size_t>(65535, __n - __pos);
+    __out += char(__pos + __m == __n); // BFINAL, BTYPE 00 (stored)
+    __le(std::uint32_t(__m), 2);
+    __le(std::uint32_t(~__m), 2);
+    __out.append(__data, __pos, __m);
+    __pos += __m;
+  } while (__pos < __n);
+  __le(_S_crc32(0, __p, __n), 4);
+  __le(std::uint32_t(__n), 4);
+  return __out;
+}
+
+} // namespace __detail
+
+// [fbbe.pprof], pprof profile export
+
+struct pprof_value_type {
+  std::string type;
+  std::string unit;
+};
+
+struct pprof_options {
+  // The meaning of the values of every sample.
+  std::vector<pprof_value_type> sample_types = {{"samples", "count"}};
+  // The distance between two samples, if they were taken periodically.
+  pprof_value_type period_type;
+  std::int64_t period = 0;
+  // When the profile was taken and for how long. The time defaults to the
+  // construction of the pprof_builder.
+  std::chrono::system_clock::time_point time{};
+  std::chrono::nanoseconds duration{0};
+  // gzip the message, as pprof writes its profiles.
+  bool compress = true;
+};
+
+class pprof_builder {
+public:
+  explicit pprof_builder(pprof_options __options = {})
+      : _M_options(std::move(__options)) {
+    if (_M_options.time == std::chrono::system_clock::time_point{})
+      _M_options.time = std::chrono::system_clock::now();
+  }
+
+  // Adds a sample of the frames __frames, innermost first, for profiles
+  // with a single sample type.
+  void add(stacktrace_view __frames, std::int64_t __value) {
+    add(__frames, {__value});
+  }
+
+  // Adds a sample with one value per sample type.
+  void add(stacktrace_view __frames,
+           std::initializer_list<std::int64_t> __values) {
+    if (__values.size() != _M_options.sample_types.size())
+      throw std::invalid_argument(
+          "pprof_builder::add: one value per sample type expected");
+    for (const auto &__f : __frames) {
+      const auto __pc = __f.native_handle();
+      const auto [__it, __new] =
+          _M_location_ids.try_emplace(__pc, _M_pcs.size() + 1);
+      if (__new)
+        _M_pcs.push_back(__pc);
+      _M_locations.push_back(__it->second);
+    }
+    _M_ends.push_back(_M_locations.size());
+    _M_values.insert(_M_values.end(), __values);
+  }
+
+  void add(const stack_table &__table, stack_id __id, std::int64_t __value) {
+    add(__table[__id], __value);
+  }
+
+  void add(const stack_table &__table, stack_id __id,
+           std::initializer_list<std::int64_t> __values) {
+    add(__table[__id], __values);
+  }
+
+  // Number of samples added.
+  size_t size() const noexcept { return _M_ends.size(); }
+
+  // Returns the profile.proto message, gzipped if the options say so.
+  std::string serialize() const;
+
+  std::ostream &write(std::ostream &__os) const {
+    const auto __s = serialize();
+    return __os.write(__s.data(), std::streamsize(__s.size()));
+  }
+
+private:
+  using _Pc = stacktrace_entry::native_handle_type;
+
+  pprof_options _M_options;
+  // Distinct program counters; the location id of _M_pcs[__i] is __i + 1.
+  std::vector<_Pc> _M_pcs;
+  std::unordered_map<_Pc, std::uint64_t> _M_location_ids;
+  // Location ids of all samples, sample __i ends at _M_ends[__i].
+  std::vector<std::uint64_t> _M_locations;
+  std::vector<size_t> _M_ends;
+  std::vector<std::int64_t> _M_values;
+};
+
+inline std::string pprof_builder::serialize() const {
+  // Field numbers of profile.proto.
+  enum : unsigned {
+    _Sample_type = 1, _Sample, _Mapping, _Location, _Function, _String_table,
+    _Time_nanos = 9, _Duration_nanos, _Period_type, _Period
+  };
+
+  std::vector<std::string> __strings{""};
+  std::unordered_map<std::string, std::uint64_t> __string_ids{{"", 0}};
+  auto __string = [&](const std::string &__s) {
+    const auto [__it, __new] = __string_ids.try_emplace(__s, __strings.size());
+    if (__new)
+      __strings.push_back(__s);
+    return __it->second;
+  };
+
+  const size_t __n = _M_pcs.size();
+  const auto __symbols = symbolize(stacktrace_view(_M_pcs.data(), __n));
+  std::vector<const module_info *> __modules(__n);
+  const auto &__map = module_map::find_cached(
+      reinterpret_cast<const std::uintptr_t *>(_M_pcs.data()), __n,
+      __modules.data());
+
+  // pprof takes the first mapping for the main executable.
+  std::vector<const module_info *> __used;
+#if __has_include(<sys/auxv.h>) && defined(AT_ENTRY)
+  if (const auto *__exe = __map.find(::getauxval(AT_ENTRY)))
+    __used.push_back(__exe);
+#endif
+  std::vector<std::uint64_t> __mapping_ids(__n);
+  for (size_t __i = 0; __i < __n; ++__i) {
+    if (!__modules[__i])
+      continue;
+    auto __it = std::find(__used.begin(), __used.end(), __modules[__i]);
+    __mapping_ids[__i] = std::uint64_t(__it - __used.begin()) + 1;
+    if (__it == __used.end())
+      __used.push_back(__modules[__i]);
+  }
+
+  __detail::_Proto_writer __w, __sub, __line;
+  auto __value_type = [&](unsigned __field, const pprof_value_type &__t) {
+    __sub._M_str().clear();
+    __sub._M_uint(1, __string(__t.type));
+    __sub._M_uint(2, __string(__t.unit));
+    __w._M_bytes(__field, __sub._M_str());
+  };
+
+  for (const auto &__t : _M_options.sample_types)
+    __value_type(_Sample_type, __t);
+
+  const size_t __types = _M_options.sample_types.size();
+  for (size_t __i = 0, __begin = 0; __i < _M_ends.size(); ++__i) {
+    __sub._M_str().clear();
+    __sub._M_packed(1, _M_locations.data() + __begin, _M_ends[__i] - __begin);
+    __sub._M_packed(2, _M_values.data() + __i * __types, __types);
+    __w._M_bytes(_Sample, __sub._M_str());
+    __begin = _M_ends[__i];
+  }
+
+  std::vector<bool> __has_functions(__used.size()), __has_lines(__used.size());
+  std::unordered_map<std::string, std::uint64_t> __function_ids;
+  std::vector<const stacktrace_symbol *> __functions;
+  for (size_t __i = 0; __i < __n; ++__i) {
+    const auto &__sym = __symbols[__i];
+    __sub._M_str().clear();
+    __sub._M_uint(1, __i + 1);
+    __sub._M_uint(2, __mapping_ids[__i]);
+    __sub._M_uint(3, _M_pcs[__i]);
+    if (!__sym.description.empty()) {
+      auto __key = __sym.description;
+      __key += '\0';
+      __key += __sym.source_file;
+      const auto [__it, __new] =
+          __function_ids.try_emplace(__key, __functions.size() + 1);
+      if (__new)
+        __functions.push_back(&__sym);
+      __line._M_str().clear();
+      __line._M_uint(1, __it->second);
+      __line._M_uint(2, __sym.source_line);
+      __sub._M_bytes(4, __line._M_str());
+      if (__mapping_ids[__i]) {
+        __has_functions[__mapping_ids[__i] - 1] = true;
+        if (__sym.source_line)
+          __has_lines[__mapping_ids[__i] - 1] = true;
+      }
+    }
+    __w._M_bytes(_Location, __sub._M_str());
+  }
+
+  for (size_t __i = 0; __i < __used.size(); ++__i) {
+    __sub._M_str().clear();
+    __sub._M_uint(1, __i + 1);
+    __sub._M_uint(2, __used[__i]->start);
+    __sub._M_uint(3, __used[__i]->end);
+    // The file offset stays 0, the first loadable segment starts at the
+    // beginning of the file.
+    __sub._M_uint(5, __string(__used[__i]->path));
+    __sub._M_uint(6, __string(__used[__i]->build_id));
+    __sub._M_uint(7, __has_functions[__i]);
+    __sub._M_uint(8, __has_lines[__i]);
+    __sub._M_uint(9, __has_lines[__i]);
+    __w._M_bytes(_Mapping, __sub._M_str());
+  }
+
+  for (size_t __i = 0; __i < __functions.size(); ++__i) {
+    __sub._M_str().clear();
+    __sub._M_uint(1, __i + 1);
+    const auto __name = __string(__functions[__i]->description);
+    __sub._M_uint(2, __name);
+    __sub._M_uint(3, __name);
+    __sub._M_uint(4, __string(__functions[__i]->source_file));
+    __w._M_bytes(_Function, __sub._M_str());
+  }
+
+  if (_M_options.period) {
+    __value_type(_Period_type, _M_options.period_type);
+    __w._M_uint(_Period, std::uint64_t(_M_options.period));
+  }
+  const auto __time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      _M_options.time.time_since_epoch());
+  __w._M_uint(_Time_nanos, std::uint64_t(__time.count()));
+  __w._M_uint(_Duration_nanos, std::uint64_t(_M_options.duration.count()));
+
+  // Strings were added up to here.
+  for (const auto &__s : __strings)
+    __w._M_bytes(_String_table, __s);
+
+  return _M_options.compress ? __detail::_S_gzip(__w._M_str())
+                             : std::move(__w._M_str());
+}
+
+#if _FBBE_PROFILER
+
+// The samples of __profile as a CPU profile, with the sample counts and the
+// CPU time they stand for.
+inline std::string to_pprof(const profile &__profile,
+                            const pprof_options &__options = {}) {
+  auto __o = __options;
+  __o.sample_types = {{"samples", "count"}, {"cpu", "nanoseconds"}};
+  __o.period_type = {"cpu", "nanoseconds"};
+  __o.period = __profile.period.count();
+  pprof_builder __builder(std::move(__o));
+  for (const auto &__s : __profile.stacks)
+    __builder.add(__s.frames, {std::int64_t(__s.count),
+                               std::int64_t(__s.count) *
+                                   __profile.period.count()});
+  return __builder.serialize();
+}
+
+#endif // _FBBE_PROFILER
+
+} // namespace fbbe
+
+#endif // _FBBE_MODULES
+
+#endif // _FBBE_BITS_PPROF_H
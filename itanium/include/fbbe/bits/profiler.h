@@ -0,0 +1,540 @@
+// Copyright Fabian Keßler 2022 - 2023.
+
+// Sampling profiler -*- C++ -*-
+// Internal header, included by fbbe/stacktrace.h. Do not include directly.
+
+// profiler samples the stacks of the running threads from a signal handler.
+// Every thread gets a timer on its own CPU clock (timer_create with
+// SIGEV_THREAD_ID), or one process-wide ITIMER_PROF timer lets the kernel
+// signal whichever thread is running. The handler unwinds the interrupted
+// stack into a ring buffer that belongs to its thread, without locks or
+// allocations. A collector thread started by start() empties the buffers
+// periodically, interns the stacks in a stack_table and counts the samples
+// of each, and looks for threads that started or exited in the meantime.
+
+#pragma once
+#ifndef _FBBE_BITS_PROFILER_H
+#define _FBBE_BITS_PROFILER_H 1
+
+#if _FBBE_THREAD_DUMP && _FBBE_CONTEXT_UNWIND && __has_include(<time.h>) &&   \
+    __has_include(<sys/time.h>)
+#include <signal.h>
+#include <sys/time.h>
+#include <time.h>
+#endif
+
+#if _FBBE_THREAD_DUMP && _FBBE_CONTEXT_UNWIND && defined(SIGEV_THREAD_ID)
+#define _FBBE_PROFILER 1
+#else
+#define _FBBE_PROFILER 0
+#endif
+
+#if _FBBE_PROFILER
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <pthread.h>
+#include <sched.h>
+#include <ucontext.h>
+
+namespace fbbe {
+
+// [fbbe.profiler], sampling profiler
+
+struct profiler_options {
+  // Samples per second of CPU time.
+  int frequency = 100;
+  // 0 selects SIGPROF.
+  int signal = 0;
+  // Give every thread a timer on its own CPU clock. Otherwise a single
+  // setitimer(ITIMER_PROF) timer runs on the CPU time of the process, and
+  // the kernel signals whichever thread is running when it expires.
+  bool per_thread_timers = true;
+  size_t max_frames = 64;
+  // Samples a thread buffers until the collector takes them.
+  size_t buffer_samples = 64;
+  // Threads that can be sampled at the same time. The buffers of threads
+  // that exited are reused.
+  size_t max_threads = 4096;
+  // Distinct stacks counted.
+  size_t max_stacks = size_t(1) << 16;
+  // How often the collector takes the samples and looks for new threads.
+  std::chrono::milliseconds collect_interval{100};
+};
+
+struct profile_sample {
+  stacktrace_view frames;
+  std::uint64_t count = 0;
+};
+
+struct profile {
+  // The sampled stacks, most frequent first.
+  std::vector<profile_sample> stacks;
+  std::uint64_t samples = 0;
+  // Samples dropped because a buffer or a table was full.
+  std::uint64_t lost = 0;
+  // CPU time between two samples of a thread.
+  std::chrono::nanoseconds period{0};
+};
+
+class profiler {
+public:
+  // Starts sampling all threads of the process, including those started
+  // later. Returns false if the profiler runs already or could not be set
+  // up. The samples of the previous run are discarded.
+  static bool start(const profiler_options &__options = {}) {
+    auto &__s = _S_state();
+    std::lock_guard<std::mutex> __lock(__s._M_mutex);
+    if (__s._M_session.load() || __options.frequency <= 0 ||
+        __options.max_frames == 0 || __options.buffer_samples == 0 ||
+        __options.max_threads == 0)
+      return false;
+    const int __sig = __options.signal ? __options.signal : SIGPROF;
+    prepare_thread();
+    if (!_S_install(__s, __sig))
+      return false;
+
+    std::unique_ptr<_Session> __p(new _Session(__options, __sig));
+    __s._M_stacks.reset(new stack_table(__options.max_stacks));
+    __s._M_counts.clear();
+    __s._M_samples = 0;
+    __s._M_lost = 0;
+    __s._M_period = __p->_M_period;
+    __s._M_stopping = false;
+    __s._M_collector_tid = 0;
+    __s._M_session.store(__p.get());
+    _S_scan(__s, *__p);
+    if (!__options.per_thread_timers) {
+      itimerval __timer;
+      __timer.it_interval = _S_timeval(__p->_M_period);
+      __timer.it_value = __timer.it_interval;
+      if (::setitimer(ITIMER_PROF, &__timer, nullptr) != 0) {
+        _S_teardown(__s, __p.release());
+        return false;
+      }
+    }
+    __s._M_collector = std::thread(_S_collect, std::ref(__s), __p.release());
+    return true;
+  }
+
+  // Stops sampling. The samples taken so far remain for snapshot().
+  static void stop() {
+    auto &__s = _S_state();
+    std::thread __collector;
+    {
+      std::lock_guard<std::mutex> __lock(__s._M_mutex);
+      if (!__s._M_session.load())
+        return;
+      __s._M_stopping = true;
+      __collector = std::move(__s._M_collector);
+    }
+    __s._M_wake.notify_all();
+    __collector.join();
+    std::lock_guard<std::mutex> __lock(__s._M_mutex);
+    _S_teardown(__s, __s._M_session.load());
+  }
+
+  static bool running() noexcept { return _S_state()._M_session.load(); }
+
+  // The samples counted since start() or the last reset, including those
+  // still buffered. The frames remain valid until the next start().
+  static profile snapshot(bool __reset = false) {
+    auto &__s = _S_state();
+    std::lock_guard<std::mutex> __lock(__s._M_mutex);
+    if (_Session *__p = __s._M_session.load())
+      _S_drain(__s, *__p);
+    profile __result;
+    __result.samples = __s._M_samples;
+    __result.lost = __s._M_lost;
+    __result.period = __s._M_period;
+    __result.stacks.reserve(__s._M_counts.size());
+    for (const auto &[__id, __count] : __s._M_counts)
+      __result.stacks.push_back({(*__s._M_stacks)[__id], __count});
+    std::sort(__result.stacks.begin(), __result.stacks.end(),
+              [](const profile_sample &__x, const profile_sample &__y) {
+                return __x.count > __y.count;
+              });
+    if (__reset) {
+      __s._M_counts.clear();
+      __s._M_samples = 0;
+      __s._M_lost = 0;
+    }
+    return __result;
+  }
+
+  // Looks up the stack of the calling thread, which allocates. Until a
+  // thread did this, or captured a trace outside a signal handler, its
+  // samples are unwound with the slower default unwinder, since the handler
+  // may have interrupted malloc. start() prepares the calling thread.
+  static void prepare_thread() noexcept {
+    ucontext_t __uc;
+    stacktrace_entry::native_handle_type __pc;
+    if (::getcontext(&__uc) == 0)
+      capture_from_context(__uc, &__pc, 1);
+  }
+
+private:
+  using uintptr_t = __UINTPTR_TYPE__;
+
+  // The samples of one thread. Written by its signal handler, read by the
+  // collector. A sample is its depth followed by the program counters.
+  struct _Ring {
+    std::atomic<std::uint64_t> _M_head{0};
+    std::atomic<std::uint64_t> _M_tail{0};
+    std::atomic<std::uint64_t> _M_lost{0};
+    std::unique_ptr<uintptr_t[]> _M_words;
+    pid_t _M_tid = 0;
+    timer_t _M_timer{};
+    bool _M_armed = false;
+    bool _M_alive = false;
+  };
+
+  // One run, from start() to stop(), shared with the handlers.
+  struct _Session {
+    profiler_options _M_options;
+    int _M_signal;
+    std::chrono::nanoseconds _M_period;
+    size_t _M_stride;
+    // Open addressing from thread ids to rings, at most half full. Only the
+    // collector changes it, the id is published after the ring. Slots of
+    // threads that exited hold _S_tombstone, which lookups probe past.
+    size_t _M_mask;
+    std::unique_ptr<std::atomic<pid_t>[]> _M_tids;
+    std::unique_ptr<_Ring *[]> _M_rings;
+    std::vector<std::unique_ptr<_Ring>> _M_owned;
+    // Drained rings of threads that exited, for new threads.
+    std::vector<_Ring *> _M_free;
+    // Samples of threads without a ring.
+    std::atomic<std::uint64_t> _M_lost{0};
+
+    _Session(const profiler_options &__options, int __sig)
+        : _M_options(__options), _M_signal(__sig),
+          _M_period(std::max<std::chrono::nanoseconds::rep>(
+              1000000000 / __options.frequency, 1)),
+          _M_stride(std::min<size_t>(__options.max_frames, 0xffff) + 1) {
+      size_t __slots = 16;
+      while (__slots < 2 * __options.max_threads)
+        __slots *= 2;
+      _M_mask = __slots - 1;
+      _M_tids.reset(new std::atomic<pid_t>[__slots]);
+      _M_rings.reset(new _Ring *[__slots]);
+      for (size_t __i = 0; __i < __slots; ++__i) {
+        _M_tids[__i].store(0, std::memory_order_relaxed);
+        _M_rings[__i] = nullptr;
+      }
+      _M_owned.reserve(__options.max_threads);
+      _M_free.reserve(__options.max_threads);
+    }
+
+    static constexpr pid_t _S_tombstone = -1;
+
+    // The slot of __tid, or -1.
+    size_t _M_slot(pid_t __tid) const noexcept {
+      size_t __i = _S_hash(__tid) & _M_mask;
+      for (size_t __n = 0; __n <= _M_mask; ++__n, __i = (__i + 1) & _M_mask) {
+        const pid_t __t = _M_tids[__i].load(std::memory_order_acquire);
+        if (__t == __tid)
+          return __i;
+        if (__t == 0)
+          break;
+      }
+      return size_t(-1);
+    }
+
+    _Ring *_M_find(pid_t __tid) const noexcept {
+      const size_t __i = _M_slot(__tid);
+      return __i != size_t(-1) ? _M_rings[__i] : nullptr;
+    }
+
+    // The ring of __tid, taken from an exited thread or created if needed.
+    // Collector only.
+    _Ring *_M_add(pid_t __tid) {
+      if (_Ring *__r = _M_find(__tid))
+        return __r;
+      // The first free slot on the probe sequence, the id is not there.
+      size_t __i = _S_hash(__tid) & _M_mask;
+      while (_M_tids[__i].load(std::memory_order_relaxed) > 0)
+        __i = (__i + 1) & _M_mask;
+      _Ring *__r;
+      if (!_M_free.empty()) {
+        __r = _M_free.back();
+        _M_free.pop_back();
+      } else {
+        if (_M_owned.size() >= _M_options.max_threads)
+          return nullptr;
+        std::unique_ptr<_Ring> __owned(new (std::nothrow) _Ring);
+        if (!__owned)
+          return nullptr;
+        __owned->_M_words.reset(
+            new (std::nothrow)
+                uintptr_t[_M_options.buffer_samples * _M_stride]);
+        if (!__owned->_M_words)
+          return nullptr;
+        __r = __owned.get();
+        _M_owned.push_back(std::move(__owned));
+      }
+      __r->_M_tid = __tid;
+      _M_rings[__i] = __r;
+      _M_tids[__i].store(__tid, std::memory_order_release);
+      return __r;
+    }
+
+    // Frees the slot of a thread that exited and keeps its ring, which
+    // must be drained, for another thread. Collector only.
+    void _M_remove(_Ring &__r) noexcept {
+      size_t __i = _M_slot(__r._M_tid);
+      __r._M_tid = 0;
+      _M_free.push_back(&__r); // reserved
+      if (__i == size_t(-1))
+        return;
+      _M_tids[__i].store(_S_tombstone, std::memory_order_release);
+      // No probe passes a tombstone that is followed by an empty slot, so
+      // it can be emptied, and the tombstones before it as well.
+      if (_M_tids[(__i + 1) & _M_mask].load(std::memory_order_relaxed) != 0)
+        return;
+      for (; _M_tids[__i].load(std::memory_order_relaxed) == _S_tombstone;
+           __i = (__i - 1) & _M_mask)
+        _M_tids[__i].store(0, std::memory_order_relaxed);
+    }
+
+    static size_t _S_hash(pid_t __tid) noexcept {
+      return size_t(std::uint32_t(__tid) * 0x9e3779b9u);
+    }
+  };
+
+  struct _State {
+    std::mutex _M_mutex;
+    std::condition_variable _M_wake;
+    std::atomic<_Session *> _M_session{nullptr};
+    // Handlers running, the session may not be freed while they do.
+    std::atomic<int> _M_active{0};
+    // Signals that have the handler installed.
+    unsigned long long _M_installed = 0;
+    std::thread _M_collector;
+    pid_t _M_collector_tid = 0;
+    bool _M_stopping = false;
+    // The counted samples, kept after stop().
+    std::unique_ptr<stack_table> _M_stacks;
+    std::unordered_map<stack_id, std::uint64_t> _M_counts;
+    std::uint64_t _M_samples = 0;
+    std::uint64_t _M_lost = 0;
+    std::chrono::nanoseconds _M_period{0};
+  };
+
+  // Never destroyed, a late signal may arrive while the program exits.
+  static _State &_S_state() {
+    static _State *__state = new _State();
+    return *__state;
+  }
+
+  static timeval _S_timeval(std::chrono::nanoseconds __ns) noexcept {
+    const auto __us = std::max<long long>(__ns.count() / 1000, 1);
+    return {time_t(__us / 1000000), suseconds_t(__us % 1000000)};
+  }
+
+  static void _S_handle(int, siginfo_t *, void *__context) {
+    const int __saved_errno = errno;
+    auto &__s = _S_state();
+    __s._M_active.fetch_add(1);
+    _Session *__p = __s._M_session.load();
+    if (__p && __context) {
+      if (_Ring *__r = __p->_M_find(__detail::_Thread_dump::_S_tid()))
+        _S_sample(*__p, *__r, *static_cast<const ucontext_t *>(__context));
+      else
+        __p->_M_lost.fetch_add(1, std::memory_order_relaxed);
+    }
+    __s._M_active.fetch_sub(1);
+    errno = __saved_errno;
+  }
+
+  static void _S_sample(const _Session &__p, _Ring &__r,
+                        const ucontext_t &__uc) noexcept {
+    const size_t __capacity = __p._M_options.buffer_samples;
+    const auto __head = __r._M_head.load(std::memory_order_relaxed);
+    if (__head - __r._M_tail.load(std::memory_order_acquire) >= __capacity) {
+      __r._M_lost.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    uintptr_t *__sample =
+        __r._M_words.get() + __head % __capacity * __p._M_stride;
+    struct _Data {
+      uintptr_t *_M_buffer;
+      size_t _M_size;
+      size_t _M_depth;
+    } __data = {__sample + 1, __p._M_stride - 1, 0};
+    auto __cb = [](void *__data, uintptr_t __pc) -> int {
+      auto &__d = *static_cast<_Data *>(__data);
+      __d._M_buffer[__d._M_depth++] = __pc;
+      return __d._M_depth == __d._M_size; // stop when the sample is full
+    };
+    orc_unwinder_t::_S_from_context(__uc, +__cb, &__data, false);
+    __sample[0] = __data._M_depth;
+    __r._M_head.store(__head + 1, std::memory_order_release);
+  }
+
+  static bool _S_install(_State &__s, int __sig) noexcept {
+    const auto __bit = 1ull << (__sig % 64);
+    if (__s._M_installed & __bit)
+      return true;
+    struct sigaction __action;
+    std::memset(&__action, 0, sizeof(__action));
+    __action.sa_sigaction = _S_handle;
+    __action.sa_flags = SA_SIGINFO | SA_RESTART | SA_ONSTACK;
+    sigemptyset(&__action.sa_mask);
+    if (::sigaction(__sig, &__action, nullptr) != 0)
+      return false;
+    __s._M_installed |= __bit;
+    return true;
+  }
+
+  // Starts a timer on the CPU clock of thread __r._M_tid.
+  static bool _S_arm(const _Session &__p, _Ring &__r) noexcept {
+    sigevent __event;
+    std::memset(&__event, 0, sizeof(__event));
+    __event.sigev_notify = SIGEV_THREAD_ID;
+    __event.sigev_signo = __p._M_signal;
+#ifdef sigev_notify_thread_id
+    __event.sigev_notify_thread_id = __r._M_tid;
+#else
+    __event._sigev_un._tid = __r._M_tid;
+#endif
+    // The scheduler CPU clock of another thread, as encoded by the kernel
+    // (see CPUCLOCK_SCHED and CPUCLOCK_PERTHREAD_MASK).
+    const auto __clock = clockid_t((~unsigned(__r._M_tid) << 3) | 6);
+    if (::timer_create(__clock, &__event, &__r._M_timer) != 0)
+      return false;
+    itimerspec __spec;
+    __spec.it_interval.tv_sec = time_t(__p._M_period.count() / 1000000000);
+    __spec.it_interval.tv_nsec = long(__p._M_period.count() % 1000000000);
+    __spec.it_value = __spec.it_interval;
+    if (::timer_settime(__r._M_timer, 0, &__spec, nullptr) != 0) {
+      ::timer_delete(__r._M_timer);
+      return false;
+    }
+    return true;
+  }
+
+  // Gives new threads a ring, and a timer, and stops the timers of threads
+  // that exited and counts the rest of their samples, so their rings can
+  // be reused. Builds the tables of modules loaded since, which the
+  // handlers cannot.
+  static void _S_scan(_State &__s, _Session &__p) {
+#if _FBBE_ORC_UNWINDER
+    __detail::_Orc_registry::_S_instance()._M_load_all();
+#endif
+    const auto __threads = __detail::_Thread_dump::_S_threads();
+    if (__threads.empty())
+      return; // not even the caller, /proc is not readable
+    for (auto &__r : __p._M_owned)
+      __r->_M_alive = false;
+    for (const pid_t __tid : __threads) {
+      if (__tid == __s._M_collector_tid)
+        continue;
+      _Ring *__r = __p._M_add(__tid);
+      if (!__r)
+        continue;
+      __r->_M_alive = true;
+      if (__p._M_options.per_thread_timers && !__r->_M_armed)
+        __r->_M_armed = _S_arm(__p, *__r);
+    }
+    for (auto &__r : __p._M_owned)
+      if (!__r->_M_alive && __r->_M_tid != 0) {
+        if (__r->_M_armed) {
+          ::timer_delete(__r->_M_timer);
+          __r->_M_armed = false;
+        }
+        _S_drain(__s, __p, *__r);
+        __p._M_remove(*__r);
+      }
+  }
+
+  // Counts the samples buffered by one thread.
+  static void _S_drain(_State &__s, const _Session &__p, _Ring &__r) {
+    const size_t __capacity = __p._M_options.buffer_samples;
+    auto __tail = __r._M_tail.load(std::memory_order_relaxed);
+    const auto __head = __r._M_head.load(std::memory_order_acquire);
+    for (; __tail != __head; ++__tail) {
+      const uintptr_t *__sample =
+          __r._M_words.get() + __tail % __capacity * __p._M_stride;
+      const stack_id __id =
+          __sample[0] ? __s._M_stacks->intern(__sample + 1, __sample[0])
+                      : invalid_stack_id;
+      if (__id == invalid_stack_id) {
+        ++__s._M_lost;
+        continue;
+      }
+      ++__s._M_counts[__id];
+      ++__s._M_samples;
+    }
+    __r._M_tail.store(__tail, std::memory_order_release);
+    __s._M_lost += __r._M_lost.exchange(0, std::memory_order_relaxed);
+  }
+
+  // Counts the buffered samples.
+  static void _S_drain(_State &__s, _Session &__p) {
+    for (auto &__r : __p._M_owned)
+      _S_drain(__s, __p, *__r);
+    __s._M_lost += __p._M_lost.exchange(0, std::memory_order_relaxed);
+  }
+
+  static void _S_collect(_State &__s, _Session *__p) {
+    sigset_t __set;
+    sigemptyset(&__set);
+    sigaddset(&__set, __p->_M_signal);
+    ::pthread_sigmask(SIG_BLOCK, &__set, nullptr);
+    std::unique_lock<std::mutex> __lock(__s._M_mutex);
+    __s._M_collector_tid = __detail::_Thread_dump::_S_tid();
+    while (!__s._M_stopping) {
+      _S_scan(__s, *__p);
+      _S_drain(__s, *__p);
+      __s._M_wake.wait_for(__lock, __p->_M_options.collect_interval,
+                           [&__s] { return __s._M_stopping; });
+    }
+  }
+
+  // Stops the timers, waits for running handlers and counts the rest of
+  // the samples. If a handler does not finish in time, the session is
+  // leaked rather than freed.
+  static void _S_teardown(_State &__s, _Session *__p) {
+    if (__p->_M_options.per_thread_timers) {
+      for (auto &__r : __p->_M_owned)
+        if (__r->_M_armed) {
+          ::timer_delete(__r->_M_timer);
+          __r->_M_armed = false;
+        }
+    } else {
+      itimerval __timer;
+      std::memset(&__timer, 0, sizeof(__timer));
+      ::setitimer(ITIMER_PROF, &__timer, nullptr);
+    }
+    __s._M_session.store(nullptr);
+    const auto __grace =
+        std::chrono::steady_clock::now() + std::chrono::milliseconds(100);
+    bool __drained = true;
+    while (__s._M_active.load() != 0 && __drained) {
+      __drained = std::chrono::steady_clock::now() < __grace;
+      ::sched_yield();
+    }
+    if (!__drained)
+      return;
+    _S_drain(__s, *__p);
+    delete __p;
+  }
+};
+
+} // namespace fbbe
+
+#endif // _FBBE_PROFILER
+
+#endif // _FBBE_BITS_PROFILER_H
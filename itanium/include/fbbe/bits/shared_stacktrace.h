@@ -0,0 +1,224 @@
+// Copyright Fabian Keßler 2022 - 2023.
+
+// Shared immutable stacktraces -*- C++ -*-
+// Internal header, included by fbbe/stacktrace.h. Do not include directly.
+
+// shared_stacktrace holds its frames in an immutable, reference-counted
+// block, for traces attached to error objects that are copied along futures,
+// retries and log sinks. A copy increments the count instead of allocating.
+// The block also keeps the hash, computed once when it is created, and two
+// traces sharing a block compare equal without looking at the frames.
+
+#pragma once
+#ifndef _FBBE_BITS_SHARED_STACKTRACE_H
+#define _FBBE_BITS_SHARED_STACKTRACE_H 1
+
+#include <atomic>
+#include <functional>
+#include <iterator>
+#include <new>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+
+namespace fbbe {
+
+// [fbbe.shared], shared immutable stacktraces
+
+class shared_stacktrace {
+public:
+  using value_type = stacktrace_entry;
+  using const_reference = const value_type &;
+  using reference = const_reference;
+  using const_iterator = const value_type *;
+  using iterator = const_iterator;
+  using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+  using reverse_iterator = const_reverse_iterator;
+  using difference_type = ptrdiff_t;
+  using size_type = unsigned short;
+
+  [[__gnu__::__noinline__]] static shared_stacktrace
+  current(size_type __skip = 0,
+          size_type __max_depth = size_type(-1)) noexcept {
+    if (__skip == size_type(-1)) [[unlikely]]
+      return {};
+    return shared_stacktrace(
+        stacktrace::current(exact_capture, __skip + 1, __max_depth));
+  }
+
+  shared_stacktrace() noexcept = default;
+
+  // Copies the frames into a new block. Empty if the memory could not be
+  // allocated.
+  explicit shared_stacktrace(stacktrace_view __frames) noexcept {
+    const size_t __n = std::min<size_t>(__frames.size(), size_type(-1));
+    if (__n == 0)
+      return;
+    void *__p = ::operator new(
+        sizeof(_Block) + __n * sizeof(stacktrace_entry), std::nothrow);
+    if (!__p)
+      return;
+    _M_block = ::new (__p) _Block{{1}, 0, size_type(__n)};
+    std::uninitialized_copy_n(__frames.begin(), __n, _M_block->_M_frames());
+    _M_block->_M_hash = __detail::_S_hash_frames(_M_block->_M_frames(), __n);
+  }
+
+  template <typename _Allocator>
+  explicit shared_stacktrace(const basic_stacktrace<_Allocator> &__st) noexcept
+      : shared_stacktrace(stacktrace_view(__st.begin(), __st.size())) {}
+
+  shared_stacktrace(const shared_stacktrace &__other) noexcept
+      : _M_block(__other._M_block) {
+    if (_M_block)
+      _M_block->_M_refs.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  shared_stacktrace(shared_stacktrace &&__other) noexcept
+      : _M_block(std::exchange(__other._M_block, nullptr)) {}
+
+  shared_stacktrace &operator=(const shared_stacktrace &__other) noexcept {
+    shared_stacktrace(__other).swap(*this);
+    return *this;
+  }
+
+  shared_stacktrace &operator=(shared_stacktrace &&__other) noexcept {
+    shared_stacktrace(std::move(__other)).swap(*this);
+    return *this;
+  }
+
+  ~shared_stacktrace() { _M_release(); }
+
+  const_iterator begin() const noexcept {
+    return _M_block ? _M_block->_M_frames() : nullptr;
+  }
+
+  const_iterator end() const noexcept { return begin() + size(); }
+
+  const_reverse_iterator rbegin() const noexcept {
+    return const_reverse_iterator(end());
+  }
+
+  const_reverse_iterator rend() const noexcept {
+    return const_reverse_iterator(begin());
+  }
+
+  const_iterator cbegin() const noexcept { return begin(); }
+  const_iterator cend() const noexcept { return end(); }
+
+  [[nodiscard]] bool empty() const noexcept { return _M_block == nullptr; }
+
+  size_type size() const noexcept { return _M_block ? _M_block->_M_size : 0; }
+
+  size_type max_size() const noexcept { return size_type(-1); }
+
+  const_reference operator[](size_type __n) const noexcept {
+    _FBBE_ASSERT(__n < size());
+    return begin()[__n];
+  }
+
+  const_reference at(size_type __n) const {
+    if (__n >= size())
+      throw std::out_of_range("shared_stacktrace::at: bad frame number");
+    return begin()[__n];
+  }
+
+  operator stacktrace_view() const noexcept {
+    return stacktrace_view(begin(), size());
+  }
+
+  // Number of shared_stacktrace objects sharing the frames, 0 if empty.
+  long use_count() const noexcept {
+    return _M_block ? long(_M_block->_M_refs.load(std::memory_order_relaxed))
+                    : 0;
+  }
+
+  // Copies the frames into a basic_stacktrace, which is empty if the memory
+  // could not be allocated.
+  template <typename _Allocator = std::allocator<stacktrace_entry>>
+  basic_stacktrace<_Allocator>
+  to_stacktrace(const _Allocator &__alloc = _Allocator()) const noexcept {
+    basic_stacktrace<_Allocator> __st(__alloc);
+    if (empty())
+      return __st;
+    auto __cb = __st._M_prepare(size());
+    if (!__cb)
+      return __st;
+    for (const auto &__f : *this)
+      __cb(&__st, __f.native_handle());
+    return __st;
+  }
+
+  void swap(shared_stacktrace &__other) noexcept {
+    std::swap(_M_block, __other._M_block);
+  }
+
+  friend bool operator==(const shared_stacktrace &__x,
+                         const shared_stacktrace &__y) noexcept {
+    if (__x._M_block == __y._M_block)
+      return true;
+    if (__x.size() != __y.size() ||
+        __x._M_block->_M_hash != __y._M_block->_M_hash)
+      return false;
+    return std::equal(__x.begin(), __x.end(), __y.begin());
+  }
+
+  friend bool operator!=(const shared_stacktrace &__x,
+                         const shared_stacktrace &__y) noexcept {
+    return !(__x == __y);
+  }
+
+private:
+  template <typename> friend struct std::hash;
+
+  struct _Block {
+    std::atomic<size_t> _M_refs;
+    size_t _M_hash;
+    size_type _M_size;
+
+    stacktrace_entry *_M_frames() noexcept {
+      return reinterpret_cast<stacktrace_entry *>(this + 1);
+    }
+  };
+
+  static_assert(sizeof(_Block) % alignof(stacktrace_entry) == 0);
+
+  _Block *_M_block = nullptr;
+
+  size_t _M_hash() const noexcept {
+    if (_M_block)
+      return _M_block->_M_hash;
+    const stacktrace_entry *__none = nullptr;
+    return __detail::_S_hash_frames(__none, 0);
+  }
+
+  void _M_release() noexcept {
+    if (_M_block &&
+        _M_block->_M_refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      _M_block->~_Block();
+      ::operator delete(_M_block);
+    }
+  }
+};
+
+inline void swap(shared_stacktrace &__a, shared_stacktrace &__b) noexcept {
+  __a.swap(__b);
+}
+
+inline std::ostream &operator<<(std::ostream &__os,
+                                const shared_stacktrace &__st) {
+  return __os << stacktrace_view(__st);
+}
+
+inline std::string to_string(const shared_stacktrace &__st) {
+  return to_string(stacktrace_view(__st));
+}
+
+} // namespace fbbe
+
+template <> struct std::hash<fbbe::shared_stacktrace> {
+  size_t operator()(const fbbe::shared_stacktrace &__st) const noexcept {
+    return __st._M_hash();
+  }
+};
+
+#endif // _FBBE_BITS_SHARED_STACKTRACE_H
@@ -0,0 +1,264 @@
+// Copyright Fabian Keßler 2022 - 2023.
+
+// Interned stacktraces -*- C++ -*-
+// Internal header, included by fbbe/stacktrace.h. Do not include directly.
+
+// stack_table stores every distinct sequence of frames once and names it by
+// a 32-bit stack_id, so that profiles and logs keep four bytes per event
+// instead of a basic_stacktrace with its own buffer.
+//
+// The frames live in an append-only arena: a record is a header followed by
+// the frames, and its id is its offset in 8-byte words. The arena grows by
+// chunks of doubling size that are never moved, so ids and views stay valid
+// for the lifetime of the table. An open-addressing hash index with a fixed
+// number of slots maps frames to ids; each slot holds the id and the upper
+// half of the hash, and is claimed with a single compare-and-swap. Neither
+// lookups nor inserts take locks. A thread that loses the race to insert the
+// same frames leaves its record unreferenced in the arena.
+
+#pragma once
+#ifndef _FBBE_BITS_STACK_TABLE_H
+#define _FBBE_BITS_STACK_TABLE_H 1
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <new>
+
+namespace fbbe {
+
+// [fbbe.intern], interned stacktraces
+
+using stack_id = std::uint32_t;
+
+inline constexpr stack_id invalid_stack_id = stack_id(-1);
+
+class stack_table {
+public:
+  // Room for __max_stacks distinct traces.
+  explicit stack_table(size_t __max_stacks = size_t(1) << 16)
+      : _M_max(std::min<size_t>(__max_stacks, _S_max_words / 2)) {
+    size_t __slots = 16;
+    while (__slots < 2 * _M_max)
+      __slots *= 2;
+    _M_mask = __slots - 1;
+    _M_slots = new std::atomic<std::uint64_t>[__slots];
+    for (size_t __i = 0; __i < __slots; ++__i)
+      _M_slots[__i].store(0, std::memory_order_relaxed);
+  }
+
+  stack_table(const stack_table &) = delete;
+  stack_table &operator=(const stack_table &) = delete;
+
+  ~stack_table() {
+    delete[] _M_slots;
+    for (auto &__chunk : _M_chunks)
+      delete[] __chunk.load(std::memory_order_relaxed);
+  }
+
+  // Returns the id of the frames, adding them if they are new, or
+  // invalid_stack_id if the table is full.
+  stack_id intern(const stacktrace_entry *__first, size_t __n) noexcept {
+    return _M_lookup(__first, __n, true);
+  }
+
+  // Same, for program counters as written by capture_current().
+  stack_id intern(const stacktrace_entry::native_handle_type *__pcs,
+                  size_t __n) noexcept {
+    return _M_lookup(__pcs, __n, true);
+  }
+
+  template <typename _Allocator>
+  stack_id intern(const basic_stacktrace<_Allocator> &__st) noexcept {
+    return _M_lookup(__st.begin(), __st.size(), true);
+  }
+
+  // Returns the id of the frames, or invalid_stack_id if they were never
+  // interned.
+  stack_id find(const stacktrace_entry *__first, size_t __n) const noexcept {
+    // Does not modify the table without __insert.
+    return const_cast<stack_table *>(this)->_M_lookup(__first, __n, false);
+  }
+
+  template <typename _Allocator>
+  stack_id find(const basic_stacktrace<_Allocator> &__st) const noexcept {
+    return find(__st.begin(), __st.size());
+  }
+
+  // The frames of an id returned by intern(), valid as long as the table.
+  stacktrace_view operator[](stack_id __id) const noexcept {
+    const auto *__r = _M_record(__id);
+    return stacktrace_view(__r->_M_frames(), __r->_M_size);
+  }
+
+  // Number of distinct traces.
+  size_t size() const noexcept {
+    return _M_size.load(std::memory_order_relaxed);
+  }
+
+  size_t max_size() const noexcept { return _M_max; }
+
+  // Bytes used by the records in the arena.
+  size_t arena_bytes() const noexcept {
+    return std::min(_M_used.load(std::memory_order_relaxed), _S_max_words) *
+           sizeof(std::uint64_t);
+  }
+
+private:
+  // Ids are word offsets below invalid_stack_id.
+  static constexpr size_t _S_max_words = invalid_stack_id;
+  // Words in the first chunk, chunk __k holds _S_first << __k.
+  static constexpr size_t _S_first = 4096;
+  static constexpr unsigned _S_chunks = 21;
+
+  struct _Record {
+    std::uint32_t _M_size;
+    std::uint32_t _M_hash;
+
+    const stacktrace_entry *_M_frames() const noexcept {
+      return std::launder(reinterpret_cast<const stacktrace_entry *>(this + 1));
+    }
+  };
+
+  static_assert(sizeof(_Record) == sizeof(std::uint64_t));
+
+  std::atomic<std::uint64_t> *_M_slots;
+  size_t _M_mask;
+  size_t _M_max;
+  std::atomic<size_t> _M_size{0};
+  std::atomic<size_t> _M_used{0};
+  std::atomic<std::uint64_t *> _M_chunks[_S_chunks] = {};
+
+  static stacktrace_entry::native_handle_type
+  _S_pc(const stacktrace_entry &__f) noexcept {
+    return __f.native_handle();
+  }
+
+  static stacktrace_entry::native_handle_type
+  _S_pc(stacktrace_entry::native_handle_type __pc) noexcept {
+    return __pc;
+  }
+
+  template <typename _It>
+  static std::uint64_t _S_hash(_It __first, size_t __n) noexcept {
+    std::uint64_t __h = __n * 0x9e3779b97f4a7c15ull;
+    for (size_t __i = 0; __i < __n; ++__i) {
+      __h ^= std::uint64_t(_S_pc(__first[__i]));
+      __h *= 0xff51afd7ed558ccdull;
+      __h ^= __h >> 32;
+    }
+    __h *= 0xc4ceb9fe1a85ec53ull;
+    return __h ^ (__h >> 29);
+  }
+
+  // The chunk holding word __w.
+  static unsigned _S_chunk(size_t __w) noexcept {
+    const size_t __q = __w / _S_first + 1;
+    return unsigned(sizeof(long long) * 8 - 1 - __builtin_clzll(__q));
+  }
+
+  static size_t _S_chunk_start(unsigned __k) noexcept {
+    return _S_first * ((size_t(1) << __k) - 1);
+  }
+
+  const _Record *_M_record(stack_id __id) const noexcept {
+    const unsigned __k = _S_chunk(__id);
+    const auto *__chunk = _M_chunks[__k].load(std::memory_order_acquire);
+    return reinterpret_cast<const _Record *>(__chunk + __id -
+                                             _S_chunk_start(__k));
+  }
+
+  // Reserves __words contiguous words, returns the offset of the first or
+  // _S_max_words.
+  size_t _M_allocate(size_t __words) noexcept {
+    for (;;) {
+      const size_t __start = _M_used.fetch_add(__words);
+      if (__start + __words > _S_max_words)
+        return _S_max_words;
+      const unsigned __k = _S_chunk(__start);
+      if (_S_chunk(__start + __words - 1) != __k)
+        continue; // the rest of chunk __k stays unused
+      if (!_M_chunks[__k].load(std::memory_order_acquire)) {
+        auto *__chunk = new (std::nothrow) std::uint64_t[_S_first << __k];
+        if (!__chunk)
+          return _S_max_words;
+        std::uint64_t *__expected = nullptr;
+        if (!_M_chunks[__k].compare_exchange_strong(__expected, __chunk))
+          delete[] __chunk;
+      }
+      return __start;
+    }
+  }
+
+  template <typename _It>
+  stack_id _M_add(_It __first, size_t __n, std::uint32_t __hash) noexcept {
+    const size_t __bytes = __n * sizeof(stacktrace_entry);
+    const size_t __words = 1 + (__bytes + 7) / 8;
+    const size_t __start = _M_allocate(__words);
+    if (__start == _S_max_words)
+      return invalid_stack_id;
+    const unsigned __k = _S_chunk(__start);
+    auto *__p = _M_chunks[__k].load(std::memory_order_acquire) + __start -
+                _S_chunk_start(__k);
+    ::new (__p) _Record{std::uint32_t(__n), __hash};
+    auto *__frames = reinterpret_cast<stacktrace_entry *>(__p + 1);
+    for (size_t __i = 0; __i < __n; ++__i) {
+      auto *__f = ::new (__frames + __i) stacktrace_entry;
+      __f->_M_pc = _S_pc(__first[__i]);
+    }
+    return stack_id(__start);
+  }
+
+  template <typename _It>
+  bool _M_equal(const _Record &__r, std::uint32_t __hash, _It __first,
+                size_t __n) const noexcept {
+    if (__r._M_size != __n || __r._M_hash != __hash)
+      return false;
+    const auto *__frames = __r._M_frames();
+    for (size_t __i = 0; __i < __n; ++__i)
+      if (__frames[__i].native_handle() != _S_pc(__first[__i]))
+        return false;
+    return true;
+  }
+
+  template <typename _It>
+  stack_id _M_lookup(_It __first, size_t __n, bool __insert) noexcept {
+    if (__n > std::uint32_t(-1))
+      return invalid_stack_id;
+    const std::uint64_t __h = _S_hash(__first, __n);
+    const std::uint32_t __tag = std::uint32_t(__h >> 32);
+    stack_id __added = invalid_stack_id;
+    for (size_t __i = __h & _M_mask, __probes = 0; __probes <= _M_mask;
+         __i = (__i + 1) & _M_mask, ++__probes) {
+      std::uint64_t __slot = _M_slots[__i].load(std::memory_order_acquire);
+      if (__slot == 0) {
+        if (!__insert)
+          return invalid_stack_id;
+        if (__added == invalid_stack_id) {
+          if (size() >= _M_max)
+            return invalid_stack_id;
+          __added = _M_add(__first, __n, __tag);
+          if (__added == invalid_stack_id)
+            return invalid_stack_id;
+        }
+        const std::uint64_t __new = std::uint64_t(__tag) << 32 | (__added + 1);
+        if (_M_slots[__i].compare_exchange_strong(__slot, __new,
+                                                  std::memory_order_acq_rel,
+                                                  std::memory_order_acquire)) {
+          _M_size.fetch_add(1, std::memory_order_relaxed);
+          return __added;
+        }
+        // __slot now holds the id another thread stored.
+      }
+      const stack_id __id = stack_id(__slot) - 1;
+      if (std::uint32_t(__slot >> 32) == __tag &&
+          _M_equal(*_M_record(__id), __tag, __first, __n))
+        return __id;
+    }
+    return invalid_stack_id;
+  }
+};
+
+} // namespace fbbe
+
+#endif // _FBBE_BITS_STACK_TABLE_H
@@ -0,0 +1,213 @@
+// Copyright Fabian Keßler 2022 - 2023.
+
+// Process-wide symbol cache -*- C++ -*-
+// Internal header, included by fbbe/stacktrace.h. Do not include directly.
+
+// Resolved symbols are cached per program counter in a fixed number of
+// shards, each guarded by a reader-writer lock, so concurrent lookups of
+// warm entries only share a lock. The memory used is bounded; when a shard
+// exceeds its share, entries are evicted in insertion order, giving entries
+// that were read since the last sweep a second chance. The whole cache is
+// dropped whenever a module was unloaded, because its addresses may be
+// reused by modules loaded later. Asking the loader takes its lock, so
+// batches of lookups ask once, and single lookups only when module_map
+// built a new snapshot since. Entries only hold views of interned names
+// and of file names owned by libbacktrace, so they all have the same size.
+
+#pragma once
+#ifndef _FBBE_BITS_SYMBOL_CACHE_H
+#define _FBBE_BITS_SYMBOL_CACHE_H 1
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <shared_mutex>
+#include <string_view>
+#include <unordered_map>
+
+#include "modules.h"
+
+namespace fbbe {
+
+namespace __detail {
+
+struct _Cached_symbol {
+  std::string_view _M_desc;
+  const char *_M_file = nullptr;
+  int _M_line = 0;
+  bool _M_resolved = false;
+};
+
+class _Symbol_cache {
+  static constexpr std::size_t _S_shards = 16;
+
+  struct _Node {
+    _Cached_symbol _M_symbol;
+    mutable std::atomic<bool> _M_referenced{false};
+  };
+
+  struct alignas(64) _Shard {
+    mutable std::shared_mutex _M_mutex;
+    std::unordered_map<std::uintptr_t, _Node> _M_map;
+    std::deque<std::uintptr_t> _M_fifo;
+    std::size_t _M_bytes = 0;
+  };
+
+  _Shard _M_shards[_S_shards];
+  std::atomic<std::size_t> _M_capacity{0};
+  std::atomic<unsigned long long> _M_unloads{0};
+  std::atomic<std::size_t> _M_bytes{0};
+
+  _Shard &_M_shard(std::uintptr_t __pc) noexcept {
+    // Return addresses are not uniformly distributed in the low bits.
+    const auto __h = (__pc >> 4) * 0x9e3779b97f4a7c15ull;
+    return _M_shards[__h >> 60];
+  }
+
+  // Key, node and bookkeeping in the map and the eviction queue.
+  static constexpr std::size_t _S_entry_bytes =
+      sizeof(std::uintptr_t) * 2 + sizeof(_Node) + 2 * sizeof(void *);
+
+  void _M_clear_shard(_Shard &__shard) {
+    std::unique_lock<std::shared_mutex> __lock(__shard._M_mutex);
+    _M_bytes.fetch_sub(__shard._M_bytes, std::memory_order_relaxed);
+    __shard._M_map.clear();
+    __shard._M_fifo.clear();
+    __shard._M_bytes = 0;
+  }
+
+  // Precondition: __shard._M_mutex is locked exclusively.
+  void _M_evict(_Shard &__shard, std::size_t __limit) {
+    // Every entry gets at most one second chance per call.
+    for (std::size_t __chances = __shard._M_fifo.size();
+         __shard._M_bytes > __limit && !__shard._M_fifo.empty();) {
+      const auto __pc = __shard._M_fifo.front();
+      __shard._M_fifo.pop_front();
+      const auto __it = __shard._M_map.find(__pc);
+      if (__it == __shard._M_map.end())
+        continue;
+      if (__chances > 0 &&
+          __it->second._M_referenced.exchange(false,
+                                              std::memory_order_relaxed)) {
+        --__chances;
+        __shard._M_fifo.push_back(__pc);
+        continue;
+      }
+      __shard._M_bytes -= _S_entry_bytes;
+      _M_bytes.fetch_sub(_S_entry_bytes, std::memory_order_relaxed);
+      __shard._M_map.erase(__it);
+    }
+  }
+
+public:
+  static _Symbol_cache &_S_instance() noexcept {
+    static _Symbol_cache __cache;
+    return __cache;
+  }
+
+  bool _M_enabled() const noexcept {
+    return _M_capacity.load(std::memory_order_relaxed) != 0;
+  }
+
+  std::size_t _M_capacity_bytes() const noexcept {
+    return _M_capacity.load(std::memory_order_relaxed);
+  }
+
+  std::size_t _M_memory_usage() const noexcept {
+    return _M_bytes.load(std::memory_order_relaxed);
+  }
+
+  void _M_set_capacity(std::size_t __bytes) {
+    _M_capacity.store(__bytes, std::memory_order_relaxed);
+    const auto __limit = __bytes / _S_shards;
+    for (auto &__shard : _M_shards) {
+      std::unique_lock<std::shared_mutex> __lock(__shard._M_mutex);
+      _M_evict(__shard, __limit);
+    }
+  }
+
+  void _M_clear() {
+    for (auto &__shard : _M_shards)
+      _M_clear_shard(__shard);
+  }
+
+  // Drops all entries if a module was unloaded since the last call. The
+  // loader's counters are read from its first module only, so this costs one
+  // short dl_iterate_phdr call and no snapshot of module_map.
+  void _M_validate() {
+#if _FBBE_MODULES && defined(__GLIBC__)
+    if (!_M_enabled())
+      return;
+    const auto __unloads = _Load_counters::_S_read()._M_subs;
+    if (_M_unloads.load(std::memory_order_relaxed) != __unloads &&
+        _M_unloads.exchange(__unloads, std::memory_order_relaxed) !=
+            __unloads)
+      _M_clear();
+#endif
+  }
+
+  bool _M_find(std::uintptr_t __pc, _Cached_symbol &__out) const {
+    auto &__shard = const_cast<_Symbol_cache *>(this)->_M_shard(__pc);
+    std::shared_lock<std::shared_mutex> __lock(__shard._M_mutex);
+    const auto __it = __shard._M_map.find(__pc);
+    if (__it == __shard._M_map.end())
+      return false;
+    __it->second._M_referenced.store(true, std::memory_order_relaxed);
+    __out = __it->second._M_symbol;
+    return true;
+  }
+
+  void _M_insert(std::uintptr_t __pc, const _Cached_symbol &__sym) {
+    const auto __limit = _M_capacity_bytes() / _S_shards;
+    auto &__shard = _M_shard(__pc);
+    std::unique_lock<std::shared_mutex> __lock(__shard._M_mutex);
+    const auto [__it, __inserted] = __shard._M_map.try_emplace(__pc);
+    if (!__inserted)
+      return;
+    __it->second._M_symbol = __sym;
+    __shard._M_fifo.push_back(__pc);
+    __shard._M_bytes += _S_entry_bytes;
+    _M_bytes.fetch_add(_S_entry_bytes, std::memory_order_relaxed);
+    _M_evict(__shard, __limit);
+  }
+};
+
+} // namespace __detail
+
+// [fbbe.symbol.cache], process-wide symbol cache
+
+// Caches description, source file and line per address for all queries of
+// stacktrace_entry, symbolize(), operator<< and to_string(). Disabled by
+// default. The cache is cleared automatically when a module is unloaded
+// (with glibc; elsewhere call clear() after dlclose()) by the next query.
+struct symbol_cache {
+  // Enables the cache, keeping its memory use at about __max_bytes. Shrinks
+  // an enabled cache if necessary.
+  static void enable(std::size_t __max_bytes) {
+    __detail::_Symbol_cache::_S_instance()._M_set_capacity(__max_bytes);
+  }
+
+  // Disables the cache and frees its memory.
+  static void disable() {
+    auto &__cache = __detail::_Symbol_cache::_S_instance();
+    __cache._M_set_capacity(0);
+    __cache._M_clear();
+  }
+
+  static bool enabled() noexcept {
+    return __detail::_Symbol_cache::_S_instance()._M_enabled();
+  }
+
+  static void clear() { __detail::_Symbol_cache::_S_instance()._M_clear(); }
+
+  // Approximate number of bytes used by the cached entries.
+  static std::size_t memory_usage() noexcept {
+    return __detail::_Symbol_cache::_S_instance()._M_memory_usage();
+  }
+};
+
+} // namespace fbbe
+
+#endif // _FBBE_BITS_SYMBOL_CACHE_H
@@ -0,0 +1,332 @@
+// Copyright Fabian Keßler 2022 - 2023.
+
+// Precomputed symbol index files -*- C++ -*-
+// Internal header, included by fbbe/stacktrace.h. Do not include directly.
+
+// fbbe_generate_symbol_index() in CMake writes <binary>.symidx next to a
+// linked binary: a table of address ranges sorted by link-time address, each
+// naming a demangled function, a source file and a line, followed by the
+// deduplicated strings. The starts of the ranges are also stored in the
+// search layout of _Address_table. The file is mapped read-only and searched
+// in place, so lookups share pages between processes and need neither the
+// debug information nor the heap. Modules without an index, or with an
+// index of a different build, are symbolized by libbacktrace as before.
+
+#pragma once
+#ifndef _FBBE_BITS_SYMBOL_INDEX_H
+#define _FBBE_BITS_SYMBOL_INDEX_H 1
+
+#include "address_table.h"
+#include "modules.h"
+#include "symbol_cache.h"
+
+#if _FBBE_MODULES && __has_include(<sys/mman.h>) && __has_include(<fcntl.h>)
+#define _FBBE_SYMBOL_INDEX 1
+#else
+#define _FBBE_SYMBOL_INDEX 0
+#endif
+
+#include <cstdint>
+
+namespace fbbe {
+
+namespace __detail {
+
+// On-disk layout, in the byte order of the target.
+struct _Symbol_index_header {
+  static constexpr char _S_magic[8] = {'F', 'B', 'B', 'E', 'S', 'Y', 'M', 0};
+  static constexpr std::uint32_t _S_version = 2;
+  static constexpr std::uint32_t _S_none = std::uint32_t(-1);
+
+  char _M_magic[8];
+  std::uint32_t _M_version;
+  // String holding the GNU build-id as hex digits, or _S_none.
+  std::uint32_t _M_build_id;
+  std::uint64_t _M_count;
+  // File offsets of the range table and of the string table.
+  std::uint64_t _M_ranges;
+  std::uint64_t _M_strings;
+  std::uint64_t _M_strings_size;
+  // File offsets of the nodes of the search tree over the range starts, 64
+  // byte aligned, and of the rank of each of their slots. There are
+  // (_M_count + 7) / 8 nodes.
+  std::uint64_t _M_tree;
+  std::uint64_t _M_tree_ranks;
+};
+
+// Covers the link-time addresses up to the start of the next range. Ranges
+// without a function mark gaps between functions.
+struct _Symbol_index_range {
+  std::uint64_t _M_start;
+  std::uint32_t _M_function;
+  std::uint32_t _M_file;
+  std::uint32_t _M_line;
+  std::uint32_t _M_reserved;
+};
+
+} // namespace __detail
+
+} // namespace fbbe
+
+#if _FBBE_SYMBOL_INDEX
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace fbbe {
+
+namespace __detail {
+
+class _Symbol_index {
+  const char *_M_data = nullptr;
+  std::size_t _M_size = 0;
+  const _Symbol_index_range *_M_ranges = nullptr;
+  std::size_t _M_count = 0;
+  const char *_M_strings = nullptr;
+  std::size_t _M_strings_size = 0;
+  // Search tree over the starts of the ranges, in the file.
+  _Address_tree _M_table;
+
+  const char *_M_string(std::uint32_t __offset) const noexcept {
+    return __offset < _M_strings_size ? _M_strings + __offset : nullptr;
+  }
+
+  // Reads the range of rank __rank.
+  bool _M_at(std::size_t __rank, _Cached_symbol &__out) const noexcept {
+    if (__rank >= _M_count) // also _S_npos, or a corrupt tree
+      return false;
+    const _Symbol_index_range &__r = _M_ranges[__rank];
+    const char *__function = _M_string(__r._M_function);
+    if (!__function)
+      return false;
+    __out._M_desc = __function;
+    __out._M_file = _M_string(__r._M_file);
+    __out._M_line = int(__r._M_line);
+    __out._M_resolved = true;
+    return true;
+  }
+
+  bool _M_validate(const std::string &__build_id) {
+    _Symbol_index_header __h;
+    std::memcpy(&__h, _M_data, sizeof(__h));
+    if (std::memcmp(__h._M_magic, _Symbol_index_header::_S_magic, 8) != 0 ||
+        __h._M_version != _Symbol_index_header::_S_version)
+      return false;
+    if (__h._M_ranges % alignof(_Symbol_index_range) != 0 ||
+        __h._M_ranges > _M_size || __h._M_count > std::uint32_t(-1) ||
+        __h._M_count > (_M_size - __h._M_ranges) / sizeof(_Symbol_index_range))
+      return false;
+    if (__h._M_strings > _M_size || __h._M_strings_size == 0 ||
+        __h._M_strings_size > _M_size - __h._M_strings ||
+        _M_data[__h._M_strings + __h._M_strings_size - 1] != '\0')
+      return false;
+    _M_ranges =
+        reinterpret_cast<const _Symbol_index_range *>(_M_data + __h._M_ranges);
+    _M_count = __h._M_count;
+    _M_strings = _M_data + __h._M_strings;
+    _M_strings_size = __h._M_strings_size;
+
+    const std::size_t __blocks =
+        (_M_count + _Address_tree::_S_width - 1) / _Address_tree::_S_width;
+    const std::size_t __slots = __blocks * _Address_tree::_S_width;
+    if (__h._M_tree % alignof(_Address_node) != 0 || __h._M_tree > _M_size ||
+        __blocks > (_M_size - __h._M_tree) / sizeof(_Address_node))
+      return false;
+    if (__h._M_tree_ranks % alignof(std::uint32_t) != 0 ||
+        __h._M_tree_ranks > _M_size ||
+        __slots > (_M_size - __h._M_tree_ranks) / sizeof(std::uint32_t))
+      return false;
+
+    const char *__id = _M_string(__h._M_build_id);
+    if ((__id ? __id : "") != __build_id)
+      return false;
+    _M_table = _Address_tree(
+        reinterpret_cast<const _Address_node *>(_M_data + __h._M_tree),
+        __blocks,
+        reinterpret_cast<const std::uint32_t *>(_M_data + __h._M_tree_ranks),
+        _M_count, _M_count ? _M_ranges[_M_count - 1]._M_start : 0);
+    return true;
+  }
+
+public:
+  _Symbol_index() = default;
+  _Symbol_index(const _Symbol_index &) = delete;
+  _Symbol_index &operator=(const _Symbol_index &) = delete;
+
+  ~_Symbol_index() {
+    if (_M_data)
+      ::munmap(const_cast<char *>(_M_data), _M_size);
+  }
+
+  // Maps the index at __path if it is well-formed and was generated for the
+  // build __build_id (hex digits, may be empty).
+  static std::unique_ptr<_Symbol_index> _S_open(const std::string &__path,
+                                                const std::string &__build_id) {
+    const int __fd = ::open(__path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (__fd < 0)
+      return nullptr;
+    struct stat __st;
+    void *__p = MAP_FAILED;
+    if (::fstat(__fd, &__st) == 0 &&
+        std::size_t(__st.st_size) >= sizeof(_Symbol_index_header))
+      __p = ::mmap(nullptr, __st.st_size, PROT_READ, MAP_SHARED, __fd, 0);
+    ::close(__fd);
+    if (__p == MAP_FAILED)
+      return nullptr;
+
+    std::unique_ptr<_Symbol_index> __index(new _Symbol_index);
+    __index->_M_data = static_cast<const char *>(__p);
+    __index->_M_size = __st.st_size;
+    if (!__index->_M_validate(__build_id))
+      return nullptr;
+    return __index;
+  }
+
+  // Looks up a link-time address.
+  bool _M_find(std::uint64_t __addr, _Cached_symbol &__out) const noexcept {
+    return _M_at(_M_table._M_find(__addr), __out);
+  }
+
+  // Looks up __n link-time addresses side by side; __found[__i] tells
+  // whether __out[__i] was set.
+  void _M_find(const std::uint64_t *__addrs, std::size_t __n,
+               _Cached_symbol *__out, bool *__found) const noexcept {
+    constexpr std::size_t __chunk = 64;
+    std::size_t __ranks[__chunk];
+    for (std::size_t __i = 0; __i < __n; __i += __chunk) {
+      const auto __m = __n - __i < __chunk ? __n - __i : __chunk;
+      _M_table._M_find(__addrs + __i, __m, __ranks);
+      for (std::size_t __j = 0; __j < __m; ++__j)
+        __found[__i + __j] = _M_at(__ranks[__j], __out[__i + __j]);
+    }
+  }
+};
+
+// Index files of the loaded modules, opened on first use.
+class _Symbol_indexes {
+  std::shared_mutex _M_mutex;
+  // Per snapshot entry of the module map; null if the module has no index.
+  std::unordered_map<const module_info *, const _Symbol_index *> _M_modules;
+  // Owns the mapped files, by path and build-id.
+  std::unordered_map<std::string, std::unique_ptr<_Symbol_index>> _M_files;
+  std::atomic<bool> _M_enabled{true};
+
+  const _Symbol_index *_M_open(const module_info &__m) {
+    {
+      std::shared_lock<std::shared_mutex> __lock(_M_mutex);
+      const auto __it = _M_modules.find(&__m);
+      if (__it != _M_modules.end())
+        return __it->second;
+    }
+    std::unique_lock<std::shared_mutex> __lock(_M_mutex);
+    auto &__file = _M_files[__m.path + '\0' + __m.build_id];
+    if (!__file && !__m.path.empty())
+      __file = _Symbol_index::_S_open(__m.path + ".symidx", __m.build_id);
+    return _M_modules[&__m] = __file.get();
+  }
+
+public:
+  // Never destroyed, the returned strings point into the mapped files.
+  static _Symbol_indexes &_S_instance() {
+    static _Symbol_indexes *__instance = new _Symbol_indexes;
+    return *__instance;
+  }
+
+  bool _M_is_enabled() const noexcept {
+    return _M_enabled.load(std::memory_order_relaxed);
+  }
+
+  void _M_set_enabled(bool __enabled) noexcept {
+    _M_enabled.store(__enabled, std::memory_order_relaxed);
+  }
+
+  const _Symbol_index *_M_find_index(std::uintptr_t __pc,
+                                     std::uintptr_t &__base) {
+    const module_info *__m = nullptr;
+    module_map::find_cached(&__pc, 1, &__m);
+    if (!__m)
+      return nullptr;
+    __base = __m->base;
+    return _M_open(*__m);
+  }
+
+  bool _M_lookup(std::uintptr_t __pc, _Cached_symbol &__out) {
+    if (!_M_is_enabled())
+      return false;
+    std::uintptr_t __base = 0;
+    const auto *__index = _M_find_index(__pc, __base);
+    return __index && __index->_M_find(__pc - __base, __out);
+  }
+
+  // Like _M_lookup for each of the __n addresses at __pcs; __found[__i]
+  // tells whether __out[__i] was set. Addresses in the same module should
+  // be adjacent, e.g. sorted, so each index is searched in batches.
+  void _M_lookup(const std::uintptr_t *__pcs, std::size_t __n,
+                 _Cached_symbol *__out, bool *__found) {
+    std::fill(__found, __found + __n, false);
+    if (!_M_is_enabled() || __n == 0)
+      return;
+    std::vector<const module_info *> __modules(__n);
+    module_map::find_cached(__pcs, __n, __modules.data());
+    std::vector<std::uint64_t> __addrs;
+    for (std::size_t __i = 0, __j; __i < __n; __i = __j) {
+      for (__j = __i + 1; __j < __n && __modules[__j] == __modules[__i];)
+        ++__j;
+      if (!__modules[__i])
+        continue;
+      const auto *__index = _M_open(*__modules[__i]);
+      if (!__index)
+        continue;
+      __addrs.assign(__pcs + __i, __pcs + __j);
+      for (auto &__a : __addrs)
+        __a -= __modules[__i]->base;
+      __index->_M_find(__addrs.data(), __j - __i, __out + __i, __found + __i);
+    }
+  }
+};
+
+} // namespace __detail
+
+// [fbbe.symbol.index], precomputed symbol index files
+
+// Controls the use of the .symidx files written by the CMake function
+// fbbe_generate_symbol_index(). Enabled by default.
+struct symbol_index {
+  static void enable() noexcept {
+    __detail::_Symbol_indexes::_S_instance()._M_set_enabled(true);
+  }
+
+  static void disable() noexcept {
+    __detail::_Symbol_indexes::_S_instance()._M_set_enabled(false);
+  }
+
+  static bool enabled() noexcept {
+    return __detail::_Symbol_indexes::_S_instance()._M_is_enabled();
+  }
+
+  // Whether the module containing __pc has a matching index.
+  static bool available(std::uintptr_t __pc) {
+    std::uintptr_t __base;
+    return __detail::_Symbol_indexes::_S_instance()._M_find_index(__pc,
+                                                                  __base);
+  }
+};
+
+} // namespace fbbe
+
+#endif // _FBBE_SYMBOL_INDEX
+
+#endif // _FBBE_BITS_SYMBOL_INDEX_H
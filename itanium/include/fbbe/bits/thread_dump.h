@@ -0,0 +1,467 @@
+// Copyright Fabian Keßler 2022 - 2023.
+
+// Stacks of all threads -*- C++ -*-
+// Internal header, included by fbbe/stacktrace.h. Do not include directly.
+
+// capture_all_threads() lists the threads of the process in /proc/self/task
+// and sends each one a reserved real-time signal. The handler finds the slot
+// prepared for its thread, captures the interrupted stack into it and counts
+// itself as answered; the caller sleeps on that counter (a futex) until every
+// thread answered or the timeout expired. Threads that block the signal, or
+// cannot run the handler in time, are reported with an empty trace.
+//
+// thread_dump_handler lets a signal such as SIGQUIT write such a dump to a
+// file. Its handler only wakes a thread started by install(), which takes
+// the dump and writes it.
+
+#pragma once
+#ifndef _FBBE_BITS_THREAD_DUMP_H
+#define _FBBE_BITS_THREAD_DUMP_H 1
+
+#if defined(__linux__) && __has_include(<dirent.h>) &&                         \
+    __has_include(<linux/futex.h>) && __has_include(<sys/syscall.h>) &&        \
+    __has_include(<unistd.h>)
+#define _FBBE_THREAD_DUMP 1
+#else
+#define _FBBE_THREAD_DUMP 0
+#endif
+
+#if _FBBE_THREAD_DUMP
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+namespace fbbe {
+
+// [fbbe.threads], stacks of all threads
+
+struct thread_dump_options {
+  // Real-time signal used to interrupt the threads; the program must not
+  // use it otherwise. 0 selects SIGRTMAX - 1.
+  int signal = 0;
+  // How long to wait for the threads to answer.
+  std::chrono::milliseconds timeout{100};
+  size_t max_frames = 64;
+};
+
+namespace __detail {
+
+class _Thread_dump {
+  friend class fbbe::profiler;
+
+  enum _Slot_state : int { _S_armed, _S_writing, _S_done, _S_abandoned };
+
+  struct _Slot {
+    pid_t _M_tid = 0;
+    std::atomic<int> _M_state{_S_armed};
+    size_t _M_size = 0;
+  };
+
+  // One capture_all_threads() call, shared with the handlers.
+  struct _Request {
+    std::unique_ptr<_Slot[]> _M_slots;
+    size_t _M_count = 0;
+    std::unique_ptr<stacktrace_entry::native_handle_type[]> _M_pcs;
+    size_t _M_max_frames = 0;
+    // Futex word, woken when the last thread answered.
+    std::atomic<int> _M_answered{0};
+    int _M_expected = 0;
+  };
+
+  struct _State {
+    std::mutex _M_mutex;
+    std::atomic<_Request *> _M_request{nullptr};
+    // Handlers running, _M_request may not be freed while they do.
+    std::atomic<int> _M_active{0};
+    // Signals that have the handler installed.
+    std::atomic<unsigned long long> _M_installed{0};
+  };
+
+  static_assert(sizeof(std::atomic<int>) == sizeof(int));
+
+  // Never destroyed, a late signal may arrive while the program exits.
+  static _State &_S_state() {
+    static _State *__state = new _State();
+    return *__state;
+  }
+
+  static pid_t _S_tid() noexcept { return pid_t(::syscall(SYS_gettid)); }
+
+  static long _S_futex(std::atomic<int> &__word, int __op, int __value,
+                       const timespec *__timeout = nullptr) noexcept {
+    return ::syscall(SYS_futex, reinterpret_cast<int *>(&__word), __op,
+                     __value, __timeout, nullptr, 0);
+  }
+
+  static void _S_handle(int, siginfo_t *, void *__context) {
+    const int __saved_errno = errno;
+    auto &__s = _S_state();
+    __s._M_active.fetch_add(1);
+    _Request *__r = __s._M_request.load();
+    const pid_t __tid = __r ? _S_tid() : 0;
+    for (size_t __i = 0; __r && __i < __r->_M_count; ++__i) {
+      _Slot &__slot = __r->_M_slots[__i];
+      if (__slot._M_tid != __tid)
+        continue;
+      int __armed = _S_armed;
+      if (!__slot._M_state.compare_exchange_strong(__armed, _S_writing))
+        break; // answered already, or given up on
+      auto *__pcs = __r->_M_pcs.get() + __i * __r->_M_max_frames;
+#if _FBBE_CONTEXT_UNWIND
+      // Looking up the stack bounds or unwind tables could lock or allocate.
+      __slot._M_size = __context ? orc_unwinder_t::_S_capture(
+                                       *static_cast<ucontext_t *>(__context),
+                                       __pcs, __r->_M_max_frames, false)
+                                 : 0;
+#else
+      (void)__context;
+      // Includes the handler and the signal trampoline.
+      __slot._M_size = capture_current(__pcs, __r->_M_max_frames);
+#endif
+      __slot._M_state.store(_S_done, std::memory_order_release);
+      if (__r->_M_answered.fetch_add(1) + 1 == __r->_M_expected)
+        _S_futex(__r->_M_answered, FUTEX_WAKE_PRIVATE, 1);
+      break;
+    }
+    __s._M_active.fetch_sub(1);
+    errno = __saved_errno;
+  }
+
+  static bool _S_install(_State &__s, int __sig) noexcept {
+    const auto __bit = 1ull << (__sig % 64);
+    if (__s._M_installed.load() & __bit)
+      return true;
+    struct sigaction __action;
+    std::memset(&__action, 0, sizeof(__action));
+    __action.sa_sigaction = _S_handle;
+    // SA_RESTART, so interrupted threads do not see EINTR from most calls.
+    __action.sa_flags = SA_SIGINFO | SA_RESTART | SA_ONSTACK;
+    sigemptyset(&__action.sa_mask);
+    if (::sigaction(__sig, &__action, nullptr) != 0)
+      return false;
+    __s._M_installed.fetch_or(__bit);
+    return true;
+  }
+
+  static std::vector<pid_t> _S_threads() {
+    std::vector<pid_t> __tids;
+    DIR *__dir = ::opendir("/proc/self/task");
+    if (!__dir)
+      return __tids;
+    while (const dirent *__e = ::readdir(__dir)) {
+      pid_t __tid = 0;
+      const char *__p = __e->d_name;
+      for (; *__p >= '0' && *__p <= '9'; ++__p)
+        __tid = __tid * 10 + (*__p - '0');
+      if (*__p == '\0' && __tid > 0)
+        __tids.push_back(__tid);
+    }
+    ::closedir(__dir);
+    return __tids;
+  }
+
+  // Waits until every signalled thread answered or __deadline passed.
+  static void _S_wait(_Request &__r,
+                      std::chrono::steady_clock::time_point __deadline) {
+    for (;;) {
+      const int __answered = __r._M_answered.load();
+      if (__answered == __r._M_expected)
+        return;
+      const auto __left = __deadline - std::chrono::steady_clock::now();
+      if (__left <= __left.zero())
+        return;
+      const auto __ns =
+          std::chrono::duration_cast<std::chrono::nanoseconds>(__left).count();
+      timespec __ts;
+      __ts.tv_sec = time_t(__ns / 1000000000);
+      __ts.tv_nsec = long(__ns % 1000000000);
+      _S_futex(__r._M_answered, FUTEX_WAIT_PRIVATE, __answered, &__ts);
+    }
+  }
+
+  static stacktrace _S_trace(const stacktrace_entry::native_handle_type *__pcs,
+                             size_t __n) {
+    stacktrace __st;
+    if (__n == 0)
+      return __st;
+    if (auto __cb = __st._M_prepare(
+            stacktrace::size_type(std::min<size_t>(__n, 0xffff)))) {
+      for (size_t __i = 0; __i < __n; ++__i)
+        if (__cb(&__st, __pcs[__i]) != 0)
+          break;
+    }
+    return __st;
+  }
+
+public:
+  static int _S_signal(const thread_dump_options &__options) noexcept {
+    return __options.signal ? __options.signal : SIGRTMAX - 1;
+  }
+
+  // Stacks of all threads. The calling thread is reported with the __n
+  // frames at __self, or not at all if __self is null.
+  static std::map<pid_t, stacktrace>
+  _S_capture(const thread_dump_options &__options,
+             const stacktrace_entry::native_handle_type *__self, size_t __n) {
+    std::map<pid_t, stacktrace> __result;
+    auto &__s = _S_state();
+    const int __sig = _S_signal(__options);
+    const size_t __max = std::min<size_t>(__options.max_frames, 0xffff);
+    std::lock_guard<std::mutex> __lock(__s._M_mutex);
+    if (__max == 0 || !_S_install(__s, __sig))
+      return __result;
+#if _FBBE_ORC_UNWINDER
+    // The handlers must not build the tables.
+    _Orc_registry::_S_instance()._M_load_all();
+#endif
+
+    const pid_t __pid = ::getpid();
+    const pid_t __me = _S_tid();
+    auto __tids = _S_threads();
+    std::unique_ptr<_Request> __r(new _Request);
+    __r->_M_slots.reset(new _Slot[__tids.size()]);
+    __r->_M_pcs.reset(
+        new stacktrace_entry::native_handle_type[__tids.size() * __max]);
+    __r->_M_max_frames = __max;
+    for (const pid_t __tid : __tids)
+      if (__tid != __me)
+        __r->_M_slots[__r->_M_count++]._M_tid = __tid;
+    __r->_M_expected = int(__r->_M_count);
+    __s._M_request.store(__r.get());
+
+    const auto __deadline =
+        std::chrono::steady_clock::now() + __options.timeout;
+    for (size_t __i = 0; __i < __r->_M_count; ++__i) {
+      _Slot &__slot = __r->_M_slots[__i];
+      if (::syscall(SYS_tgkill, __pid, __slot._M_tid, __sig) != 0) {
+        // The thread exited since it was listed.
+        __slot._M_tid = 0;
+        __slot._M_state.store(_S_abandoned);
+        __r->_M_answered.fetch_add(1);
+      }
+    }
+    if (__self)
+      __result.emplace(__me, _S_trace(__self, __n));
+    _S_wait(*__r, __deadline);
+
+    for (size_t __i = 0; __i < __r->_M_count; ++__i) {
+      int __armed = _S_armed;
+      __r->_M_slots[__i]._M_state.compare_exchange_strong(__armed,
+                                                          _S_abandoned);
+    }
+    __s._M_request.store(nullptr);
+    // A handler still writing a slot holds on to the request. If one does
+    // not finish in time, e.g. because it waits for a lock held by the
+    // thread it interrupted, the request is leaked rather than freed.
+    const auto __grace = std::chrono::steady_clock::now() + __options.timeout;
+    bool __drained = true;
+    while (__s._M_active.load() != 0 && __drained) {
+      __drained = std::chrono::steady_clock::now() < __grace;
+      ::sched_yield();
+    }
+
+    for (size_t __i = 0; __i < __r->_M_count; ++__i) {
+      const _Slot &__slot = __r->_M_slots[__i];
+      if (__slot._M_tid == 0)
+        continue;
+      const bool __done =
+          __slot._M_state.load(std::memory_order_acquire) == _S_done;
+      __result.emplace(__slot._M_tid,
+                       _S_trace(__r->_M_pcs.get() + __i * __max,
+                                __done ? __slot._M_size : 0));
+    }
+    if (!__drained)
+      __r.release();
+    return __result;
+  }
+};
+
+} // namespace __detail
+
+// Captures the stack of every thread of the process, by thread id. Each
+// thread records its own stack in a handler for __options.signal; threads
+// that do not answer within __options.timeout, e.g. because they block the
+// signal, have an empty trace. The calling thread's trace starts at the
+// caller of capture_all_threads().
+//
+// The handler is installed by the first call and stays installed. Like any
+// signal, it makes some blocking calls of the interrupted threads fail with
+// EINTR, e.g. nanosleep and epoll_wait.
+[[__gnu__::__noinline__]] inline std::map<pid_t, stacktrace>
+capture_all_threads(const thread_dump_options &__options = {}) {
+  stacktrace_entry::native_handle_type __pcs[256];
+  const size_t __n =
+      capture_current(__pcs, std::min<size_t>(__options.max_frames, 256), 1);
+  return __detail::_Thread_dump::_S_capture(__options, __pcs, __n);
+}
+
+struct thread_dump_handler_options {
+  // The signal that requests a dump.
+  int signal = SIGQUIT;
+  // The dump is appended to this file; to stderr if empty.
+  std::string path;
+  // Resolve function names, files and lines; otherwise frames are written
+  // as "0x<pc> <module>+0x<offset>" for fbbe_symbolize.
+  bool symbolize = true;
+  thread_dump_options dump;
+};
+
+class thread_dump_handler {
+public:
+  // Makes options.signal write the stacks of all threads. The dump is taken
+  // by a thread started on the first call, not in the signal handler.
+  // Installing again replaces the options. Returns false if the handler
+  // could not be installed.
+  static bool install(const thread_dump_handler_options &__options = {}) {
+    auto &__s = _S_state();
+    {
+      std::lock_guard<std::mutex> __lock(__s._M_mutex);
+      __s._M_options = __options;
+      if (__s._M_pipe[1] < 0) {
+        if (::pipe2(__s._M_pipe, O_CLOEXEC) != 0)
+          return false;
+        // Signals that arrive while a dump is pending are dropped.
+        ::fcntl(__s._M_pipe[1], F_SETFL, O_NONBLOCK);
+        std::thread(_S_run, std::ref(__s)).detach();
+      }
+    }
+    uninstall();
+    struct sigaction __action;
+    std::memset(&__action, 0, sizeof(__action));
+    __action.sa_handler = _S_handle;
+    __action.sa_flags = SA_RESTART;
+    sigemptyset(&__action.sa_mask);
+    if (::sigaction(__options.signal, &__action, &__s._M_previous) != 0)
+      return false;
+    __s._M_signal = __options.signal;
+    return true;
+  }
+
+  // Restores the handler that was installed before install().
+  static void uninstall() noexcept {
+    auto &__s = _S_state();
+    if (__s._M_signal == 0)
+      return;
+    ::sigaction(__s._M_signal, &__s._M_previous, nullptr);
+    __s._M_signal = 0;
+  }
+
+private:
+  struct _State {
+    std::mutex _M_mutex;
+    thread_dump_handler_options _M_options;
+    int _M_pipe[2] = {-1, -1};
+    int _M_signal = 0;
+    struct sigaction _M_previous;
+  };
+
+  // Never destroyed, the dump thread outlives main().
+  static _State &_S_state() {
+    static _State *__state = new _State();
+    return *__state;
+  }
+
+  static void _S_handle(int) {
+    const int __saved_errno = errno;
+    const char __c = 0;
+    [[maybe_unused]] auto __n = ::write(_S_state()._M_pipe[1], &__c, 1);
+    errno = __saved_errno;
+  }
+
+  static void _S_run(_State &__s) {
+    for (char __c;;) {
+      const auto __n = ::read(__s._M_pipe[0], &__c, 1);
+      if (__n < 0 && errno == EINTR)
+        continue;
+      if (__n <= 0)
+        return;
+      thread_dump_handler_options __options;
+      {
+        std::lock_guard<std::mutex> __lock(__s._M_mutex);
+        __options = __s._M_options;
+      }
+      _S_write(__options);
+    }
+  }
+
+  static void _S_write(const thread_dump_handler_options &__options) {
+    const auto __threads =
+        __detail::_Thread_dump::_S_capture(__options.dump, nullptr, 0);
+    int __fd = STDERR_FILENO;
+    if (!__options.path.empty())
+      __fd = ::open(__options.path.c_str(),
+                    O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (__fd < 0)
+      return;
+
+    __detail::_Fd_writer __w(__fd);
+    auto __out = __detail::_Format::_S_padded(__w._M_out(), "*** pid ", 0);
+    __out = __detail::_Format::_S_number(__out, ::getpid(), 0);
+    __out = __detail::_Format::_S_padded(__out, ", ", 0);
+    __out = __detail::_Format::_S_number(__out, __threads.size(), 0);
+    __detail::_Format::_S_padded(__out, " threads ***\n", 0);
+    __w._M_flush();
+
+    write_options __write;
+    __write.raw = !__options.symbolize;
+    for (const auto &[__tid, __st] : __threads) {
+      __out = __detail::_Format::_S_padded(__w._M_out(), "\nthread ", 0);
+      __out = __detail::_Format::_S_number(__out, __tid, 0);
+      char __name[32];
+      if (const size_t __len = _S_name(__tid, __name, sizeof(__name))) {
+        __out = __detail::_Format::_S_padded(__out, " \"", 0);
+        __out = __detail::_Format::_S_padded(
+            __out, std::string_view(__name, __len), 0);
+        *__out++ = '"';
+      }
+      if (__st.empty())
+        __detail::_Format::_S_padded(__out, ": no answer", 0);
+      __w._M_put('\n');
+      __w._M_flush();
+      write_stacktrace(__fd, __st, __write);
+    }
+    if (__fd != STDERR_FILENO)
+      ::close(__fd);
+  }
+
+  // Reads the name of thread __tid, without the trailing newline.
+  static size_t _S_name(pid_t __tid, char *__buf, size_t __size) {
+    const auto __path = "/proc/self/task/" + std::to_string(__tid) + "/comm";
+    const int __fd = ::open(__path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (__fd < 0)
+      return 0;
+    const auto __n = ::read(__fd, __buf, __size);
+    ::close(__fd);
+    if (__n <= 0)
+      return 0;
+    size_t __len = size_t(__n);
+    while (__len && __buf[__len - 1] == '\n')
+      --__len;
+    return __len;
+  }
+};
+
+} // namespace fbbe
+
+#endif // _FBBE_THREAD_DUMP
+
+#endif // _FBBE_BITS_THREAD_DUMP_H
@@ -0,0 +1,78 @@
+// Copyright Fabian Keßler 2022 - 2023.
+
+// One-time warm-up of the symbolizer -*- C++ -*-
+// Internal header, included by fbbe/stacktrace.h. Do not include directly.
+
+// The first query of libbacktrace reads the debug information of every loaded
+// module. _Warm_up runs that step exactly once: either on a background thread
+// started by stacktrace_preload(), or on the first thread that needs a symbol.
+// Threads arriving while it runs wait for it instead of parsing as well.
+
+#pragma once
+#ifndef _FBBE_BITS_WARM_UP_H
+#define _FBBE_BITS_WARM_UP_H 1
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+namespace fbbe {
+
+namespace __detail {
+
+class _Warm_up {
+  std::atomic<bool> _M_done{false};
+  std::mutex _M_mutex;
+  std::condition_variable _M_cv;
+  bool _M_running = false;
+  bool _M_started = false;
+
+public:
+  // Never destroyed: a background warm-up may still run while the program
+  // exits.
+  static _Warm_up &_S_instance() {
+    static _Warm_up *__instance = new _Warm_up;
+    return *__instance;
+  }
+
+  bool _M_is_done() const noexcept {
+    return _M_done.load(std::memory_order_acquire);
+  }
+
+  // Runs __f unless it already ran; waits if another thread is running it.
+  void _M_run(void (*__f)() noexcept) {
+    if (_M_is_done())
+      return;
+    std::unique_lock<std::mutex> __lock(_M_mutex);
+    _M_cv.wait(__lock, [this] { return !_M_running; });
+    if (_M_done.load(std::memory_order_relaxed))
+      return;
+    _M_running = true;
+    __lock.unlock();
+    __f();
+    __lock.lock();
+    _M_running = false;
+    _M_done.store(true, std::memory_order_release);
+    _M_cv.notify_all();
+  }
+
+  // Runs __f on a new thread, unless it already ran or was started.
+  void _M_start(void (*__f)() noexcept) {
+    if (_M_is_done())
+      return;
+    {
+      std::lock_guard<std::mutex> __lock(_M_mutex);
+      if (_M_started)
+        return;
+      _M_started = true;
+    }
+    std::thread([this, __f] { _M_run(__f); }).detach();
+  }
+};
+
+} // namespace __detail
+
+} // namespace fbbe
+
+#endif // _FBBE_BITS_WARM_UP_H
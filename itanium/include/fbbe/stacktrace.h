@@ -60,17 +60,45 @@ using stacktrace = std::pmr::stacktrace;
 
 #pragma GCC system_header
 
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <iterator>
 #include <limits>
 #include <memory>
 #include <new>
 #include <sstream>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <type_traits>
 #include <utility>
+#include <vector>
 
 #if __has_include(<compare>)
 #include <compare>
 #endif
 
+#if __has_include(<unistd.h>)
+#include <unistd.h>
+#endif
+
+#if defined(__linux__) && __has_include(<ucontext.h>) &&                      \
+    (defined(__x86_64__) || defined(__i386__) || defined(__aarch64__))
+#include <ucontext.h>
+#define _FBBE_CONTEXT_UNWIND 1
+#else
+#define _FBBE_CONTEXT_UNWIND 0
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__) || defined(__aarch64__)) &&      \
+    (defined(__GLIBC__) || defined(__APPLE__))
+#include <pthread.h>
+#define _FBBE_FRAME_POINTER_UNWINDER 1
+#else
+#define _FBBE_FRAME_POINTER_UNWINDER 0
+#endif
+
 #if __has_include(<backtrace.h>)
 #include <backtrace.h>
 #else
@@ -113,16 +141,40 @@ int backtrace_syminfo(backtrace_state *, __UINTPTR_TYPE__ addr,
   #define _FBBE_CATCH(x) catch(x)
 #endif
 
+#include "bits/orc_unwind.h"
+#include "bits/address_table.h"
+#include "bits/modules.h"
+#include "bits/name_pool.h"
+#include "bits/symbol_cache.h"
+#include "bits/symbol_index.h"
+#include "bits/warm_up.h"
 
 
-namespace __cxxabiv1 {
-extern "C" char *__cxa_demangle(const char *__mangled_name,
-                                char *__output_buffer, size_t *__length,
-                                int *__status);
-}
-
 namespace fbbe {
 
+// [fbbe.symbol], resolved symbol information of a stacktrace_entry
+struct stacktrace_symbol {
+  std::string description;
+  std::string source_file;
+  __UINT_LEAST32_TYPE__ source_line = 0;
+  // False if nothing is known about the entry, e.g. for an empty entry.
+  bool resolved = false;
+};
+
+template <typename _Allocator> class basic_stacktrace;
+class compact_stacktrace;
+class shared_stacktrace;
+class stacktrace_view;
+
+class crash_handler;
+class profiler;
+class stack_table;
+
+namespace __detail {
+struct _Format;
+class _Thread_dump;
+}
+
 // [stacktrace.entry], class stacktrace_entry
 class stacktrace_entry {
   using uint_least32_t = __UINT_LEAST32_TYPE__;
@@ -168,6 +220,15 @@ public:
     return __line;
   }
 
+  // Like description() and source_file(), but without allocating once the
+  // name was seen. The views stay valid until the end of the program.
+  std::string_view description_view() const { return _M_symbol()._M_desc; }
+
+  std::string_view source_file_view() const {
+    const auto __file = _M_symbol()._M_file;
+    return __file ? __file : std::string_view();
+  }
+
   // [stacktrace.entry.cmp], comparison
 #if _HAS_CXX20
 
@@ -220,6 +281,7 @@ private:
   native_handle_type _M_pc = -1;
 
   template <typename _Allocator> friend class basic_stacktrace;
+  friend struct default_unwinder_t;
 
   static void _S_err_handler(void *, const char *, int) {}
 
@@ -230,64 +292,699 @@ private:
   }
 
   friend std::ostream &operator<<(std::ostream &, const stacktrace_entry &);
+  friend struct __detail::_Format;
+  friend class crash_handler;
+  friend class stack_table;
+  friend class stacktrace_view;
+  friend void stacktrace_preload();
+  friend void stacktrace_preload_wait();
+
+  // Builds the state and makes libbacktrace read the debug information of
+  // all loaded modules.
+  static void _S_prepare() noexcept {
+    const auto __state = _S_init();
+    if (!__state)
+      return;
+    const auto __pc = reinterpret_cast<uintptr_t>(&_S_err_handler);
+    auto __cb = [](void *, uintptr_t, const char *, int, const char *) {
+      return 1;
+    };
+    ::backtrace_pcinfo(__state, __pc, +__cb, _S_err_handler, nullptr);
+    auto __cb2 = [](void *, uintptr_t, const char *, uintptr_t, uintptr_t) {};
+    ::backtrace_syminfo(__state, __pc, +__cb2, _S_err_handler, nullptr);
+  }
+
+  friend std::vector<stacktrace_symbol> symbolize(stacktrace_view);
+
+  // Resolves __n entries at once, looking up every distinct address once.
+  template <typename _Iter>
+  static void _S_symbolize(_Iter __first, size_t __n,
+                           stacktrace_symbol *__out) {
+    std::vector<size_t> __order(__n);
+    for (size_t __i = 0; __i < __n; ++__i)
+      __order[__i] = __i;
+    std::sort(__order.begin(), __order.end(), [__first](size_t __x, size_t __y) {
+      return __first[__x]._M_pc < __first[__y]._M_pc;
+    });
+    __detail::_Symbol_cache::_S_instance()._M_validate();
+#if _FBBE_SYMBOL_INDEX
+    // Addresses covered by symbol index files are searched side by side.
+    std::vector<uintptr_t> __pcs(__n);
+    for (size_t __i = 0; __i < __n; ++__i)
+      __pcs[__i] = __first[__order[__i]]._M_pc;
+    std::vector<__detail::_Cached_symbol> __indexed(__n);
+    std::unique_ptr<bool[]> __found(new bool[__n]);
+    __detail::_Symbol_indexes::_S_instance()._M_lookup(
+        __pcs.data(), __n, __indexed.data(), __found.get());
+#endif
+    for (size_t __i = 0; __i < __n;) {
+      const stacktrace_entry __f = __first[__order[__i]];
+      stacktrace_symbol &__sym = __out[__order[__i]];
+#if _FBBE_SYMBOL_INDEX
+      const auto __ref = __found[__i] ? __indexed[__i] : __f._M_lookup();
+#else
+      const auto __ref = __f._M_lookup();
+#endif
+      __sym.description = __ref._M_desc;
+      if (__ref._M_file)
+        __sym.source_file = __ref._M_file;
+      __sym.source_line = __ref._M_line;
+      __sym.resolved = __ref._M_resolved;
+      size_t __j = __i + 1;
+      for (; __j < __n && __first[__order[__j]]._M_pc == __f._M_pc; ++__j)
+        __out[__order[__j]] = __sym;
+      __i = __j;
+    }
+  }
 
   bool _M_get_info(std::string *__desc, std::string *__file,
                    int *__line) const {
+    const auto __sym = _M_symbol();
+    if (__desc)
+      *__desc = __sym._M_desc;
+    if (__file && __sym._M_file)
+      *__file = __sym._M_file;
+    if (__line)
+      *__line = __sym._M_line;
+    return __sym._M_resolved;
+  }
+
+  __detail::_Cached_symbol _M_symbol() const {
+    __detail::_Symbol_cache::_S_instance()._M_validate();
+    return _M_lookup();
+  }
+
+  // Like _M_symbol, but does not check whether the symbol cache is stale.
+  __detail::_Cached_symbol _M_lookup() const {
     if (!*this)
-      return false;
+      return {};
 
-    struct _Data {
-      std::string *_M_desc;
-      std::string *_M_file;
-      int *_M_line;
-    } __data = {__desc, __file, __line};
+    auto &__cache = __detail::_Symbol_cache::_S_instance();
+    if (!__cache._M_enabled())
+      return _M_resolve();
+
+    __detail::_Cached_symbol __sym;
+    if (!__cache._M_find(_M_pc, __sym)) {
+      __sym = _M_resolve();
+      __cache._M_insert(_M_pc, __sym);
+    }
+    return __sym;
+  }
 
+  __detail::_Cached_symbol _M_resolve() const {
+    __detail::_Cached_symbol __sym;
+#if _FBBE_SYMBOL_INDEX
+    if (__detail::_Symbol_indexes::_S_instance()._M_lookup(_M_pc, __sym))
+      return __sym;
+#endif
     auto __cb = [](void *__data, uintptr_t, const char *__filename,
                    int __lineno, const char *__function) -> int {
-      auto &__d = *static_cast<_Data *>(__data);
-      if (__function && __d._M_desc)
-        *__d._M_desc = _S_demangle(__function);
-      if (__filename && __d._M_file)
-        *__d._M_file = __filename;
-      if (__d._M_line)
-        *__d._M_line = __lineno;
+      auto &__s = *static_cast<__detail::_Cached_symbol *>(__data);
+      if (__function)
+        __s._M_desc = __detail::_Name_pool::_S_instance()._M_demangle(__function);
+      __s._M_file = __filename;
+      __s._M_line = __lineno;
       return __function != nullptr;
     };
+    __detail::_Warm_up::_S_instance()._M_run(_S_prepare);
     const auto __state = _S_init();
-    if (::backtrace_pcinfo(__state, _M_pc, +__cb, _S_err_handler, &__data))
-      return true;
-    if (__desc && __desc->empty()) {
+    if (::backtrace_pcinfo(__state, _M_pc, +__cb, _S_err_handler, &__sym)) {
+      __sym._M_resolved = true;
+      return __sym;
+    }
+    if (__sym._M_desc.empty()) {
       auto __cb2 = [](void *__data, uintptr_t, const char *__symname, uintptr_t,
                       uintptr_t) {
         if (__symname)
-          *static_cast<_Data *>(__data)->_M_desc = _S_demangle(__symname);
+          static_cast<__detail::_Cached_symbol *>(__data)->_M_desc =
+              __detail::_Name_pool::_S_instance()._M_demangle(__symname);
       };
-      if (::backtrace_syminfo(__state, _M_pc, +__cb2, _S_err_handler, &__data))
+      if (::backtrace_syminfo(__state, _M_pc, +__cb2, _S_err_handler, &__sym))
+        __sym._M_resolved = true;
+    }
+    return __sym;
+  }
+};
+
+// [fbbe.capture], allocation-free capture
+
+// Writes the program counters of at most __size frames of the calling
+// thread into __buffer, innermost first, and returns how many were written.
+// __skip frames are omitted, starting with the caller of capture_current.
+// The values are the same as stacktrace_entry::native_handle() of the
+// entries produced by basic_stacktrace::current().
+//
+// This function does not allocate, takes no locks of this library and does
+// not touch the lazily created backtrace_state, so it may be called from
+// allocator hooks and while holding allocator locks. The locks it can take
+// are those of the unwinder: like every _Unwind_Backtrace based unwinder,
+// the very first unwind of a process may have to load libgcc_s, so capture
+// once during startup if the first capture could happen inside a signal
+// handler; and on glibc before 2.35, which lacks _dl_find_object,
+// _Unwind_Find_FDE takes libgcc's object mutex and the loader's lock
+// through dl_iterate_phdr, so a signal interrupting a thread that holds
+// one of them can deadlock.
+[[__gnu__::__noinline__]] inline size_t
+capture_current(stacktrace_entry::native_handle_type *__buffer, size_t __size,
+                size_t __skip = 0) noexcept {
+  using uintptr_t = __UINTPTR_TYPE__;
+
+  if (__size == 0 || __skip >= __INT_MAX__ - 1) [[unlikely]]
+    return 0;
+
+  struct _Data {
+    uintptr_t *_M_buffer;
+    size_t _M_size;
+    size_t _M_depth;
+  } __data = {__buffer, __size, 0};
+
+  auto __cb = [](void *__data, uintptr_t __pc) -> int {
+    auto &__d = *static_cast<_Data *>(__data);
+    __d._M_buffer[__d._M_depth++] = __pc;
+    return __d._M_depth == __d._M_size; // stop tracing when the buffer is full
+  };
+  // backtrace_simple never dereferences the state, it only forwards it to
+  // the error callback, so the (allocating) stacktrace_entry::_S_init() is
+  // not needed here.
+  auto __err = [](void *, const char *, int) {};
+  ::backtrace_simple(nullptr, static_cast<int>(__skip) + 1, +__cb, +__err,
+                     &__data);
+  return __data._M_depth;
+}
+
+// [fbbe.preload], symbolizer warm-up
+
+// Reads the debug information needed for symbolization on a background
+// thread, so the first stacktrace printed does not pay for it. Queries made
+// in the meantime wait for the warm-up instead of repeating it. Calls after
+// the first have no effect.
+inline void stacktrace_preload() {
+  __detail::_Warm_up::_S_instance()._M_start(stacktrace_entry::_S_prepare);
+}
+
+// Blocks until the warm-up finished, running it on the calling thread if
+// stacktrace_preload() was not called.
+inline void stacktrace_preload_wait() {
+  __detail::_Warm_up::_S_instance()._M_run(stacktrace_entry::_S_prepare);
+}
+
+// [fbbe.unwind], unwinder selection
+
+template <typename _Tp> struct __is_unwinder : std::false_type {};
+
+// Walks the .eh_frame call frame information with libbacktrace's
+// backtrace_simple. Used by the current() overloads without an unwinder.
+struct default_unwinder_t {
+  explicit default_unwinder_t() = default;
+
+private:
+  template <typename _Allocator> friend class basic_stacktrace;
+  friend struct frame_pointer_unwinder_t;
+  friend struct orc_unwinder_t;
+
+  using uintptr_t = __UINTPTR_TYPE__;
+
+  // Same contract as backtrace_simple(): frames are counted from the function
+  // this is inlined into.
+  [[__gnu__::__always_inline__]] static int
+  _S_simple(int __skip, int (*__cb)(void *, uintptr_t), void *__data) noexcept {
+    return ::backtrace_simple(stacktrace_entry::_S_init(), __skip, __cb,
+                              stacktrace_entry::_S_err_handler, __data);
+  }
+};
+
+inline constexpr default_unwinder_t default_unwinder{};
+template <> struct __is_unwinder<default_unwinder_t> : std::true_type {};
+
+// Follows the chain of saved frame pointers, checking every frame pointer
+// against the stack of the calling thread. This is much faster than the
+// default unwinder and yields the same entries, as long as every function
+// on the stack keeps a frame pointer (-fno-omit-frame-pointer). The walk
+// stops at the first frame without one. Falls back to the default unwinder
+// on unsupported targets and when not running on the thread's stack, e.g.
+// on an alternate signal stack.
+struct frame_pointer_unwinder_t {
+  explicit frame_pointer_unwinder_t() = default;
+
+private:
+  template <typename _Allocator> friend class basic_stacktrace;
+  friend struct orc_unwinder_t;
+
+  using uintptr_t = __UINTPTR_TYPE__;
+
+  struct _Stack_bounds {
+    uintptr_t _M_low = 0;
+    uintptr_t _M_high = 0;
+
+    // Whether __n words at __addr are on the stack.
+    bool _M_contains(uintptr_t __addr, size_t __n = 1) const noexcept {
+      return __addr % alignof(uintptr_t) == 0 && __addr >= _M_low &&
+             __addr + __n * sizeof(uintptr_t) <= _M_high;
+    }
+
+    // A frame record is the caller's frame pointer and the return address.
+    bool _M_contains_frame(uintptr_t __fp) const noexcept {
+      return _M_contains(__fp, 2);
+    }
+  };
+
+#if _FBBE_FRAME_POINTER_UNWINDER
+  static _Stack_bounds &_S_thread_bounds() noexcept {
+    static thread_local _Stack_bounds __bounds;
+    return __bounds;
+  }
+
+  static _Stack_bounds _S_stack_bounds() noexcept {
+    auto &__bounds = _S_thread_bounds();
+    if (__bounds._M_high == 0) [[unlikely]] {
+#if defined(__APPLE__)
+      const pthread_t __self = pthread_self();
+      const auto __high =
+          reinterpret_cast<uintptr_t>(pthread_get_stackaddr_np(__self));
+      __bounds._M_low = __high - pthread_get_stacksize_np(__self);
+      __bounds._M_high = __high;
+#else
+      pthread_attr_t __attr;
+      if (pthread_getattr_np(pthread_self(), &__attr) != 0)
+        return __bounds;
+      void *__addr = nullptr;
+      size_t __size = 0;
+      if (pthread_attr_getstack(&__attr, &__addr, &__size) == 0) {
+        __bounds._M_low = reinterpret_cast<uintptr_t>(__addr);
+        __bounds._M_high = __bounds._M_low + __size;
+      }
+      pthread_attr_destroy(&__attr);
+#endif
+    }
+    return __bounds;
+  }
+#endif
+
+  [[__gnu__::__noinline__]] static int
+  _S_simple(int __skip, int (*__cb)(void *, uintptr_t), void *__data) noexcept {
+#if _FBBE_FRAME_POINTER_UNWINDER
+    const auto __bounds = _S_stack_bounds();
+    auto __fp = reinterpret_cast<uintptr_t>(__builtin_frame_address(0));
+    if (__bounds._M_contains_frame(__fp)) [[likely]] {
+      for (;;) {
+        const auto *__record = reinterpret_cast<const uintptr_t *>(__fp);
+        const uintptr_t __ra = __record[1];
+        if (__ra == 0)
+          break;
+        // Return addresses point after the call, report the call itself
+        // like backtrace_simple does.
+        if (__skip > 0)
+          --__skip;
+        else if (int __ret = __cb(__data, __ra - 1))
+          return __ret;
+        // The stack grows down, so callers' frames are at higher addresses.
+        const uintptr_t __next = __record[0];
+        if (__next <= __fp || !__bounds._M_contains_frame(__next))
+          break;
+        __fp = __next;
+      }
+      return 0;
+    }
+#endif
+    // Skip this frame, which is not inlined.
+    return default_unwinder_t::_S_simple(__skip + 1, __cb, __data);
+  }
+};
+
+inline constexpr frame_pointer_unwinder_t frame_pointer_unwinder{};
+template <> struct __is_unwinder<frame_pointer_unwinder_t> : std::true_type {};
+
+// Unwinds with compact tables built from the .eh_frame call frame
+// information of each loaded module the first time one of its frames is
+// walked, see fbbe/bits/orc_unwind.h. Does not need frame pointers and
+// yields the same entries as the default unwinder, continuing with the
+// default unwinder at the first frame the tables cannot describe. Only
+// available on x86-64 Linux, elsewhere this is the default unwinder.
+//
+// Building a table takes a lock and the loader's lock. Once the tables of
+// the modules on the stack were built, walks take no locks, except that
+// at most once per 10 ms, process-wide, a walk asks the loader (under its
+// lock) whether a module was unloaded, and drops all tables if so. Until
+// then a module mapped where an unloaded one was is walked with the old
+// module's table.
+struct orc_unwinder_t {
+  explicit orc_unwinder_t() = default;
+
+private:
+  template <typename _Allocator> friend class basic_stacktrace;
+  friend class profiler;
+
+  using uintptr_t = __UINTPTR_TYPE__;
+
+  struct _Registers {
+    uintptr_t _M_pc;
+    uintptr_t _M_sp;
+    uintptr_t _M_bp;
+  };
+
+#if _FBBE_ORC_UNWINDER && _FBBE_FRAME_POINTER_UNWINDER
+  // Reports the frame executing __r._M_pc and its callers, as far as the
+  // tables describe them. __r._M_pc is the exact instruction for the first
+  // frame if __exact, and a return address otherwise. __walked counts the
+  // frames passed to __cb or skipped. Returns false at the first frame the
+  // tables cannot describe, true if the walk ended or __cb stopped it (its
+  // result is stored in __ret). Without __lookup, neither the stack bounds
+  // of the thread nor unwind tables are looked up, which may lock and
+  // allocate: the walk only uses what is known already, as signal handlers
+  // must.
+  static bool _S_walk(_Registers __r, bool __exact, int __skip, int &__walked,
+                      int (*__cb)(void *, uintptr_t), void *__data, int &__ret,
+                      bool __lookup = true) noexcept {
+    using __detail::_Orc_row;
+
+    auto &__registry = __detail::_Orc_registry::_S_instance();
+    // Unknown bounds are empty, the walk ends at once.
+    const auto __bounds = __lookup
+                              ? frame_pointer_unwinder_t::_S_stack_bounds()
+                              : frame_pointer_unwinder_t::_S_thread_bounds();
+    if (__lookup)
+      __registry._M_refresh();
+    for (; __bounds._M_contains(__r._M_sp, 0); __exact = false) {
+      // Return addresses point after the call, report the call itself like
+      // backtrace_simple does. That includes the null return address of the
+      // outermost frame.
+      const uintptr_t __ip = __exact ? __r._M_pc : __r._M_pc - 1;
+      if (__walked++ >= __skip)
+        if ((__ret = __cb(__data, __ip)) != 0)
+          return true;
+      if (__r._M_pc == 0)
         return true;
+
+      const _Orc_row *__row = __registry._M_find(__ip, __lookup);
+      if (!__row || __row->_M_kind == _Orc_row::_S_unknown)
+        return false;
+      if (__row->_M_kind == _Orc_row::_S_end) {
+        __r._M_pc = 0;
+        continue;
+      }
+
+      const uintptr_t __cfa =
+          (__row->_M_cfa_reg == _Orc_row::_S_rsp ? __r._M_sp : __r._M_bp) +
+          __row->_M_cfa_offset;
+      const uintptr_t __ra_addr = __cfa + __row->_M_ra_offset;
+      const uintptr_t __bp_addr = __cfa + __row->_M_bp_offset;
+      if (!__bounds._M_contains(__ra_addr) ||
+          (__row->_M_bp_offset && !__bounds._M_contains(__bp_addr)))
+        return false;
+      if (__row->_M_bp_offset)
+        __r._M_bp = *reinterpret_cast<const uintptr_t *>(__bp_addr);
+      __r._M_pc = *reinterpret_cast<const uintptr_t *>(__ra_addr);
+      __r._M_sp = __cfa;
     }
     return false;
   }
+#endif
+
+  [[__gnu__::__noinline__]] static int
+  _S_simple(int __skip, int (*__cb)(void *, uintptr_t), void *__data) noexcept {
+    int __walked = 0; // frames already passed to __cb or skipped
+#if _FBBE_ORC_UNWINDER && _FBBE_FRAME_POINTER_UNWINDER
+    // Registers of the caller; __builtin_frame_address forces a frame
+    // pointer for this function, which holds the caller's rbp.
+    const _Registers __r = {
+        reinterpret_cast<uintptr_t>(__builtin_return_address(0)),
+        reinterpret_cast<uintptr_t>(__builtin_dwarf_cfa()),
+        *static_cast<const uintptr_t *>(__builtin_frame_address(0))};
+    int __ret = 0;
+    if (_S_walk(__r, false, __skip, __walked, __cb, __data, __ret))
+      return __ret;
+#endif
+    // Continue after the last walked frame, skipping this function's frame.
+    return default_unwinder_t::_S_simple(std::max(__skip, __walked) + 1, __cb,
+                                         __data);
+  }
 
-#if __has_builtin(__builtin_free)
-#define _FBBE_GNU_FREE __builtin_free
-#else
-#define _FBBE_GNU_FREE std::free
+#if _FBBE_CONTEXT_UNWIND
+  friend size_t capture_from_context(const ucontext_t &,
+                                     stacktrace_entry::native_handle_type *,
+                                     size_t) noexcept;
+  friend class crash_handler;
+  friend class __detail::_Thread_dump;
+
+  static _Registers _S_registers(const ucontext_t &__uc) noexcept {
+#if defined(__x86_64__)
+    return {uintptr_t(__uc.uc_mcontext.gregs[REG_RIP]),
+            uintptr_t(__uc.uc_mcontext.gregs[REG_RSP]),
+            uintptr_t(__uc.uc_mcontext.gregs[REG_RBP])};
+#elif defined(__i386__)
+    return {uintptr_t(__uc.uc_mcontext.gregs[REG_EIP]),
+            uintptr_t(__uc.uc_mcontext.gregs[REG_ESP]),
+            uintptr_t(__uc.uc_mcontext.gregs[REG_EBP])};
+#else // __aarch64__
+    return {uintptr_t(__uc.uc_mcontext.pc), uintptr_t(__uc.uc_mcontext.sp),
+            uintptr_t(__uc.uc_mcontext.regs[29])};
 #endif
+  }
 
-  static std::string _S_demangle(const char *__name) {
-    std::string __s;
-    int __status;
-    char *__str =
-        __cxxabiv1::__cxa_demangle(__name, nullptr, nullptr, &__status);
-    if (__status == 0)
-      __s = __str;
-    else
-      __s = __name;
-    _FBBE_GNU_FREE(__str);
-    return __s;
+  // Reports the frames of the code interrupted in __uc, starting with the
+  // interrupted instruction. Where the unwind tables cannot describe a
+  // frame, e.g. on targets without them, the rest of the stack is taken from
+  // the default unwinder, which only sees it while the signal handler that
+  // received __uc runs on the same thread. Without __lookup, the walk does
+  // not lock or allocate, see _S_walk: threads whose stack bounds are not
+  // known yet, and frames in modules without a table yet, are left to the
+  // default unwinder.
+  static int
+  _S_from_context(const ucontext_t &__uc, int (*__cb)(void *, uintptr_t),
+                  void *__data,
+                  [[maybe_unused]] bool __lookup = true) noexcept {
+    const _Registers __r = _S_registers(__uc);
+    struct _Resume {
+      uintptr_t _M_target; // first frame to forward, or the one before it
+      bool _M_inclusive;
+      bool _M_found = false;
+      int (*_M_cb)(void *, uintptr_t);
+      void *_M_data;
+    } __resume = {__r._M_pc, true, false, __cb, __data};
+#if _FBBE_ORC_UNWINDER && _FBBE_FRAME_POINTER_UNWINDER
+    struct _Last {
+      uintptr_t _M_pc = 0;
+      int (*_M_cb)(void *, uintptr_t);
+      void *_M_data;
+    } __last = {0, __cb, __data};
+    auto __track = [](void *__p, uintptr_t __pc) {
+      auto &__l = *static_cast<_Last *>(__p);
+      __l._M_pc = __pc;
+      return __l._M_cb(__l._M_data, __pc);
+    };
+    int __walked = 0, __ret = 0;
+    if (_S_walk(__r, true, 0, __walked, +__track, &__last, __ret, __lookup))
+      return __ret;
+    if (__walked > 0) {
+      __resume._M_target = __last._M_pc;
+      __resume._M_inclusive = false;
+    }
+#endif
+    // The interrupted frame appears with its exact address, return addresses
+    // one below.
+    auto __forward = [](void *__p, uintptr_t __pc) {
+      auto &__s = *static_cast<_Resume *>(__p);
+      if (!__s._M_found) {
+        if (__pc != __s._M_target &&
+            !(__s._M_inclusive && __pc == __s._M_target - 1))
+          return 0;
+        __s._M_found = true;
+        if (!__s._M_inclusive)
+          return 0;
+      }
+      return __s._M_cb(__s._M_data, __pc);
+    };
+    auto __err = [](void *, const char *, int) {};
+    return ::backtrace_simple(nullptr, 0, +__forward, +__err, &__resume);
+  }
+
+  // Writes at most __size frames of the code interrupted in __uc to
+  // __buffer, returns how many were written. See _S_from_context for
+  // __lookup.
+  static size_t _S_capture(const ucontext_t &__uc,
+                           stacktrace_entry::native_handle_type *__buffer,
+                           size_t __size, bool __lookup) noexcept {
+    if (__size == 0) [[unlikely]]
+      return 0;
+    struct _Data {
+      uintptr_t *_M_buffer;
+      size_t _M_size;
+      size_t _M_depth;
+    } __data = {__buffer, __size, 0};
+    auto __cb = [](void *__data, uintptr_t __pc) -> int {
+      auto &__d = *static_cast<_Data *>(__data);
+      __d._M_buffer[__d._M_depth++] = __pc;
+      return __d._M_depth == __d._M_size; // stop tracing when the buffer is full
+    };
+    _S_from_context(__uc, +__cb, &__data, __lookup);
+    return __data._M_depth;
+  }
+#endif
+};
+
+inline constexpr orc_unwinder_t orc_unwinder{};
+template <> struct __is_unwinder<orc_unwinder_t> : std::true_type {};
+
+// [fbbe.capture.policy], allocation policy of current()
+
+template <typename _Tp> struct __is_capture_policy : std::false_type {};
+
+// Allocates for the requested depth, or 64 frames if it is larger than 128,
+// grows by doubling while unwinding and shrinks the result if more than half
+// of it is unused. Used by the current() overloads without a policy.
+struct growing_capture_t {
+  explicit growing_capture_t() = default;
+};
+
+inline constexpr growing_capture_t growing_capture{};
+template <>
+struct __is_capture_policy<growing_capture_t> : std::true_type {};
+
+// Unwinds into a buffer owned by the calling thread first, then allocates
+// exactly the frames of the trace once. The buffer holds 256 frames and is
+// grown on the heap, and kept for the thread, when a deeper trace is
+// requested. Falls back to growing_capture if the buffer is in use, e.g. by
+// a capture interrupted by a signal handler that captures as well.
+struct exact_capture_t {
+  explicit exact_capture_t() = default;
+};
+
+inline constexpr exact_capture_t exact_capture{};
+template <> struct __is_capture_policy<exact_capture_t> : std::true_type {};
+
+namespace __detail {
+
+class _Capture_scratch {
+  using uintptr_t = __UINTPTR_TYPE__;
+
+  static constexpr size_t _S_inline = 256;
+
+  uintptr_t _M_inline[_S_inline];
+  uintptr_t *_M_heap = nullptr;
+  size_t _M_capacity = _S_inline;
+  bool _M_busy = false;
+
+public:
+  _Capture_scratch() = default;
+  _Capture_scratch(const _Capture_scratch &) = delete;
+  _Capture_scratch &operator=(const _Capture_scratch &) = delete;
+  ~_Capture_scratch() { delete[] _M_heap; }
+
+  // nullptr if the buffer of the calling thread is in use.
+  static _Capture_scratch *_S_acquire() noexcept {
+    static thread_local _Capture_scratch __scratch;
+    if (__scratch._M_busy)
+      return nullptr;
+    __scratch._M_busy = true;
+    return &__scratch;
+  }
+
+  void _M_release() noexcept { _M_busy = false; }
+
+  uintptr_t *_M_data() noexcept { return _M_heap ? _M_heap : _M_inline; }
+  size_t _M_size() const noexcept { return _M_capacity; }
+
+  // Makes room for at least __n frames, keeps the current room on failure.
+  bool _M_reserve(size_t __n) noexcept {
+    if (__n <= _M_capacity)
+      return true;
+    auto *__p = new (std::nothrow) uintptr_t[__n];
+    if (!__p)
+      return false;
+    delete[] _M_heap;
+    _M_heap = __p;
+    _M_capacity = __n;
+    return true;
+  }
+};
+
+} // namespace __detail
+
+#if _FBBE_CONTEXT_UNWIND
+
+// [fbbe.context], capture from a signal context
+
+// Like capture_current(), but starts at the instruction interrupted in __uc,
+// e.g. the context passed to a SA_SIGINFO signal handler, instead of at the
+// caller: the handler and the signal trampoline are not part of the trace.
+// On x86-64 the frames are walked from the saved registers with the tables
+// of orc_unwinder, which are built for a module the first time one of its
+// frames is walked (crash_handler::install() builds them in advance).
+// Elsewhere, and past frames the tables cannot describe, the frames are
+// taken from the default unwinder, which requires calling this from the
+// handler that received __uc.
+inline size_t
+capture_from_context(const ucontext_t &__uc,
+                     stacktrace_entry::native_handle_type *__buffer,
+                     size_t __size) noexcept {
+  return orc_unwinder_t::_S_capture(__uc, __buffer, __size, true);
+}
+
+#endif // _FBBE_CONTEXT_UNWIND
+
+// [fbbe.inline], inline frame storage
+
+// Selects a basic_stacktrace that keeps up to _Np frames inside the object,
+// see inline_stacktrace, and takes deeper traces from _Alloc, e.g. a
+// std::pmr::polymorphic_allocator. Equality, copies and propagation are
+// those of _Alloc.
+template <typename _Alloc, size_t _Np> struct inline_allocator : _Alloc {
+  template <typename _Up> struct rebind {
+    using other = inline_allocator<
+        typename std::allocator_traits<_Alloc>::template rebind_alloc<_Up>,
+        _Np>;
+  };
+
+  using _Alloc::_Alloc;
+
+  inline_allocator() = default;
+
+  inline_allocator(const _Alloc &__a) noexcept : _Alloc(__a) {}
+
+  template <typename _Up>
+  inline_allocator(const inline_allocator<_Up, _Np> &__a) noexcept
+      : _Alloc(static_cast<const _Up &>(__a)) {}
+
+  inline_allocator select_on_container_copy_construction() const {
+    return std::allocator_traits<
+        _Alloc>::select_on_container_copy_construction(*this);
+  }
+
+  friend bool operator==(const inline_allocator &__x,
+                         const inline_allocator &__y) noexcept {
+    return static_cast<const _Alloc &>(__x) == static_cast<const _Alloc &>(__y);
+  }
+
+  friend bool operator!=(const inline_allocator &__x,
+                         const inline_allocator &__y) noexcept {
+    return !(__x == __y);
+  }
+};
+
+template <typename _Allocator>
+struct __inline_capacity : std::integral_constant<size_t, 0> {};
+
+template <typename _Alloc, size_t _Np>
+struct __inline_capacity<inline_allocator<_Alloc, _Np>>
+    : std::integral_constant<size_t, _Np> {};
+
+namespace __detail {
+
+template <size_t _Np> struct _Local_frames {
+  alignas(stacktrace_entry) unsigned char
+      _M_buf[_Np * sizeof(stacktrace_entry)];
+
+  stacktrace_entry *_M_get() noexcept {
+    return reinterpret_cast<stacktrace_entry *>(_M_buf);
   }
 };
 
+template <> struct _Local_frames<0> {
+  stacktrace_entry *_M_get() noexcept { return nullptr; }
+};
+
+} // namespace __detail
+
 // [stacktrace.basic], class template basic_stacktrace
 template <typename _Allocator> class basic_stacktrace {
   using _AllocTraits = std::allocator_traits<_Allocator>;
@@ -305,17 +1002,18 @@ public:
   using size_type = unsigned short;
   using allocator_type = _Allocator;
 
+private:
+  // Frames stored in the object itself, see inline_allocator.
+  static constexpr size_type _S_local = __inline_capacity<_Allocator>::value;
+  static_assert(__inline_capacity<_Allocator>::value <= size_type(-1));
+
+public:
   // [stacktrace.basic.ctor], creation and assignment
 
   [[__gnu__::__noinline__]] static basic_stacktrace
   current(const allocator_type &__alloc = allocator_type()) noexcept {
     basic_stacktrace __ret(__alloc);
-    if (auto __cb = __ret._M_prepare()) [[likely]] {
-      auto __state = stacktrace_entry::_S_init();
-      if (backtrace_simple(__state, 1, __cb, stacktrace_entry::_S_err_handler,
-                           std::addressof(__ret)))
-        __ret._M_clear();
-    }
+    __ret._M_capture(default_unwinder, 0, size_type(-1));
     return __ret;
   }
 
@@ -323,16 +1021,7 @@ public:
   current(size_type __skip,
           const allocator_type &__alloc = allocator_type()) noexcept {
     basic_stacktrace __ret(__alloc);
-    if (__skip >= __INT_MAX__) [[unlikely]]
-      return __ret;
-    if (auto __cb = __ret._M_prepare()) [[likely]] {
-      auto __state = stacktrace_entry::_S_init();
-      if (backtrace_simple(__state, __skip + 1, __cb,
-                           stacktrace_entry::_S_err_handler,
-                           std::addressof(__ret)))
-        __ret._M_clear();
-    }
-
+    __ret._M_capture(default_unwinder, __skip, size_type(-1));
     return __ret;
   }
 
@@ -341,33 +1030,67 @@ public:
           const allocator_type &__alloc = allocator_type()) noexcept {
     _FBBE_ASSERT(__skip <= (size_type(-1) - __max_depth));
 
+    basic_stacktrace __ret(__alloc);
+    __ret._M_capture(default_unwinder, __skip, __max_depth);
+    return __ret;
+  }
+
+  // Same as the overloads above, but walks the stack with the selected
+  // unwinder, e.g. fbbe::frame_pointer_unwinder.
+  template <typename _Unwinder,
+            typename = std::enable_if_t<__is_unwinder<_Unwinder>::value>>
+  [[__gnu__::__noinline__]] static basic_stacktrace
+  current(_Unwinder __unwinder, size_type __skip = 0,
+          size_type __max_depth = size_type(-1),
+          const allocator_type &__alloc = allocator_type()) noexcept {
+    basic_stacktrace __ret(__alloc);
+    __ret._M_capture(__unwinder, __skip, __max_depth);
+    return __ret;
+  }
+
+  // Same, but allocates as selected by the policy, e.g.
+  // fbbe::exact_capture.
+  template <typename _Policy,
+            std::enable_if_t<__is_capture_policy<_Policy>::value, int> = 0>
+  [[__gnu__::__noinline__]] static basic_stacktrace
+  current(_Policy __policy, size_type __skip = 0,
+          size_type __max_depth = size_type(-1),
+          const allocator_type &__alloc = allocator_type()) noexcept {
+    basic_stacktrace __ret(__alloc);
+    __ret._M_capture(default_unwinder, __policy, __skip, __max_depth);
+    return __ret;
+  }
+
+  template <typename _Unwinder, typename _Policy,
+            typename = std::enable_if_t<__is_unwinder<_Unwinder>::value &&
+                                        __is_capture_policy<_Policy>::value>>
+  [[__gnu__::__noinline__]] static basic_stacktrace
+  current(_Unwinder __unwinder, _Policy __policy, size_type __skip = 0,
+          size_type __max_depth = size_type(-1),
+          const allocator_type &__alloc = allocator_type()) noexcept {
+    basic_stacktrace __ret(__alloc);
+    __ret._M_capture(__unwinder, __policy, __skip, __max_depth);
+    return __ret;
+  }
+
+#if _FBBE_CONTEXT_UNWIND
+  // Captures the stack of the code interrupted in __uc, see
+  // capture_from_context().
+  static basic_stacktrace
+  from_context(const ucontext_t &__uc, size_type __max_depth = size_type(-1),
+               const allocator_type &__alloc = allocator_type()) noexcept {
     basic_stacktrace __ret(__alloc);
     if (__max_depth == 0) [[unlikely]]
       return __ret;
-    if (__skip >= __INT_MAX__) [[unlikely]]
-      return __ret;
     if (auto __cb = __ret._M_prepare(__max_depth)) [[likely]] {
-      auto __state = stacktrace_entry::_S_init();
-      int __err = backtrace_simple(__state, __skip + 1, __cb,
-                                   stacktrace_entry::_S_err_handler,
-                                   std::addressof(__ret));
-      if (__err < 0)
+      if (orc_unwinder_t::_S_from_context(__uc, __cb, &__ret) < 0)
         __ret._M_clear();
-      else if (__ret.size() > __max_depth) {
+      else if (__ret.size() > __max_depth)
         __ret._M_impl._M_resize(__max_depth, __ret._M_alloc);
-
-        if (__ret._M_impl._M_capacity / 2 >= __max_depth) {
-          // shrink to fit
-          _Impl __tmp = __ret._M_impl._M_clone(__ret._M_alloc);
-          if (__tmp._M_capacity) {
-            __ret._M_clear();
-            __ret._M_impl = __tmp;
-          }
-        }
-      }
     }
     return __ret;
   }
+#endif
 
   basic_stacktrace() noexcept(
       std::is_nothrow_default_constructible_v<allocator_type>) {}
@@ -381,25 +1104,25 @@ public:
                              __other._M_alloc)) {}
 
   basic_stacktrace(basic_stacktrace &&__other) noexcept
-      : _M_alloc(std::move(__other._M_alloc)),
-        _M_impl(std::exchange(__other._M_impl, {})) {}
+      : _M_alloc(std::move(__other._M_alloc)) {
+    _M_take(__other);
+  }
 
   basic_stacktrace(const basic_stacktrace &__other,
                    const allocator_type &__alloc) noexcept
       : _M_alloc(__alloc) {
-    if (const auto __s = __other._M_impl._M_size)
-      _M_impl = __other._M_impl._M_clone(_M_alloc);
+    _M_copy(__other._M_impl);
   }
 
   basic_stacktrace(basic_stacktrace &&__other,
                    const allocator_type &__alloc) noexcept
       : _M_alloc(__alloc) {
-    if constexpr (_Allocator::is_always_equal::value)
-      _M_impl = std::exchange(__other._M_impl, {});
+    if constexpr (_AllocTraits::is_always_equal::value)
+      _M_take(__other);
     else if (_M_alloc == __other._M_alloc)
-      _M_impl = std::exchange(__other._M_impl, {});
-    else if (const auto __s = __other._M_impl._M_size)
-      _M_impl = __other._M_impl._M_clone(_M_alloc);
+      _M_take(__other);
+    else
+      _M_copy(__other._M_impl);
   }
 
   basic_stacktrace &operator=(const basic_stacktrace &__other) noexcept {
@@ -426,7 +1149,7 @@ public:
       if constexpr (__pocca)
         _M_alloc = __other._M_alloc;
 
-      _M_impl = __other._M_impl._M_clone(_M_alloc);
+      _M_copy(__other._M_impl);
     } else {
       // Current storage is large enough.
       _M_impl._M_resize(0, _M_alloc);
@@ -446,7 +1169,15 @@ public:
     constexpr bool __pocma =
         _AllocTraits::propagate_on_container_move_assignment::value;
 
-    if constexpr (_AllocTraits::is_always_equal::value)
+    if constexpr (_S_local != 0) {
+      // Inline frames cannot change hands, they are copied.
+      _M_clear();
+      if (__pocma || _AllocTraits::is_always_equal::value ||
+          _M_alloc == __other._M_alloc)
+        _M_take(__other);
+      else
+        _M_copy(__other._M_impl);
+    } else if constexpr (_AllocTraits::is_always_equal::value)
       std::swap(_M_impl, __other._M_impl);
     else if (_M_alloc == __other._M_alloc)
       std::swap(_M_impl, __other._M_impl);
@@ -461,7 +1192,7 @@ public:
       if (_M_impl._M_capacity < __s) {
         // Need to allocate new storage.
         _M_clear();
-        _M_impl = __other._M_impl._M_clone(_M_alloc);
+        _M_copy(__other._M_impl);
       } else {
         // Current storage is large enough.
         _M_impl._M_resize(0, _M_alloc);
@@ -604,6 +1335,20 @@ public:
 
   // [stacktrace.basic.mod], modifiers
   void swap(basic_stacktrace &__other) noexcept {
+    if constexpr (_S_local != 0) {
+      if (_M_impl._M_is_local || __other._M_impl._M_is_local) {
+        // Inline frames cannot change hands, they are copied. Each side
+        // takes the frames of the one whose allocator it gets.
+        basic_stacktrace __tmp(std::move(*this));
+        if constexpr (_AllocTraits::propagate_on_container_swap::value)
+          _M_alloc = __other._M_alloc;
+        _M_take(__other);
+        if constexpr (_AllocTraits::propagate_on_container_swap::value)
+          __other._M_alloc = __tmp._M_alloc;
+        __other._M_take(__tmp);
+        return;
+      }
+    }
     std::swap(_M_impl, __other._M_impl);
     if constexpr (_AllocTraits::propagate_on_container_swap::value)
       std::swap(_M_alloc, __other._M_alloc);
@@ -613,29 +1358,158 @@ public:
   }
 
 private:
-  bool _M_push_back(const value_type &__x) noexcept {
-    return _M_impl._M_push_back(_M_alloc, __x);
+  friend class __detail::_Thread_dump;
+  friend class compact_stacktrace;
+  friend class shared_stacktrace;
+
+  // Must be inlined into current(), which is skipped as the innermost frame.
+  template <typename _Unwinder>
+  [[__gnu__::__always_inline__]] void
+  _M_capture(_Unwinder, size_type __skip, size_type __max_depth) noexcept {
+    if (__max_depth == 0) [[unlikely]]
+      return;
+    if (__skip >= __INT_MAX__) [[unlikely]]
+      return;
+    if (auto __cb = _M_prepare(__max_depth)) [[likely]] {
+      int __err = _Unwinder::_S_simple(__skip + 1, __cb, this);
+      if (__err < 0)
+        _M_clear();
+      else if (size() > __max_depth) {
+        _M_impl._M_resize(__max_depth, _M_alloc);
+        _M_shrink_to_fit();
+      }
+    }
   }
 
-  void _M_clear() noexcept {
-    _M_impl._M_resize(0, _M_alloc);
-    _M_impl._M_deallocate(_M_alloc);
+  template <typename _Unwinder>
+  [[__gnu__::__always_inline__]] void
+  _M_capture(_Unwinder __unwinder, growing_capture_t, size_type __skip,
+             size_type __max_depth) noexcept {
+    _M_capture(__unwinder, __skip, __max_depth);
   }
 
-  // Precondition: __max_depth != 0
-  auto _M_prepare(size_type __max_depth = -1) noexcept
-      -> int (*)(void *, uintptr_t) {
-    auto __cb = +[](void *__data, uintptr_t __pc) {
-      auto &__s = *static_cast<basic_stacktrace *>(__data);
-      stacktrace_entry __f;
-      __f._M_pc = __pc;
-      if (__s._M_push_back(__f)) [[likely]]
-        return 0; // continue tracing
-      return -1;  // stop tracing due to error
-    };
+  template <typename _Unwinder>
+  [[__gnu__::__always_inline__]] void
+  _M_capture(_Unwinder __unwinder, exact_capture_t, size_type __skip,
+             size_type __max_depth) noexcept {
+    if (__max_depth == 0) [[unlikely]]
+      return;
+    if (__skip >= __INT_MAX__) [[unlikely]]
+      return;
+    auto *__scratch = __detail::_Capture_scratch::_S_acquire();
+    if (!__scratch) [[unlikely]] {
+      _M_capture(__unwinder, __skip, __max_depth);
+      return;
+    }
+    struct _Data {
+      uintptr_t *_M_buffer;
+      size_t _M_size;
+      size_t _M_depth;
+    } __data;
+    auto __cb = [](void *__data, uintptr_t __pc) -> int {
+      auto &__d = *static_cast<_Data *>(__data);
+      __d._M_buffer[__d._M_depth++] = __pc;
+      return __d._M_depth == __d._M_size; // stop when the buffer is full
+    };
+    for (;;) {
+      __data = {__scratch->_M_data(),
+                std::min<size_t>(__scratch->_M_size(), __max_depth), 0};
+      if (_Unwinder::_S_simple(__skip + 1, +__cb, &__data) < 0) {
+        __data._M_depth = 0;
+        break;
+      }
+      // A full buffer may have cut the trace short: unwind again into a
+      // larger one.
+      if (__data._M_depth < __data._M_size || __data._M_size == __max_depth ||
+          !__scratch->_M_reserve(
+              std::min<size_t>(2 * __scratch->_M_size(), __max_depth)))
+        break;
+    }
+    if (__data._M_depth && _M_allocate(size_type(__data._M_depth)))
+      for (size_t __i = 0; __i < __data._M_depth; ++__i) {
+        stacktrace_entry __f;
+        __f._M_pc = __data._M_buffer[__i];
+        _M_push_back(__f);
+      }
+    __scratch->_M_release();
+  }
+
+  struct _Impl;
+
+  void _M_shrink_to_fit() noexcept {
+    if (_M_impl._M_is_local)
+      return;
+    if constexpr (_S_local != 0) {
+      if (size() <= _S_local) {
+        _Impl __heap = std::exchange(_M_impl, {});
+        _M_copy(__heap);
+        __heap._M_resize(0, _M_alloc);
+        __heap._M_deallocate(_M_alloc);
+        return;
+      }
+    }
+    if (_M_impl._M_capacity / 2 >= size()) {
+      _Impl __tmp = _M_impl._M_clone(_M_alloc);
+      if (__tmp._M_capacity) {
+        _M_clear();
+        _M_impl = __tmp;
+      }
+    }
+  }
+
+  // Uses the inline frames if __n fit.
+  // Precondition: _M_impl._M_frames == nullptr && __n != 0
+  bool _M_allocate(size_type __n) noexcept {
+    if constexpr (_S_local != 0) {
+      if (__n <= _S_local) {
+        _M_impl._M_frames = _M_local._M_get();
+        _M_impl._M_capacity = __n;
+        _M_impl._M_is_local = true;
+        return true;
+      }
+    }
+    return _M_impl._M_allocate(_M_alloc, __n);
+  }
+
+  // Precondition: _M_impl._M_frames == nullptr
+  void _M_copy(const _Impl &__other) noexcept {
+    if (__other._M_size && _M_allocate(__other._M_size))
+      _M_impl._M_assign(__other, _M_alloc);
+  }
+
+  // Takes the frames of __other, whose allocator must equal ours.
+  // Precondition: _M_impl._M_frames == nullptr
+  void _M_take(basic_stacktrace &__other) noexcept {
+    if (__other._M_impl._M_is_local) {
+      _M_copy(__other._M_impl);
+      __other._M_clear();
+    } else
+      _M_impl = std::exchange(__other._M_impl, {});
+  }
+
+  bool _M_push_back(const value_type &__x) noexcept {
+    return _M_impl._M_push_back(_M_alloc, __x);
+  }
+
+  void _M_clear() noexcept {
+    _M_impl._M_resize(0, _M_alloc);
+    _M_impl._M_deallocate(_M_alloc);
+  }
+
+  // Precondition: __max_depth != 0
+  auto _M_prepare(size_type __max_depth = -1) noexcept
+      -> int (*)(void *, uintptr_t) {
+    auto __cb = +[](void *__data, uintptr_t __pc) {
+      auto &__s = *static_cast<basic_stacktrace *>(__data);
+      stacktrace_entry __f;
+      __f._M_pc = __pc;
+      if (__s._M_push_back(__f)) [[likely]]
+        return 0; // continue tracing
+      return -1;  // stop tracing due to error
+    };
 
-    if (__max_depth > 128)
-      __max_depth = 64; // soft limit, _M_push_back will reallocate
+    if (__max_depth > 128) // soft limit, _M_push_back will reallocate
+      __max_depth = _S_local ? _S_local : 64;
     else
       __cb = [](void *__data, uintptr_t __pc) {
         auto &__s = *static_cast<basic_stacktrace *>(__data);
@@ -648,7 +1522,7 @@ private:
         return -1;  // stop tracing due to error
       };
 
-    if (_M_impl._M_allocate(_M_alloc, __max_depth)) [[likely]]
+    if (_M_allocate(__max_depth)) [[likely]]
       return __cb;
     return nullptr;
   }
@@ -659,6 +1533,8 @@ private:
     pointer _M_frames = nullptr;
     size_type _M_size = 0;
     size_type _M_capacity = 0;
+    // _M_frames points to the inline frames of the owner.
+    bool _M_is_local = false;
 
     static size_type _S_max_size(const allocator_type &__alloc) noexcept {
       const size_t __size_max = std::numeric_limits<size_type>::max();
@@ -699,7 +1575,11 @@ private:
     }
 
     void _M_deallocate(allocator_type &__alloc) noexcept {
-      if (_M_capacity) {
+      if (_M_is_local) {
+        _M_frames = nullptr;
+        _M_capacity = 0;
+        _M_is_local = false;
+      } else if (_M_capacity) {
         if constexpr (std::is_same_v<allocator_type,
                                      std::allocator<value_type>>)
 #if defined(__cpp_sized_deallocation) && __cpp_sized_deallocation >= 201309L
@@ -784,11 +1664,18 @@ private:
   [[no_unique_address]] allocator_type _M_alloc{};
 
   _Impl _M_impl{};
+
+  [[no_unique_address]] __detail::_Local_frames<_S_local> _M_local;
 };
 
 // basic_stacktrace typedef names
 using stacktrace = basic_stacktrace<std::allocator<stacktrace_entry>>;
 
+// Keeps traces of up to _Np frames inside the object, without allocating.
+template <size_t _Np>
+using inline_stacktrace =
+    basic_stacktrace<inline_allocator<std::allocator<stacktrace_entry>, _Np>>;
+
 // [stacktrace.basic.nonmem], non-member functions
 template <typename _Allocator>
 inline void
@@ -797,13 +1684,294 @@ swap(basic_stacktrace<_Allocator> &__a,
   __a.swap(__b);
 }
 
+// [fbbe.view], non-owning stacktraces
+
+// Refers to frames owned elsewhere: the entries of a basic_stacktrace or a
+// stack_table, or program counters written by capture_current() into a ring
+// buffer or shared memory. The frames must outlive the view. The entries of
+// program counters are made when the iterators are dereferenced, so these
+// yield entries by value.
+class stacktrace_view {
+  using uintptr_t = stacktrace_entry::native_handle_type;
+
+public:
+  class const_iterator {
+  public:
+    using iterator_category = std::random_access_iterator_tag;
+    using value_type = stacktrace_entry;
+    using difference_type = ptrdiff_t;
+    using reference = stacktrace_entry;
+
+    // Keeps the entry operator-> points to.
+    struct pointer {
+      stacktrace_entry _M_entry;
+      const stacktrace_entry *operator->() const noexcept { return &_M_entry; }
+    };
+
+    constexpr const_iterator() noexcept = default;
+
+    reference operator*() const noexcept {
+      if (!_M_pcs)
+        return _M_entries[_M_pos];
+      stacktrace_entry __f;
+      __f._M_pc = _M_pcs[_M_pos];
+      return __f;
+    }
+
+    pointer operator->() const noexcept { return {**this}; }
+
+    reference operator[](difference_type __n) const noexcept {
+      return *(*this + __n);
+    }
+
+    const_iterator &operator++() noexcept {
+      ++_M_pos;
+      return *this;
+    }
+
+    const_iterator operator++(int) noexcept {
+      auto __tmp = *this;
+      ++_M_pos;
+      return __tmp;
+    }
+
+    const_iterator &operator--() noexcept {
+      --_M_pos;
+      return *this;
+    }
+
+    const_iterator operator--(int) noexcept {
+      auto __tmp = *this;
+      --_M_pos;
+      return __tmp;
+    }
+
+    const_iterator &operator+=(difference_type __n) noexcept {
+      _M_pos += __n;
+      return *this;
+    }
+
+    const_iterator &operator-=(difference_type __n) noexcept {
+      _M_pos -= __n;
+      return *this;
+    }
+
+    friend const_iterator operator+(const_iterator __i,
+                                    difference_type __n) noexcept {
+      return __i += __n;
+    }
+
+    friend const_iterator operator+(difference_type __n,
+                                    const_iterator __i) noexcept {
+      return __i += __n;
+    }
+
+    friend const_iterator operator-(const_iterator __i,
+                                    difference_type __n) noexcept {
+      return __i -= __n;
+    }
+
+    // Iterators of the same view compare by position.
+    friend difference_type operator-(const const_iterator &__x,
+                                     const const_iterator &__y) noexcept {
+      return __x._M_pos - __y._M_pos;
+    }
+
+    friend bool operator==(const const_iterator &__x,
+                           const const_iterator &__y) noexcept {
+      return __x._M_pos == __y._M_pos;
+    }
+
+    friend bool operator!=(const const_iterator &__x,
+                           const const_iterator &__y) noexcept {
+      return __x._M_pos != __y._M_pos;
+    }
+
+    friend bool operator<(const const_iterator &__x,
+                          const const_iterator &__y) noexcept {
+      return __x._M_pos < __y._M_pos;
+    }
+
+    friend bool operator>(const const_iterator &__x,
+                          const const_iterator &__y) noexcept {
+      return __x._M_pos > __y._M_pos;
+    }
+
+    friend bool operator<=(const const_iterator &__x,
+                           const const_iterator &__y) noexcept {
+      return __x._M_pos <= __y._M_pos;
+    }
+
+    friend bool operator>=(const const_iterator &__x,
+                           const const_iterator &__y) noexcept {
+      return __x._M_pos >= __y._M_pos;
+    }
+
+  private:
+    friend class stacktrace_view;
+
+    // Exactly one of them is set, unless the view is empty.
+    const stacktrace_entry *_M_entries = nullptr;
+    const uintptr_t *_M_pcs = nullptr;
+    difference_type _M_pos = 0;
+
+    constexpr const_iterator(const stacktrace_entry *__entries,
+                             const uintptr_t *__pcs,
+                             difference_type __pos) noexcept
+        : _M_entries(__entries), _M_pcs(__pcs), _M_pos(__pos) {}
+  };
+
+  using value_type = stacktrace_entry;
+  using const_reference = stacktrace_entry;
+  using reference = const_reference;
+  using iterator = const_iterator;
+  using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+  using reverse_iterator = const_reverse_iterator;
+  using difference_type = ptrdiff_t;
+  using size_type = size_t;
+
+  static constexpr size_type npos = size_type(-1);
+
+  constexpr stacktrace_view() noexcept = default;
+
+  constexpr stacktrace_view(const stacktrace_entry *__first,
+                            size_type __size) noexcept
+      : _M_entries(__first), _M_size(__size) {}
+
+  constexpr stacktrace_view(const uintptr_t *__pcs, size_type __size) noexcept
+      : _M_pcs(__pcs), _M_size(__size) {}
+
+  template <typename _Allocator>
+  stacktrace_view(const basic_stacktrace<_Allocator> &__st) noexcept
+      : _M_entries(__st.begin()), _M_size(__st.size()) {}
+
+  constexpr const_iterator begin() const noexcept {
+    return const_iterator(_M_entries, _M_pcs, 0);
+  }
+
+  constexpr const_iterator end() const noexcept {
+    return const_iterator(_M_entries, _M_pcs, difference_type(_M_size));
+  }
+
+  const_reverse_iterator rbegin() const noexcept {
+    return const_reverse_iterator(end());
+  }
+
+  const_reverse_iterator rend() const noexcept {
+    return const_reverse_iterator(begin());
+  }
+
+  constexpr const_iterator cbegin() const noexcept { return begin(); }
+  constexpr const_iterator cend() const noexcept { return end(); }
+
+  [[nodiscard]] constexpr bool empty() const noexcept { return _M_size == 0; }
+  constexpr size_type size() const noexcept { return _M_size; }
+
+  const_reference operator[](size_type __n) const noexcept {
+    _FBBE_ASSERT(__n < size());
+    return begin()[difference_type(__n)];
+  }
+
+  const_reference at(size_type __n) const {
+    if (__n >= size())
+      throw std::out_of_range("stacktrace_view::at: bad frame number");
+    return (*this)[__n];
+  }
+
+  // The frames [__skip, __skip + __count), clamped to the end of the view.
+  // __skip may not be larger than size().
+  stacktrace_view subview(size_type __skip, size_type __count = npos) const {
+    if (__skip > size())
+      throw std::out_of_range("stacktrace_view::subview: bad frame number");
+    const size_type __n = std::min(__count, _M_size - __skip);
+    if (_M_pcs)
+      return stacktrace_view(_M_pcs + __skip, __n);
+    return stacktrace_view(_M_entries ? _M_entries + __skip : nullptr, __n);
+  }
+
+  // Ordered by size first, then frame by frame, like basic_stacktrace.
+  friend bool operator==(stacktrace_view __x, stacktrace_view __y) noexcept {
+    return std::equal(__x.begin(), __x.end(), __y.begin(), __y.end());
+  }
+
+  friend bool operator!=(stacktrace_view __x, stacktrace_view __y) noexcept {
+    return !(__x == __y);
+  }
+
+  friend bool operator<(stacktrace_view __x, stacktrace_view __y) noexcept {
+    return _S_compare(__x, __y) < 0;
+  }
+
+  friend bool operator>(stacktrace_view __x, stacktrace_view __y) noexcept {
+    return _S_compare(__x, __y) > 0;
+  }
+
+  friend bool operator<=(stacktrace_view __x, stacktrace_view __y) noexcept {
+    return _S_compare(__x, __y) <= 0;
+  }
+
+  friend bool operator>=(stacktrace_view __x, stacktrace_view __y) noexcept {
+    return _S_compare(__x, __y) >= 0;
+  }
+
+private:
+  // At most one of them is set.
+  const stacktrace_entry *_M_entries = nullptr;
+  const uintptr_t *_M_pcs = nullptr;
+  size_type _M_size = 0;
+
+  static int _S_compare(stacktrace_view __x, stacktrace_view __y) noexcept {
+    if (__x.size() != __y.size())
+      return __x.size() < __y.size() ? -1 : 1;
+    const auto __m = std::mismatch(__x.begin(), __x.end(), __y.begin());
+    if (__m.first == __x.end())
+      return 0;
+    return *__m.first < *__m.second ? -1 : 1;
+  }
+};
+
+// [fbbe.symbolize], batch symbolization
+
+// Resolves description, source file and line of every entry of __st. Each
+// distinct address is looked up once, which is cheaper than querying the
+// entries one by one, even more so for traces with repeated frames.
+inline std::vector<stacktrace_symbol> symbolize(stacktrace_view __st) {
+  std::vector<stacktrace_symbol> __symbols(__st.size());
+  stacktrace_entry::_S_symbolize(__st.begin(), __st.size(), __symbols.data());
+  return __symbols;
+}
+
+template <typename _Allocator>
+std::vector<stacktrace_symbol>
+symbolize(const basic_stacktrace<_Allocator> &__st) {
+  return symbolize(stacktrace_view(__st));
+}
+
+inline std::ostream &operator<<(std::ostream &__os,
+                                const stacktrace_symbol &__sym) {
+  if (__sym.resolved) {
+    __os.width(4);
+    __os << __sym.description << " at " << __sym.source_file << ':'
+         << __sym.source_line;
+  }
+  return __os;
+}
+
 inline std::ostream &operator<<(std::ostream &__os,
                                 const stacktrace_entry &__f) {
-  std::string __desc, __file;
-  int __line;
-  if (__f._M_get_info(&__desc, &__file, &__line)) {
+  stacktrace_symbol __sym;
+  int __line = 0;
+  __sym.resolved = __f._M_get_info(&__sym.description, &__sym.source_file,
+                                   &__line);
+  __sym.source_line = __line;
+  return __os << __sym;
+}
+
+inline std::ostream &operator<<(std::ostream &__os, stacktrace_view __st) {
+  const auto __symbols = symbolize(__st);
+  for (size_t __i = 0; __i < __st.size(); ++__i) {
     __os.width(4);
-    __os << __desc << " at " << __file << ':' << __line;
+    __os << __i << "# " << __symbols[__i] << '\n';
   }
   return __os;
 }
@@ -811,34 +1979,494 @@ inline std::ostream &operator<<(std::ostream &__os,
 template <typename _Allocator>
 inline std::ostream &operator<<(std::ostream &__os,
                                 const basic_stacktrace<_Allocator> &__st) {
-  for (stacktrace::size_type __i = 0; __i < __st.size(); ++__i) {
-    __os.width(4);
-    __os << __i << "# " << __st[__i] << '\n';
+  return __os << stacktrace_view(__st);
+}
+
+// [fbbe.format], formatting without streams
+
+template <typename _OutputIt> struct format_to_n_result {
+  _OutputIt out;
+  // Number of characters the whole output has, even if it was truncated.
+  std::ptrdiff_t size;
+};
+
+namespace __detail {
+
+// Format specification of the std::format and fmt formatters:
+//
+//   [.frames][a|s]
+//
+// .frames limits a trace to its first frames. 'a' writes the addresses only,
+// without reading any debug information, 's' omits the source location.
+struct _Format_spec {
+  size_t _M_limit = size_t(-1);
+  bool _M_address = false;
+  bool _M_location = true;
+
+  // Parses the specification up to the closing brace at __it, which is left
+  // there. Returns an error message or nullptr.
+  template <typename _It>
+  constexpr const char *_M_parse(_It &__it, _It __last, bool __trace) {
+    if (__it != __last && *__it == '.') {
+      if (!__trace)
+        return "a stacktrace_entry has no frames to limit";
+      if (++__it == __last || *__it < '0' || *__it > '9')
+        return "expected the number of frames after '.'";
+      _M_limit = 0;
+      for (; __it != __last && *__it >= '0' && *__it <= '9'; ++__it)
+        _M_limit = _M_limit * 10 + size_t(*__it - '0');
+    }
+    if (__it != __last && (*__it == 'a' || *__it == 's')) {
+      _M_address = *__it == 'a';
+      _M_location = *__it != 's';
+      ++__it;
+    }
+    if (__it != __last && *__it != '}')
+      return "invalid format specification for a stacktrace";
+    return nullptr;
   }
-  return __os;
+};
+
+// Writes the same text as the stream operators, without streams or
+// temporary strings.
+struct _Format {
+  // Right-aligns __s in __width columns, like std::ostream::width().
+  template <typename _OutputIt>
+  static _OutputIt _S_padded(_OutputIt __out, std::string_view __s,
+                             size_t __width) {
+    for (size_t __i = __s.size(); __i < __width; ++__i)
+      *__out++ = ' ';
+    return std::copy(__s.begin(), __s.end(), __out);
+  }
+
+  template <typename _OutputIt>
+  static _OutputIt _S_number(_OutputIt __out, long long __n, size_t __width) {
+    char __buf[24];
+    const auto __end = std::to_chars(__buf, std::end(__buf), __n).ptr;
+    return _S_padded(__out, std::string_view(__buf, __end - __buf), __width);
+  }
+
+  template <typename _OutputIt>
+  static _OutputIt _S_symbol(_OutputIt __out, std::string_view __desc,
+                             std::string_view __file, long long __line,
+                             bool __resolved) {
+    if (!__resolved)
+      return __out;
+    __out = _S_padded(__out, __desc, 4);
+    __out = _S_padded(__out, " at ", 0);
+    __out = _S_padded(__out, __file, 0);
+    *__out++ = ':';
+    return _S_number(__out, __line, 0);
+  }
+
+  template <typename _OutputIt>
+  static _OutputIt _S_symbol(_OutputIt __out, const _Cached_symbol &__sym) {
+    return _S_symbol(__out, __sym._M_desc,
+                     __sym._M_file ? __sym._M_file : std::string_view(),
+                     __sym._M_line, __sym._M_resolved);
+  }
+
+  template <typename _OutputIt>
+  static _OutputIt _S_address(_OutputIt __out, __UINTPTR_TYPE__ __pc) {
+    char __buf[2 + 2 * sizeof(__pc)] = {'0', 'x'};
+    const auto __end = std::to_chars(__buf + 2, std::end(__buf), __pc, 16).ptr;
+    return _S_padded(__out, std::string_view(__buf, __end - __buf), 0);
+  }
+
+  // Writes one entry as selected by __spec. The symbol cache must have been
+  // validated.
+  template <typename _OutputIt>
+  static _OutputIt _S_entry_unchecked(_OutputIt __out,
+                                      const stacktrace_entry &__f,
+                                      const _Format_spec &__spec) {
+    if (__spec._M_address)
+      return _S_address(__out, __f._M_pc);
+    const auto __sym = __f._M_lookup();
+    if (!__spec._M_location)
+      return __sym._M_resolved ? _S_padded(__out, __sym._M_desc, 4) : __out;
+    return _S_symbol(__out, __sym);
+  }
+
+  template <typename _OutputIt>
+  static _OutputIt _S_entry(_OutputIt __out, const stacktrace_entry &__f,
+                            const _Format_spec &__spec = {}) {
+    if (!__spec._M_address)
+      _Symbol_cache::_S_instance()._M_validate();
+    return _S_entry_unchecked(std::move(__out), __f, __spec);
+  }
+
+  // Looks the entries up one by one, so nothing is allocated once their
+  // names were seen.
+  template <typename _OutputIt, typename _Iter>
+  static _OutputIt _S_trace(_OutputIt __out, _Iter __first, size_t __n,
+                            const _Format_spec &__spec = {}) {
+    if (!__spec._M_address)
+      _Symbol_cache::_S_instance()._M_validate();
+    __n = std::min(__n, __spec._M_limit);
+    for (size_t __i = 0; __i < __n; ++__i) {
+      __out = _S_number(__out, __i, 4);
+      __out = _S_padded(__out, "# ", 0);
+      __out = _S_entry_unchecked(__out, __first[__i], __spec);
+      *__out++ = '\n';
+    }
+    return __out;
+  }
+
+  // Writes the first __n characters to the wrapped iterator and counts the
+  // rest.
+  template <typename _OutputIt> class _Bounded {
+    _OutputIt _M_out;
+    std::ptrdiff_t _M_left;
+    std::ptrdiff_t _M_size = 0;
+
+  public:
+    using iterator_category = std::output_iterator_tag;
+    using value_type = void;
+    using difference_type = std::ptrdiff_t;
+    using pointer = void;
+    using reference = void;
+
+    _Bounded(_OutputIt __out, std::ptrdiff_t __n)
+        : _M_out(std::move(__out)), _M_left(__n) {}
+
+    _Bounded &operator*() { return *this; }
+    _Bounded &operator++() { return *this; }
+    _Bounded &operator++(int) { return *this; }
+    _Bounded &operator=(char __c) {
+      if (_M_left > 0) {
+        *_M_out++ = __c;
+        --_M_left;
+      }
+      ++_M_size;
+      return *this;
+    }
+
+    format_to_n_result<_OutputIt> _M_result() && {
+      return {std::move(_M_out), _M_size};
+    }
+  };
+};
+
+} // namespace __detail
+
+// Writes what operator<< writes for __f to __out, a character output
+// iterator, and returns the iterator past the output. Allocates nothing
+// once the names of the entries were seen.
+template <typename _OutputIt>
+_OutputIt format_to(_OutputIt __out, const stacktrace_entry &__f) {
+  return __detail::_Format::_S_entry(std::move(__out), __f);
+}
+
+template <typename _OutputIt>
+_OutputIt format_to(_OutputIt __out, stacktrace_view __st) {
+  return __detail::_Format::_S_trace(std::move(__out), __st.begin(),
+                                     __st.size());
+}
+
+template <typename _OutputIt, typename _Allocator>
+_OutputIt format_to(_OutputIt __out,
+                    const basic_stacktrace<_Allocator> &__st) {
+  return format_to(std::move(__out), stacktrace_view(__st));
+}
+
+// Like format_to, but writes at most __n characters, e.g. into a fixed
+// buffer. The output is not null-terminated; result.size tells the length
+// it would have had.
+template <typename _OutputIt>
+format_to_n_result<_OutputIt>
+format_to_n(_OutputIt __out, std::ptrdiff_t __n, const stacktrace_entry &__f) {
+  __detail::_Format::_Bounded<_OutputIt> __bounded(std::move(__out), __n);
+  return format_to(std::move(__bounded), __f)._M_result();
+}
+
+template <typename _OutputIt>
+format_to_n_result<_OutputIt>
+format_to_n(_OutputIt __out, std::ptrdiff_t __n, stacktrace_view __st) {
+  __detail::_Format::_Bounded<_OutputIt> __bounded(std::move(__out), __n);
+  return format_to(std::move(__bounded), __st)._M_result();
+}
+
+template <typename _OutputIt, typename _Allocator>
+format_to_n_result<_OutputIt>
+format_to_n(_OutputIt __out, std::ptrdiff_t __n,
+            const basic_stacktrace<_Allocator> &__st) {
+  return format_to_n(std::move(__out), __n, stacktrace_view(__st));
 }
 
 inline std::string to_string(const stacktrace_entry &__f) {
-  std::ostringstream __os;
-  __os << __f;
-  return std::move(__os).str();
+  std::string __s;
+  format_to(std::back_inserter(__s), __f);
+  return __s;
+}
+
+inline std::string to_string(stacktrace_view __st) {
+  std::string __s;
+  const auto __symbols = symbolize(__st);
+  for (size_t __i = 0; __i < __st.size(); ++__i) {
+    const auto &__sym = __symbols[__i];
+    __detail::_Format::_S_number(std::back_inserter(__s), __i, 4);
+    __s += "# ";
+    __detail::_Format::_S_symbol(std::back_inserter(__s), __sym.description,
+                                 __sym.source_file, __sym.source_line,
+                                 __sym.resolved);
+    __s += '\n';
+  }
+  return __s;
 }
 
 template <typename _Allocator>
 std::string to_string(const basic_stacktrace<_Allocator> &__st) {
-  std::ostringstream __os;
-  __os << __st;
-  return std::move(__os).str();
+  return to_string(stacktrace_view(__st));
+}
+
+#if _FBBE_MODULES
+
+// [fbbe.raw], offline symbolization
+
+// Describes __st by module-relative offsets instead of symbols, without
+// reading any debug information:
+//
+//   fbbe-raw begin 1 <frames>
+//   fbbe-raw module <index> <load base> <build-id or -> <path>
+//   fbbe-raw frame <module index or -> <offset, or address if no module>
+//   ...
+//   fbbe-raw end
+//
+// Only the modules referenced by frames are listed. Addresses are written in
+// hexadecimal. The fbbe_symbolize tool finds such records in logs and
+// resolves them against the binaries on disk.
+inline std::string to_raw_string(stacktrace_view __st) {
+  std::string __out;
+  auto __hex = [&__out](__UINTPTR_TYPE__ __v) {
+    char __buf[2 + 2 * sizeof(__v)] = {'0', 'x'};
+    __out.append(__buf, std::to_chars(__buf + 2, std::end(__buf), __v, 16).ptr);
+  };
+
+  std::vector<uintptr_t> __pcs(__st.size());
+  for (size_t __i = 0; __i < __st.size(); ++__i)
+    __pcs[__i] = __st[__i].native_handle();
+  std::vector<const module_info *> __found(__st.size());
+  module_map::find_cached(__pcs.data(), __pcs.size(), __found.data());
+  std::vector<const module_info *> __used;
+  for (size_t __i = 0; __i < __st.size(); ++__i) {
+    if (__found[__i] &&
+        std::find(__used.begin(), __used.end(), __found[__i]) == __used.end())
+      __used.push_back(__found[__i]);
+  }
+
+  __out += "fbbe-raw begin 1 ";
+  __out += std::to_string(__st.size());
+  __out += '\n';
+  for (size_t __i = 0; __i < __used.size(); ++__i) {
+    __out += "fbbe-raw module ";
+    __out += std::to_string(__i);
+    __out += ' ';
+    __hex(__used[__i]->base);
+    __out += ' ';
+    __out += __used[__i]->build_id.empty() ? "-" : __used[__i]->build_id;
+    __out += ' ';
+    __out += __used[__i]->path;
+    __out += '\n';
+  }
+  for (size_t __i = 0; __i < __st.size(); ++__i) {
+    const auto __pc = __pcs[__i];
+    __out += "fbbe-raw frame ";
+    if (!__found[__i]) {
+      __out += "- ";
+      __hex(__pc);
+    } else {
+      const auto __index =
+          std::find(__used.begin(), __used.end(), __found[__i]) -
+          __used.begin();
+      __out += std::to_string(__index);
+      __out += ' ';
+      __hex(__pc - __found[__i]->base);
+    }
+    __out += '\n';
+  }
+  __out += "fbbe-raw end\n";
+  return __out;
+}
+
+template <typename _Allocator>
+std::string to_raw_string(const basic_stacktrace<_Allocator> &__st) {
+  return to_raw_string(stacktrace_view(__st));
+}
+
+inline std::ostream &write_raw(std::ostream &__os, stacktrace_view __st) {
+  return __os << to_raw_string(__st);
+}
+
+template <typename _Allocator>
+std::ostream &write_raw(std::ostream &__os,
+                        const basic_stacktrace<_Allocator> &__st) {
+  return write_raw(__os, stacktrace_view(__st));
+}
+
+#endif // _FBBE_MODULES
+
+#if __has_include(<unistd.h>)
+
+// [fbbe.fd], writing to file descriptors
+
+struct write_options {
+  // Writes "0x<pc> <module>+0x<offset>" per frame, without reading any debug
+  // information. The modules come from the last snapshot of module_map, so
+  // this mode takes no locks and does not allocate, and can be used in
+  // signal handlers once module_map::current() was called. Only this mode
+  // is safe in signal handlers and allocator hooks: without it, frames are
+  // symbolized through the symbol cache, which can lock, allocate names and
+  // create the backtrace_state on first use.
+  bool raw = false;
+  size_t max_frames = size_t(-1);
+};
+
+namespace __detail {
+
+// Collects output in a buffer on the stack and writes it with write(2).
+class _Fd_writer {
+  int _M_fd;
+  size_t _M_size = 0;
+  bool _M_ok = true;
+  char _M_buf[512];
+
+public:
+  explicit _Fd_writer(int __fd) noexcept : _M_fd(__fd) {}
+
+  _Fd_writer(const _Fd_writer &) = delete;
+  _Fd_writer &operator=(const _Fd_writer &) = delete;
+
+  void _M_put(char __c) noexcept {
+    if (_M_size == sizeof(_M_buf))
+      _M_flush();
+    _M_buf[_M_size++] = __c;
+  }
+
+  // Returns whether everything was written so far.
+  bool _M_flush() noexcept {
+    for (size_t __done = 0; __done < _M_size && _M_ok;) {
+      const auto __n = ::write(_M_fd, _M_buf + __done, _M_size - __done);
+      if (__n > 0)
+        __done += size_t(__n);
+      // write(2) returning 0 would never make progress.
+      else if (__n == 0 || errno != EINTR)
+        _M_ok = false;
+    }
+    _M_size = 0;
+    return _M_ok;
+  }
+
+  class iterator {
+    _Fd_writer *_M_writer;
+
+  public:
+    using iterator_category = std::output_iterator_tag;
+    using value_type = void;
+    using difference_type = std::ptrdiff_t;
+    using pointer = void;
+    using reference = void;
+
+    explicit iterator(_Fd_writer *__w) noexcept : _M_writer(__w) {}
+
+    iterator &operator*() noexcept { return *this; }
+    iterator &operator++() noexcept { return *this; }
+    iterator &operator++(int) noexcept { return *this; }
+    iterator &operator=(char __c) noexcept {
+      _M_writer->_M_put(__c);
+      return *this;
+    }
+  };
+
+  iterator _M_out() noexcept { return iterator(this); }
+};
+
+template <typename _Iter>
+bool _S_write_stacktrace(int __fd, _Iter __first, size_t __n,
+                         const write_options &__options) {
+  _Fd_writer __w(__fd);
+  __n = std::min(__n, __options.max_frames);
+  if (!__options.raw) {
+    _Format_spec __spec;
+    __spec._M_limit = __n;
+    _Format::_S_trace(__w._M_out(), __first, __n, __spec);
+    return __w._M_flush();
+  }
+#if _FBBE_MODULES
+  const module_map *__modules = module_map::last();
+#endif
+  for (size_t __i = 0; __i < __n; ++__i) {
+    const auto __pc = __first[__i].native_handle();
+    auto __out = _Format::_S_address(__w._M_out(), __pc);
+#if _FBBE_MODULES
+    if (const auto *__m = __modules ? __modules->find(__pc) : nullptr) {
+      *__out++ = ' ';
+      __out = _Format::_S_padded(__out, __m->path, 0);
+      *__out++ = '+';
+      _Format::_S_address(__out, __pc - __m->base);
+    }
+#endif
+    __w._M_put('\n');
+  }
+  return __w._M_flush();
+}
+
+} // namespace __detail
+
+// Writes __st to the file descriptor __fd, as operator<< would, or in the
+// raw format of write_options. Uses neither streams, strings nor the locale;
+// the output is buffered on the stack. Returns false if writing failed.
+inline bool write_stacktrace(int __fd, stacktrace_view __st,
+                             const write_options &__options = {}) {
+  return __detail::_S_write_stacktrace(__fd, __st.begin(), __st.size(),
+                                       __options);
+}
+
+template <typename _Allocator>
+bool write_stacktrace(int __fd, const basic_stacktrace<_Allocator> &__st,
+                      const write_options &__options = {}) {
+  return write_stacktrace(__fd, stacktrace_view(__st), __options);
+}
+
+#endif // __has_include(<unistd.h>)
+
+namespace __detail {
+
+// The hash of the frames [__first, __first + __n), as std::hash of the
+// stacktrace types computes it.
+template <typename _Iter>
+size_t _S_hash_frames(_Iter __first, size_t __n) noexcept {
+  constexpr auto __combine = [](size_t __seed, size_t __value) {
+    return __seed ^= __value + 0x9e3779b9 + (__seed << 6) + (__seed >> 2);
+  };
+  std::hash<stacktrace_entry::native_handle_type> __h;
+  size_t __val = std::hash<size_t>{}(__n);
+  for (size_t __i = 0; __i < __n; ++__i)
+    __val = __combine(__h(__first[__i].native_handle()), __val);
+  return __val;
 }
 
+} // namespace __detail
+
 } // namespace fbbe
 
+#include "bits/crash_handler.h"
+#include "bits/thread_dump.h"
+#include "bits/stack_table.h"
+#include "bits/compact_stacktrace.h"
+#include "bits/shared_stacktrace.h"
+#include "bits/profiler.h"
+#include "bits/pprof.h"
+
 #if __has_include(<memory_resource>)
 #include <memory_resource>
 
 namespace fbbe::pmr {
 using stacktrace =
     basic_stacktrace<std::pmr::polymorphic_allocator<stacktrace_entry>>;
+
+template <size_t _Np>
+using inline_stacktrace = basic_stacktrace<
+    inline_allocator<std::pmr::polymorphic_allocator<stacktrace_entry>, _Np>>;
 } // namespace fbbe::pmr
 
 #endif // __has_include(<memory_resource>)
@@ -852,18 +2480,108 @@ template <> struct std::hash<fbbe::stacktrace_entry> {
   }
 };
 
+template <> struct std::hash<fbbe::stacktrace_view> {
+  size_t operator()(fbbe::stacktrace_view __st) const noexcept {
+    return fbbe::__detail::_S_hash_frames(__st.begin(), __st.size());
+  }
+};
+
 template <typename _Allocator>
 struct std::hash<fbbe::basic_stacktrace<_Allocator>> {
   size_t
   operator()(const fbbe::basic_stacktrace<_Allocator> &__st) const noexcept {
-    constexpr static auto hcomb = [](size_t seed, size_t value) {
-      return seed ^= value + 0x9e3779b9 + (seed << 6) + (seed >> 2);
-    };
-    hash<fbbe::stacktrace_entry::native_handle_type> __h;
-    size_t __val = std::hash<size_t>{}(__st.size());
-    for (const auto &__f : __st)
-      __val = hcomb(__h(__f), __val);
-    return __val;
+    return fbbe::__detail::_S_hash_frames(__st.begin(), __st.size());
   }
 };
+
+// [stacktrace.format], formatting support
+
+#if __cplusplus >= 202002L && __has_include(<format>)
+#include <format>
+#endif
+
+#if defined(__cpp_lib_format)
+
+template <> struct std::formatter<fbbe::stacktrace_entry> {
+  fbbe::__detail::_Format_spec _M_spec;
+
+  constexpr auto parse(std::format_parse_context &__ctx) {
+    auto __it = __ctx.begin();
+    if (const char *__error = _M_spec._M_parse(__it, __ctx.end(), false))
+      throw std::format_error(__error);
+    return __it;
+  }
+
+  template <typename _FormatContext>
+  auto format(const fbbe::stacktrace_entry &__f, _FormatContext &__ctx) const {
+    return fbbe::__detail::_Format::_S_entry(__ctx.out(), __f, _M_spec);
+  }
+};
+
+template <> struct std::formatter<fbbe::stacktrace_view> {
+  fbbe::__detail::_Format_spec _M_spec;
+
+  constexpr auto parse(std::format_parse_context &__ctx) {
+    auto __it = __ctx.begin();
+    if (const char *__error = _M_spec._M_parse(__it, __ctx.end(), true))
+      throw std::format_error(__error);
+    return __it;
+  }
+
+  template <typename _FormatContext>
+  auto format(fbbe::stacktrace_view __st, _FormatContext &__ctx) const {
+    return fbbe::__detail::_Format::_S_trace(__ctx.out(), __st.begin(),
+                                             __st.size(), _M_spec);
+  }
+};
+
+template <typename _Allocator>
+struct std::formatter<fbbe::basic_stacktrace<_Allocator>>
+    : std::formatter<fbbe::stacktrace_view> {};
+
+#endif // __cpp_lib_format
+
+// fmt::formatter specializations, if FBBE_USE_FMT is defined (see the CMake
+// option of the same name).
+#if defined(FBBE_USE_FMT) && __has_include(<fmt/format.h>)
+#include <fmt/format.h>
+
+template <> struct fmt::formatter<fbbe::stacktrace_entry> {
+  fbbe::__detail::_Format_spec _M_spec;
+
+  constexpr auto parse(fmt::format_parse_context &__ctx) {
+    auto __it = __ctx.begin();
+    if (const char *__error = _M_spec._M_parse(__it, __ctx.end(), false))
+      throw fmt::format_error(__error);
+    return __it;
+  }
+
+  template <typename _FormatContext>
+  auto format(const fbbe::stacktrace_entry &__f, _FormatContext &__ctx) const {
+    return fbbe::__detail::_Format::_S_entry(__ctx.out(), __f, _M_spec);
+  }
+};
+
+template <> struct fmt::formatter<fbbe::stacktrace_view> {
+  fbbe::__detail::_Format_spec _M_spec;
+
+  constexpr auto parse(fmt::format_parse_context &__ctx) {
+    auto __it = __ctx.begin();
+    if (const char *__error = _M_spec._M_parse(__it, __ctx.end(), true))
+      throw fmt::format_error(__error);
+    return __it;
+  }
+
+  template <typename _FormatContext>
+  auto format(fbbe::stacktrace_view __st, _FormatContext &__ctx) const {
+    return fbbe::__detail::_Format::_S_trace(__ctx.out(), __st.begin(),
+                                             __st.size(), _M_spec);
+  }
+};
+
+template <typename _Allocator>
+struct fmt::formatter<fbbe::basic_stacktrace<_Allocator>>
+    : fmt::formatter<fbbe::stacktrace_view> {};
+
+#endif // FBBE_USE_FMT
 #endif
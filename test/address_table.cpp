@@ -0,0 +1,77 @@
+// The search tree over range starts must agree with std::upper_bound, for
+// single and batched queries, on tables of any shape, also when searched in
+// a copy of its layout, as the symbol index does in its file.
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "check.h"
+#include "fbbe/stacktrace.h"
+
+using fbbe::__detail::_Address_table;
+
+static std::size_t expected(const std::vector<std::uint64_t> &keys,
+                            std::uint64_t x) {
+  const auto it = std::upper_bound(keys.begin(), keys.end(), x);
+  return it == keys.begin() ? _Address_table::_S_npos
+                            : std::size_t(it - keys.begin()) - 1;
+}
+
+auto main() -> int {
+  std::mt19937_64 random(42);
+  for (const std::size_t n : {0, 1, 2, 7, 8, 9, 72, 80, 81, 82, 1000, 65537}) {
+    // Strictly increasing, with gaps, starting above zero.
+    std::vector<std::uint64_t> keys(n);
+    std::uint64_t key = 0x1000;
+    for (auto &k : keys)
+      k = key += 1 + random() % 64;
+    _Address_table table;
+    table._M_assign(n, [&](std::size_t i) { return keys[i]; });
+    CHECK(table._M_count() == n);
+
+    std::vector<std::uint64_t> queries = {0, 0x1000, std::uint64_t(-1)};
+    for (const auto k : keys) {
+      queries.push_back(k - 1);
+      queries.push_back(k);
+      queries.push_back(k + 1);
+    }
+    for (int i = 0; i < 1000; ++i)
+      queries.push_back(0x1000 + random() % (key - 0x1000 + 128));
+
+    const auto nodes = table._M_node_data();
+    const auto ranks = table._M_rank_data();
+    const fbbe::__detail::_Address_tree tree(nodes.data(), nodes.size(),
+                                             ranks.data(), n,
+                                             n ? keys.back() : 0);
+    CHECK(tree._M_count() == n);
+
+    std::vector<std::size_t> batched(queries.size());
+    table._M_find(queries.data(), queries.size(), batched.data());
+    std::vector<std::size_t> in_place(queries.size());
+    tree._M_find(queries.data(), queries.size(), in_place.data());
+    for (std::size_t i = 0; i < queries.size(); ++i) {
+      CHECK(table._M_find(queries[i]) == expected(keys, queries[i]));
+      CHECK(batched[i] == expected(keys, queries[i]));
+      CHECK(tree._M_find(queries[i]) == expected(keys, queries[i]));
+      CHECK(in_place[i] == expected(keys, queries[i]));
+    }
+  }
+
+  // The batched module lookup of a trace agrees with the single one.
+  const auto trace = fbbe::stacktrace::current();
+  std::vector<std::uintptr_t> pcs;
+  for (const auto &frame : trace)
+    pcs.push_back(frame.native_handle());
+  pcs.push_back(0);
+  const auto &map = fbbe::module_map::current();
+  std::vector<const fbbe::module_info *> modules(pcs.size());
+  map.find(pcs.data(), pcs.size(), modules.data());
+  for (std::size_t i = 0; i < pcs.size(); ++i)
+    CHECK(modules[i] == map.find(pcs[i]));
+  CHECK(modules[0] != nullptr);
+  CHECK(modules.back() == nullptr);
+  return 0;
+}
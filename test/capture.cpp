@@ -0,0 +1,94 @@
+// fbbe::capture_current must not allocate and must be usable from signal
+// handlers and allocation hooks.
+#include <algorithm>
+#include <csignal>
+#include <cstdlib>
+#include <iostream>
+
+#include "fbbe/stacktrace.h"
+
+#define FBBE_TEST_COUNT_ALLOCATIONS
+#include "check.h"
+
+using native_handle_type = fbbe::stacktrace_entry::native_handle_type;
+
+static volatile std::sig_atomic_t g_in_hook = 0;
+static volatile std::sig_atomic_t g_hook_reentered = 0;
+static native_handle_type g_hook_frames[64];
+static size_t g_hook_depth = 0;
+
+static void capture_in_hook() {
+  if (g_in_hook)
+    g_hook_reentered = 1;
+  g_in_hook = 1;
+  g_hook_depth = fbbe::capture_current(g_hook_frames, 64);
+  g_in_hook = 0;
+}
+
+static native_handle_type g_signal_frames[64];
+static size_t g_signal_depth = 0;
+static std::sig_atomic_t g_signal_allocations = 0;
+
+extern "C" void on_signal(int) {
+  const long before = g_allocations;
+  g_signal_depth = fbbe::capture_current(g_signal_frames, 64);
+  g_signal_allocations = g_allocations - before;
+}
+
+// Returns the trace of the caller as seen by both capture paths.
+[[gnu::noinline]] static size_t compare_with_current(native_handle_type *buffer,
+                                                     fbbe::stacktrace &trace) {
+  const auto depth = fbbe::capture_current(buffer, 64, 1);
+  trace = fbbe::stacktrace::current(1);
+  return depth;
+}
+
+[[gnu::noinline]] static fbbe::stacktrace raise_signal() {
+  auto trace = fbbe::stacktrace::current();
+  std::raise(SIGUSR1);
+  return trace;
+}
+
+auto main() -> int {
+  // Load the unwinder before capturing from a signal handler.
+  native_handle_type frames[64];
+  CHECK(fbbe::capture_current(frames, 64) > 0);
+
+  // Same values as basic_stacktrace::current().
+  fbbe::stacktrace trace;
+  const auto depth = compare_with_current(frames, trace);
+  CHECK(depth == trace.size());
+  for (size_t i = 0; i < depth; ++i)
+    CHECK(frames[i] == trace[i].native_handle());
+
+  // Skip and buffer bounds.
+  CHECK(fbbe::capture_current(frames, 0) == 0);
+  CHECK(fbbe::capture_current(frames, 1) == 1);
+  CHECK(fbbe::capture_current(frames, 64, 1000) == 0);
+
+  // From a signal handler, without allocating.
+  struct sigaction action = {};
+  action.sa_handler = on_signal;
+  sigemptyset(&action.sa_mask);
+  CHECK(sigaction(SIGUSR1, &action, nullptr) == 0);
+  const auto raised = raise_signal();
+  CHECK(g_signal_allocations == 0);
+  CHECK(g_signal_depth > raised.size());
+  // Everything below raise_signal() is identical.
+  CHECK(std::equal(raised.begin() + 1, raised.end(),
+                   g_signal_frames + g_signal_depth - (raised.size() - 1),
+                   [](const fbbe::stacktrace_entry &entry,
+                      native_handle_type pc) {
+                     return entry.native_handle() == pc;
+                   }));
+
+  // From inside an allocation hook, without recursing into it.
+  g_allocation_hook = capture_in_hook;
+  auto *p = new int(42);
+  g_allocation_hook = nullptr;
+  delete p;
+  CHECK(!g_hook_reentered);
+  CHECK(g_hook_depth > 0);
+
+  return 0;
+}
@@ -0,0 +1,84 @@
+// Helpers shared by the tests.
+//
+// CHECK(cond) reports the failed condition and exits with 1.
+//
+// A test that defines FBBE_TEST_COUNT_ALLOCATIONS before including this
+// header replaces the global operator new and delete: g_allocations counts
+// the calls to operator new, g_last_allocation_size keeps the size of the
+// last one, and g_allocation_hook, when set, runs inside every call. The
+// counters are lock-free atomics and may be read from signal handlers.
+#pragma once
+
+#include <cstdlib>
+#include <iostream>
+
+#define CHECK(cond)                                                            \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      std::cerr << __FILE__ << ':' << __LINE__ << ": check failed: " #cond     \
+                << std::endl;                                                  \
+      std::exit(1);                                                            \
+    }                                                                          \
+  } while (false)
+
+#ifdef FBBE_TEST_COUNT_ALLOCATIONS
+
+#include <atomic>
+#include <cstddef>
+#include <new>
+
+static std::atomic<long> g_allocations{0};
+static std::atomic<std::size_t> g_last_allocation_size{0};
+static void (*volatile g_allocation_hook)() = nullptr;
+
+static_assert(std::atomic<long>::is_always_lock_free &&
+              std::atomic<std::size_t>::is_always_lock_free);
+
+[[gnu::noinline]] static void *counted_allocation(std::size_t size) noexcept {
+  ++g_allocations;
+  g_last_allocation_size = size;
+  if (auto *hook = g_allocation_hook)
+    hook();
+  return std::malloc(size ? size : 1);
+}
+
+[[gnu::noinline]] static void counted_deallocation(void *p) noexcept {
+  std::free(p);
+}
+
+void *operator new(std::size_t size) {
+  if (void *p = counted_allocation(size))
+    return p;
+  throw std::bad_alloc();
+}
+
+void *operator new[](std::size_t size) {
+  if (void *p = counted_allocation(size))
+    return p;
+  throw std::bad_alloc();
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept {
+  return counted_allocation(size);
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept {
+  return counted_allocation(size);
+}
+
+void operator delete(void *p) noexcept { counted_deallocation(p); }
+void operator delete[](void *p) noexcept { counted_deallocation(p); }
+void operator delete(void *p, std::size_t) noexcept {
+  counted_deallocation(p);
+}
+void operator delete[](void *p, std::size_t) noexcept {
+  counted_deallocation(p);
+}
+void operator delete(void *p, const std::nothrow_t &) noexcept {
+  counted_deallocation(p);
+}
+void operator delete[](void *p, const std::nothrow_t &) noexcept {
+  counted_deallocation(p);
+}
+
+#endif // FBBE_TEST_COUNT_ALLOCATIONS
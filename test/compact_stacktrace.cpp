@@ -0,0 +1,76 @@
+// compact_stacktrace must give back the frames it was built from, compare
+// and hash like the traces it encodes, and take less space than them.
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <utility>
+#include <vector>
+
+#include "check.h"
+#include "fbbe/stacktrace.h"
+
+using pc_t = fbbe::stacktrace_entry::native_handle_type;
+
+[[gnu::noinline]] static fbbe::stacktrace nested(int depth) {
+  if (depth == 0)
+    return fbbe::stacktrace::current();
+  auto st = nested(depth - 1);
+  return st;
+}
+
+auto main() -> int {
+  const auto st = nested(20);
+  const fbbe::compact_stacktrace c(st);
+  CHECK(c.size() == st.size());
+  CHECK(c.to_stacktrace() == st);
+  // The frames in this executable are close to each other.
+  CHECK(c.encoded_size() * 2 < st.size() * sizeof(pc_t));
+
+  pc_t pcs[4];
+  CHECK(c.decode(pcs, 4) == 4);
+  for (std::size_t i = 0; i < 4; ++i)
+    CHECK(pcs[i] == st[i].native_handle());
+
+  // Equal traces have equal encodings and hashes.
+  const fbbe::compact_stacktrace same{fbbe::stacktrace(st)};
+  std::hash<fbbe::compact_stacktrace> hash;
+  CHECK(c == same);
+  CHECK(hash(c) == hash(same));
+  const fbbe::compact_stacktrace other(nested(21));
+  CHECK(c != other);
+
+  // Copies, moves and the empty trace.
+  fbbe::compact_stacktrace copy = c;
+  CHECK(copy == c);
+  fbbe::compact_stacktrace moved = std::move(copy);
+  CHECK(moved == c && copy.empty());
+  copy = moved;
+  CHECK(copy == c);
+  moved.clear();
+  CHECK(moved.empty() && moved.encoded_size() == 0);
+  CHECK(moved == fbbe::compact_stacktrace());
+  CHECK(moved.to_stacktrace().empty());
+  swap(moved, copy);
+  CHECK(moved == c && copy.empty());
+
+  // Arbitrary addresses, in both directions and at the extremes, and more
+  // frames than are encoded at once.
+  std::vector<pc_t> values = {0, pc_t(-1), 1, pc_t(-1) / 2, 0x7fff0000, 5};
+  for (pc_t i = 0; i < 300; ++i)
+    values.push_back(0x400000 + i * i * 977);
+  {
+    fbbe::stack_table table;
+    const auto id = table.intern(values.data(), values.size());
+    const auto view = table[id];
+    const fbbe::compact_stacktrace v(view);
+    CHECK(v.size() == values.size());
+    std::vector<pc_t> decoded(values.size());
+    CHECK(v.decode(decoded.data(), decoded.size()) == values.size());
+    CHECK(decoded == values);
+    const auto back = v.to_stacktrace();
+    CHECK(back.size() == values.size());
+    CHECK(std::equal(back.begin(), back.end(), view.begin(), view.end()));
+  }
+  return 0;
+}
@@ -0,0 +1,165 @@
+// crash_handler must report the stack of the faulting function to its file
+// descriptor and then hand the signal on: to the default action, which
+// kills the process, or to the handler installed before it. It must not
+// look up the stack bounds of the crashing thread.
+#include <csignal>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "check.h"
+#include "fbbe/stacktrace.h"
+
+static int *volatile g_null = nullptr;
+static volatile int g_sink = 0;
+
+[[gnu::noinline]] static void crash_here() {
+  *g_null = 42;
+  g_sink = g_sink + 1; // no tail call
+}
+
+// Recurses until the stack overflows, g_sink is never negative.
+[[gnu::noinline]] static void overflow(int depth) {
+  volatile char pad[1024];
+  pad[0] = char(depth);
+  if (g_sink < 0)
+    return;
+  overflow(depth + 1);
+  g_sink = g_sink + pad[0]; // no tail call
+}
+
+static int g_fd = -1;
+
+// Reports the calls made while SIGSEGV is blocked, i.e. by its handler.
+extern "C" int pthread_getattr_np(pthread_t thread,
+                                  pthread_attr_t *attr) noexcept {
+  static const auto next = reinterpret_cast<decltype(&pthread_getattr_np)>(
+      dlsym(RTLD_NEXT, "pthread_getattr_np"));
+  sigset_t blocked;
+  pthread_sigmask(SIG_BLOCK, nullptr, &blocked);
+  if (g_fd >= 0 && sigismember(&blocked, SIGSEGV)) {
+    const char message[] = "pthread_getattr_np in the handler\n";
+    [[maybe_unused]] auto n = write(g_fd, message, sizeof(message) - 1);
+  }
+  return next(thread, attr);
+}
+
+static void previous_handler(int, siginfo_t *, void *) { _exit(42); }
+
+struct result {
+  std::string output;
+  int status;
+};
+
+template <typename F> static result run(F child) {
+  int fds[2];
+  CHECK(pipe(fds) == 0);
+  const pid_t pid = fork();
+  CHECK(pid >= 0);
+  if (pid == 0) {
+    close(fds[0]);
+    child(fds[1]);
+    _exit(0);
+  }
+  close(fds[1]);
+  result r;
+  char buf[4096];
+  for (ssize_t n; (n = read(fds[0], buf, sizeof(buf))) > 0;)
+    r.output.append(buf, n);
+  close(fds[0]);
+  CHECK(waitpid(pid, &r.status, 0) == pid);
+  return r;
+}
+
+static bool killed_by(const result &r, int sig) {
+  return WIFSIGNALED(r.status) && WTERMSIG(r.status) == sig;
+}
+
+auto main() -> int {
+  // Raw report, then the default action.
+  auto r = run([](int fd) {
+    fbbe::crash_handler_options options;
+    options.fd = fd;
+    CHECK(fbbe::crash_handler::install(options));
+    crash_here();
+  });
+  CHECK(killed_by(r, SIGSEGV));
+  CHECK(r.output.rfind("*** SIGSEGV (11) at 0x0, pid ", 0) == 0);
+  // The first frame is the faulting function, in this executable.
+  const auto first = r.output.substr(r.output.find('\n') + 1);
+  const auto pc = std::stoull(first, nullptr, 16);
+  const auto begin = reinterpret_cast<std::uintptr_t>(&crash_here);
+  CHECK(begin <= pc && pc < begin + 64);
+  const auto *self = fbbe::module_map::current().find(begin);
+  CHECK(self);
+  CHECK(first.find(' ' + self->path + "+0x") != std::string::npos);
+
+  // Symbolized report.
+  r = run([](int fd) {
+    fbbe::crash_handler_options options;
+    options.fd = fd;
+    options.symbolize = true;
+    CHECK(fbbe::crash_handler::install(options));
+    crash_here();
+  });
+  CHECK(killed_by(r, SIGSEGV));
+  CHECK(r.output.find("   0# crash_here") != std::string::npos);
+  CHECK(r.output.find("# main") != std::string::npos);
+
+  // A thread that was not prepared is reported without looking up its stack.
+  r = run([](int fd) {
+    fbbe::crash_handler_options options;
+    options.fd = fd;
+    CHECK(fbbe::crash_handler::install(options));
+    g_fd = fd;
+    std::thread(crash_here).join();
+  });
+  CHECK(killed_by(r, SIGSEGV));
+  CHECK(r.output.rfind("*** SIGSEGV (11) at 0x0, pid ", 0) == 0);
+  CHECK(r.output.find("in the handler") == std::string::npos);
+  CHECK(std::stoull(r.output.substr(r.output.find('\n') + 1), nullptr, 16) ==
+        pc);
+
+  // abort() is reported and still ends the process.
+  r = run([](int fd) {
+    fbbe::crash_handler_options options;
+    options.fd = fd;
+    CHECK(fbbe::crash_handler::install(options));
+    std::abort();
+  });
+  CHECK(killed_by(r, SIGABRT));
+  CHECK(r.output.rfind("*** SIGABRT (6)", 0) == 0);
+
+  // Chains to the handler installed before.
+  r = run([](int fd) {
+    struct sigaction action = {};
+    action.sa_sigaction = previous_handler;
+    action.sa_flags = SA_SIGINFO;
+    sigaction(SIGSEGV, &action, nullptr);
+    fbbe::crash_handler_options options;
+    options.fd = fd;
+    CHECK(fbbe::crash_handler::install(options));
+    crash_here();
+  });
+  CHECK(WIFEXITED(r.status) && WEXITSTATUS(r.status) == 42);
+  CHECK(r.output.rfind("*** SIGSEGV", 0) == 0);
+
+  // A stack overflow is reported from the alternate stack.
+  r = run([](int fd) {
+    fbbe::crash_handler_options options;
+    options.fd = fd;
+    options.max_frames = 8;
+    CHECK(fbbe::crash_handler::install(options));
+    overflow(0);
+  });
+  CHECK(killed_by(r, SIGSEGV));
+  CHECK(r.output.rfind("*** SIGSEGV", 0) == 0);
+  CHECK(r.output.size() > r.output.find('\n') + 1);
+  return 0;
+}
@@ -0,0 +1,64 @@
+// current(fbbe::exact_capture) must yield the same frames as the default
+// policy with a single allocation of exactly the size of the trace, also
+// for traces deeper than the per-thread buffer.
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+
+#include "fbbe/stacktrace.h"
+
+#define FBBE_TEST_COUNT_ALLOCATIONS
+#include "check.h"
+
+struct traces {
+  fbbe::stacktrace exact;
+  fbbe::stacktrace growing;
+  long allocations;
+  std::size_t allocated;
+};
+
+// Both traces are taken at the same depth; they differ in the first frame.
+[[gnu::noinline]] static void nested(int depth, traces &t,
+                                     unsigned short max_depth = 0xffff) {
+  if (depth == 0) {
+    const long before = g_allocations;
+    t.exact = fbbe::stacktrace::current(fbbe::exact_capture, 0, max_depth);
+    t.allocations = g_allocations - before;
+    t.allocated = g_last_allocation_size;
+    t.growing = fbbe::stacktrace::current(0, max_depth);
+    return;
+  }
+  nested(depth - 1, t, max_depth);
+  asm volatile("");
+}
+
+static bool same(const traces &t) {
+  return t.exact.size() == t.growing.size() && t.exact.size() > 1 &&
+         std::equal(t.exact.begin() + 1, t.exact.end(), t.growing.begin() + 1);
+}
+
+auto main() -> int {
+  traces t;
+  nested(0, t); // loads the unwinder
+
+  for (const int depth : {3, 100, 400}) {
+    nested(depth, t);
+    nested(depth, t); // the per-thread buffer has grown
+    CHECK(same(t));
+    CHECK(t.allocations == 1);
+    CHECK(t.allocated == t.exact.size() * sizeof(fbbe::stacktrace_entry));
+  }
+
+  nested(100, t, 10);
+  CHECK(t.exact.size() == 10 && same(t));
+  CHECK(t.allocations == 1);
+
+  // The unwinder can be combined with the policy.
+  const auto by_default = fbbe::stacktrace::current(fbbe::exact_capture);
+  const auto by_frame_pointer = fbbe::stacktrace::current(
+      fbbe::frame_pointer_unwinder, fbbe::exact_capture);
+  CHECK(!by_frame_pointer.empty());
+  CHECK(by_frame_pointer.size() <= by_default.size());
+  CHECK(fbbe::stacktrace::current(fbbe::growing_capture, 0, 1).size() == 1);
+  return 0;
+}
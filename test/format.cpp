@@ -0,0 +1,58 @@
+// format_to() and format_to_n() must write what the stream operators write,
+// and must not allocate once the names of the frames were seen.
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+#include <string>
+
+#include "fbbe/stacktrace.h"
+
+#define FBBE_TEST_COUNT_ALLOCATIONS
+#include "check.h"
+
+template <typename T> static std::string streamed(const T &value) {
+  std::ostringstream os;
+  os << value;
+  return os.str();
+}
+
+[[gnu::noinline]] static fbbe::stacktrace capture() {
+  return fbbe::stacktrace::current();
+}
+
+auto main() -> int {
+  const auto trace = capture();
+  CHECK(trace.size() >= 2);
+
+  const auto expected = streamed(trace);
+  CHECK(fbbe::to_string(trace) == expected);
+  std::string text;
+  fbbe::format_to(std::back_inserter(text), trace);
+  CHECK(text == expected);
+  for (const auto &entry : trace)
+    CHECK(fbbe::to_string(entry) == streamed(entry));
+
+  // Into a fixed buffer, without touching the heap.
+  char buffer[8192];
+  const long before = g_allocations;
+  const auto result = fbbe::format_to_n(buffer, sizeof(buffer), trace);
+  CHECK(g_allocations == before);
+  CHECK(result.size == std::ptrdiff_t(expected.size()));
+  CHECK(result.out == buffer + expected.size());
+  CHECK(std::string(buffer, result.out) == expected);
+
+  // Truncated output still reports the full size.
+  const auto truncated = fbbe::format_to_n(buffer, 10, trace);
+  CHECK(truncated.out == buffer + 10);
+  CHECK(truncated.size == std::ptrdiff_t(expected.size()));
+  CHECK(std::string(buffer, 10) == expected.substr(0, 10));
+
+  const auto entry = fbbe::format_to_n(buffer, sizeof(buffer), trace[0]);
+  CHECK(std::string(buffer, entry.out) == streamed(trace[0]));
+  CHECK(std::string(buffer, entry.out).find("capture") != std::string::npos);
+
+  CHECK(fbbe::format_to_n(buffer, 0, fbbe::stacktrace_entry()).size == 0);
+  return 0;
+}
@@ -0,0 +1,67 @@
+// The fmt (and, where available, std::format) formatters must write what
+// operator<< writes and honour the frame limit, 'a' and 's' specifications.
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#include "check.h"
+#include "fbbe/stacktrace.h"
+
+template <typename T> static std::string streamed(const T &value) {
+  std::ostringstream os;
+  os << value;
+  return os.str();
+}
+
+static std::string hex(std::uintptr_t pc) {
+  std::ostringstream os;
+  os << "0x" << std::hex << pc;
+  return os.str();
+}
+
+[[gnu::noinline]] static fbbe::stacktrace capture() {
+  return fbbe::stacktrace::current();
+}
+
+template <typename Format> static void check(Format format) {
+  const auto trace = capture();
+  CHECK(trace.size() >= 3);
+  CHECK(format("{}", trace) == streamed(trace));
+  CHECK(format("{}", trace[0]) == streamed(trace[0]));
+
+  // The first two frames only.
+  const auto full = streamed(trace);
+  const auto second = full.find('\n', full.find('\n') + 1);
+  CHECK(format("{:.2}", trace) == full.substr(0, second + 1));
+  CHECK(format("{:.0}", trace).empty());
+
+  CHECK(format("{:a}", trace[0]) == hex(trace[0].native_handle()));
+  CHECK(format("{:.1a}", trace) ==
+        "   0# " + hex(trace[0].native_handle()) + "\n");
+
+  const auto name = format("{:s}", trace[0]);
+  CHECK(name.find("capture") != std::string::npos);
+  CHECK(name.find(" at ") == std::string::npos);
+  CHECK(format("{:.1s}", trace) == "   0# " + name + "\n");
+}
+
+auto main() -> int {
+  check([](const char *spec, const auto &value) {
+    return fmt::format(fmt::runtime(spec), value);
+  });
+  bool thrown = false;
+  try {
+    (void)fmt::format(fmt::runtime("{:x}"), capture());
+  } catch (const fmt::format_error &) {
+    thrown = true;
+  }
+  CHECK(thrown);
+
+#if defined(__cpp_lib_format)
+  check([](const char *spec, const auto &value) {
+    return std::vformat(spec, std::make_format_args(value));
+  });
+#endif
+  return 0;
+}
@@ -0,0 +1,52 @@
+// The frame pointer unwinder must produce the same entries as the default
+// unwinder for code built with -fno-omit-frame-pointer.
+#include <cstdlib>
+#include <iostream>
+
+#include "check.h"
+#include "fbbe/stacktrace.h"
+
+static volatile int g_sink = 0;
+
+struct traces {
+  fbbe::stacktrace by_default;
+  fbbe::stacktrace by_frame_pointer;
+  fbbe::stacktrace limited;
+};
+
+[[gnu::noinline]] static void descend(int depth, traces &out) {
+  if (depth == 0) {
+    out.by_default = fbbe::stacktrace::current();
+    out.by_frame_pointer =
+        fbbe::stacktrace::current(fbbe::frame_pointer_unwinder);
+    out.limited = fbbe::stacktrace::current(fbbe::frame_pointer_unwinder, 1, 2);
+  } else {
+    descend(depth - 1, out);
+  }
+  g_sink = g_sink + 1; // no tail call
+}
+
+auto main() -> int {
+  constexpr int depth = 10;
+  traces t;
+  descend(depth, t);
+
+  // descend() frames plus main()
+  const auto frames = depth + 2;
+  CHECK(t.by_default.size() >= frames);
+  CHECK(t.by_frame_pointer.size() >= frames);
+  // Different call sites in the innermost frame, identical callers.
+  CHECK(t.by_default[0].description() == t.by_frame_pointer[0].description());
+  for (int i = 1; i < frames; ++i)
+    CHECK(t.by_default[i] == t.by_frame_pointer[i]);
+
+  // skip and max_depth behave like with the default unwinder.
+  CHECK(t.limited.size() == 2);
+  CHECK(t.limited[0] == t.by_default[1]);
+  CHECK(t.limited[1] == t.by_default[2]);
+
+  const auto explicit_default =
+      fbbe::stacktrace::current(fbbe::default_unwinder);
+  CHECK(!explicit_default.empty());
+  return 0;
+}
@@ -0,0 +1,99 @@
+// capture_from_context() and stacktrace::from_context() must start at the
+// interrupted instruction, without the signal handler and the trampoline.
+#include <csetjmp>
+#include <csignal>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#include <ucontext.h>
+
+#include "check.h"
+#include "fbbe/stacktrace.h"
+
+static int *volatile g_null = nullptr;
+static volatile int g_sink = 0;
+static sigjmp_buf g_jump;
+
+static fbbe::stacktrace_entry::native_handle_type g_frames[64];
+static std::size_t g_depth = 0;
+static fbbe::stacktrace g_trace;
+static fbbe::stacktrace g_current;
+
+[[gnu::noinline]] static void fault() {
+  *g_null = 42;
+  g_sink = g_sink + 1; // no tail call
+}
+
+[[gnu::noinline]] static void interrupted() {
+  std::raise(SIGUSR1);
+  g_sink = g_sink + 1; // no tail call
+}
+
+static void on_signal(int sig, siginfo_t *, void *context) {
+  const auto &uc = *static_cast<const ucontext_t *>(context);
+  g_depth = fbbe::capture_from_context(uc, g_frames, 64);
+  g_trace = fbbe::stacktrace::from_context(uc);
+  g_current = fbbe::stacktrace::current();
+  if (sig == SIGSEGV)
+    siglongjmp(g_jump, 1);
+}
+
+[[gnu::noinline]] static fbbe::stacktrace from_getcontext() {
+  ucontext_t uc;
+  getcontext(&uc);
+  auto trace = fbbe::stacktrace::from_context(uc);
+  g_sink = g_sink + 1; // no tail call
+  return trace;
+}
+
+static void check_same(const fbbe::stacktrace &trace) {
+  CHECK(trace.size() == g_depth);
+  for (std::size_t i = 0; i < g_depth; ++i)
+    CHECK(trace[i].native_handle() == g_frames[i]);
+}
+
+// The trace is the tail of the one captured in the handler.
+static void check_suffix(const fbbe::stacktrace &trace) {
+  CHECK(trace.size() < g_current.size());
+  const auto offset = g_current.size() - trace.size();
+  for (std::size_t i = 1; i < trace.size(); ++i)
+    CHECK(trace[i] == g_current[offset + i]);
+}
+
+auto main() -> int {
+  struct sigaction action = {};
+  action.sa_sigaction = on_signal;
+  action.sa_flags = SA_SIGINFO;
+  sigaction(SIGSEGV, &action, nullptr);
+  sigaction(SIGUSR1, &action, nullptr);
+
+  // A fault: the first frame is the faulting instruction.
+  if (sigsetjmp(g_jump, 1) == 0)
+    fault();
+  check_same(g_trace);
+  CHECK(g_trace.size() >= 2);
+  CHECK(g_trace[0].description_view() == "fault");
+  CHECK(g_trace[1].description_view() == "main");
+  check_suffix(g_trace);
+
+  // A signal sent by the thread itself interrupts the C library.
+  interrupted();
+  check_same(g_trace);
+  bool found = false;
+  for (const auto &entry : g_trace)
+    found |= entry.description_view() == "interrupted";
+  CHECK(found);
+  check_suffix(g_trace);
+
+  const auto trace = from_getcontext();
+  CHECK(trace.size() >= 2);
+  CHECK(trace[0].description_view() == "from_getcontext");
+  CHECK(trace[1].description_view() == "main");
+
+  ucontext_t uc;
+  getcontext(&uc);
+  CHECK(fbbe::stacktrace::from_context(uc, 1).size() == 1);
+  CHECK(fbbe::stacktrace::from_context(uc, 0).empty());
+  return 0;
+}
@@ -0,0 +1,228 @@
+// inline_stacktrace<N> must keep traces of up to N frames without
+// allocating, and copy, move, assign and swap like a basic_stacktrace,
+// also between inline and allocated frames. inline_allocator must take
+// deeper traces from the allocator it wraps and propagate it like that
+// allocator does.
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <memory_resource>
+#include <type_traits>
+#include <utility>
+
+#include "fbbe/stacktrace.h"
+
+#define FBBE_TEST_COUNT_ALLOCATIONS
+#include "check.h"
+
+using small = fbbe::inline_stacktrace<32>;
+
+// The blocks handed out by tagged_allocator, and the tag of each.
+static void *g_blocks[64];
+static int g_tags[64];
+
+static int &tag_of(void *p) {
+  for (std::size_t i = 0; i < std::size(g_blocks); ++i)
+    if (g_blocks[i] == p)
+      return g_tags[i];
+  std::cerr << "unknown block\n";
+  std::exit(1);
+}
+
+static int live_blocks() {
+  return int(std::count_if(std::begin(g_blocks), std::end(g_blocks),
+                           [](void *p) { return p != nullptr; }));
+}
+
+// Stateful and propagated on copy and move assignment and on swap. Blocks
+// must be returned to an allocator with the same tag.
+template <typename T> struct tagged_allocator {
+  using value_type = T;
+  using propagate_on_container_copy_assignment = std::true_type;
+  using propagate_on_container_move_assignment = std::true_type;
+  using propagate_on_container_swap = std::true_type;
+  using is_always_equal = std::false_type;
+
+  int tag;
+
+  explicit tagged_allocator(int t) noexcept : tag(t) {}
+  template <typename U>
+  tagged_allocator(const tagged_allocator<U> &other) noexcept
+      : tag(other.tag) {}
+
+  T *allocate(std::size_t n) {
+    void *p = ::operator new(n * sizeof(T));
+    tag_of(nullptr) = tag;
+    *std::find(std::begin(g_blocks), std::end(g_blocks), nullptr) = p;
+    return static_cast<T *>(p);
+  }
+
+  void deallocate(T *p, std::size_t) noexcept {
+    CHECK(tag_of(p) == tag);
+    *std::find(std::begin(g_blocks), std::end(g_blocks), p) = nullptr;
+    ::operator delete(p);
+  }
+
+  friend bool operator==(const tagged_allocator &x,
+                         const tagged_allocator &y) noexcept {
+    return x.tag == y.tag;
+  }
+  friend bool operator!=(const tagged_allocator &x,
+                         const tagged_allocator &y) noexcept {
+    return x.tag != y.tag;
+  }
+};
+
+using tagged = fbbe::basic_stacktrace<
+    fbbe::inline_allocator<tagged_allocator<fbbe::stacktrace_entry>, 32>>;
+
+template <typename Trace>
+[[gnu::noinline]] static Trace
+deep_trace(int depth, const typename Trace::allocator_type &alloc) {
+  if (depth == 0)
+    return Trace::current(alloc);
+  auto st = deep_trace<Trace>(depth - 1, alloc);
+  asm volatile("");
+  return st;
+}
+
+static tagged deep_tagged(int depth, int tag) {
+  return deep_trace<tagged>(depth, tagged::allocator_type(tag));
+}
+
+static int tag(const tagged &st) { return st.get_allocator().tag; }
+
+// Counts the bytes allocated from it.
+struct counting_resource : std::pmr::memory_resource {
+  std::size_t bytes = 0;
+
+  void *do_allocate(std::size_t n, std::size_t align) override {
+    bytes += n;
+    return std::pmr::new_delete_resource()->allocate(n, align);
+  }
+  void do_deallocate(void *p, std::size_t n, std::size_t align) override {
+    std::pmr::new_delete_resource()->deallocate(p, n, align);
+  }
+  bool do_is_equal(const memory_resource &other) const noexcept override {
+    return this == &other;
+  }
+};
+
+// Captures both traces at the same depth; they differ in the first frame.
+[[gnu::noinline]] static void nested(int depth, small &st,
+                                     fbbe::stacktrace &reference) {
+  if (depth == 0) {
+    st = small::current();
+    reference = fbbe::stacktrace::current();
+    return;
+  }
+  nested(depth - 1, st, reference);
+  asm volatile("");
+}
+
+static bool same(const small &a, const fbbe::stacktrace &b) {
+  return a.size() == b.size() && a.size() > 1 &&
+         std::equal(a.begin() + 1, a.end(), b.begin() + 1);
+}
+
+auto main() -> int {
+  static_assert(sizeof(fbbe::stacktrace) == 16);
+  static_assert(sizeof(small) ==
+                sizeof(fbbe::stacktrace) + 32 * sizeof(fbbe::stacktrace_entry));
+
+  small a, deep;
+  fbbe::stacktrace reference, deep_reference;
+  nested(3, a, reference);
+  nested(40, deep, deep_reference);
+  CHECK(same(a, reference) && a.size() <= 32);
+  CHECK(same(deep, deep_reference) && deep.size() > 32);
+
+  // Shallow traces, their copies and moves do not allocate.
+  long before = g_allocations;
+  a = small::current();
+  small b = a;
+  small c = std::move(b);
+  small d;
+  d = c;
+  small e;
+  e = std::move(d);
+  CHECK(g_allocations == before);
+  CHECK(!a.empty() && c == a && e == a);
+  CHECK(b.empty() && d.empty());
+  CHECK(a.get_allocator() == e.get_allocator());
+
+  // Deeper traces fall back to the allocator.
+  before = g_allocations;
+  small deep_copy = deep;
+  CHECK(g_allocations > before);
+  CHECK(deep_copy == deep);
+
+  // Assignments and swaps between inline and allocated frames.
+  small x = a;
+  x = deep;
+  CHECK(x == deep);
+  x = a;
+  CHECK(x == a);
+  x = std::move(deep_copy);
+  CHECK(x == deep && deep_copy.empty());
+  x.swap(a);
+  CHECK(x == e && a == deep);
+  swap(x, a);
+  CHECK(x == deep && a == e);
+  small y;
+  y.swap(x);
+  CHECK(y == deep && x.empty());
+
+  // A depth limit that fits moves the frames inline.
+  const auto limited = small::current(0, 4);
+  CHECK(limited.size() == 4);
+  const long after = g_allocations;
+  small limited_copy = limited;
+  CHECK(g_allocations == after && limited_copy == limited);
+
+  // Everything else works as for fbbe::stacktrace.
+  CHECK(fbbe::to_string(a).find("main") != std::string::npos);
+
+  // A stateful allocator is kept by copies and propagated by assignments
+  // and swaps, between inline and allocated frames.
+  {
+    const tagged shallow(tagged::current(tagged::allocator_type(1)));
+    const tagged deeper = deep_tagged(40, 2);
+    CHECK(shallow.size() <= 32 && deeper.size() > 32);
+    CHECK(live_blocks() == 1);
+    tagged copy = deeper;
+    CHECK(tag(copy) == 2 && copy == deeper && live_blocks() == 2);
+
+    tagged x(tagged::allocator_type(3));
+    x = deeper; // copy assignment
+    CHECK(tag(x) == 2 && x == deeper);
+    x = shallow;
+    CHECK(tag(x) == 1 && x == shallow);
+    x = std::move(copy); // move assignment takes the block
+    CHECK(tag(x) == 2 && x == deeper && copy.empty() && live_blocks() == 2);
+    tagged y(shallow);
+    y = std::move(x);
+    CHECK(tag(y) == 2 && y == deeper);
+    x = shallow;
+    CHECK(tag(x) == 1);
+
+    x.swap(y); // inline and allocated frames
+    CHECK(tag(x) == 2 && x == deeper && tag(y) == 1 && y == shallow);
+    swap(x, y);
+    CHECK(tag(x) == 1 && x == shallow && tag(y) == 2 && y == deeper);
+    tagged z = deep_tagged(40, 4);
+    y.swap(z); // both allocated
+    CHECK(tag(y) == 4 && tag(z) == 2 && z == deeper);
+  }
+  CHECK(live_blocks() == 0);
+
+  // Deeper traces come from the memory resource, shallow ones do not.
+  using pmr_small = fbbe::pmr::inline_stacktrace<32>;
+  counting_resource resource;
+  const auto shallow_pmr = pmr_small::current(&resource);
+  CHECK(!shallow_pmr.empty() && resource.bytes == 0);
+  const auto deep_pmr = deep_trace<pmr_small>(40, &resource);
+  CHECK(deep_pmr.size() > 32 && resource.bytes > 0);
+  CHECK(deep_pmr.get_allocator().resource() == &resource);
+  return 0;
+}
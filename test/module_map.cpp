@@ -0,0 +1,73 @@
+// fbbe::module_map must find the module of an address without rebuilding,
+// and pick up modules loaded and unloaded with dlopen() and dlclose().
+// find_cached() must only look for them when an address is not found.
+#include <cstdlib>
+#include <iostream>
+
+#include <dlfcn.h>
+
+#include "check.h"
+#include "fbbe/stacktrace.h"
+
+auto main() -> int {
+  const auto &map = fbbe::module_map::current();
+  CHECK(map.size() >= 2);
+  CHECK(&fbbe::module_map::current() == &map); // nothing changed
+
+  // Sorted and disjoint.
+  for (auto it = map.begin(); it != map.end(); ++it) {
+    CHECK(it->start < it->end);
+    if (it + 1 != map.end())
+      CHECK(it->end <= (it + 1)->start);
+  }
+
+  const auto main_pc = reinterpret_cast<std::uintptr_t>(&main);
+  const auto *self = map.find(main_pc);
+  CHECK(self);
+  CHECK(!self->path.empty());
+  CHECK(self->start <= main_pc && main_pc < self->end);
+  CHECK(map.find(0) == nullptr);
+  CHECK(map.find(std::uintptr_t(-1)) == nullptr);
+  for (const auto &module : map) {
+    CHECK(map.find(module.start) == &module);
+    CHECK(map.find(module.end - 1) == &module);
+  }
+
+  const auto trace = fbbe::stacktrace::current();
+  CHECK(map.find(trace[0].native_handle()) == self);
+
+#if defined(__GLIBC__)
+  if (void *handle = dlopen("libz.so.1", RTLD_NOW | RTLD_LOCAL)) {
+    const auto pc =
+        reinterpret_cast<std::uintptr_t>(dlsym(handle, "zlibVersion"));
+    CHECK(pc != 0);
+    const fbbe::module_info *found = nullptr;
+    CHECK(&fbbe::module_map::find_cached(&main_pc, 1, &found) == &map);
+    CHECK(found == self);
+    const auto &loaded = fbbe::module_map::find_cached(&pc, 1, &found);
+    CHECK(&loaded != &map);
+    CHECK(&fbbe::module_map::current() == &loaded);
+    CHECK(loaded.size() == map.size() + 1);
+    const auto *zlib = loaded.find(pc);
+    CHECK(zlib && zlib->path.find("libz") != std::string::npos);
+    CHECK(map.find(pc) == nullptr); // the old snapshot is unchanged
+
+    CHECK(found == zlib);
+
+    dlclose(handle);
+    // Addresses captured before dlclose() keep their module.
+    CHECK(&fbbe::module_map::find_cached(&pc, 1, &found) == &loaded);
+    CHECK(found == zlib);
+    const auto &unloaded = fbbe::module_map::current();
+    CHECK(&unloaded != &loaded);
+    CHECK(unloaded.size() == map.size());
+  }
+#endif
+
+  // refresh() always builds a new snapshot, which becomes the current one.
+  const auto &fresh = fbbe::module_map::refresh();
+  CHECK(&fresh != &map);
+  CHECK(&fbbe::module_map::current() == &fresh);
+  CHECK(fresh.size() == map.size());
+  return 0;
+}
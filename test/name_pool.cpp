@@ -0,0 +1,55 @@
+// description_view() and source_file_view() must agree with description()
+// and source_file() and must not allocate once a name was interned.
+#include <cstdlib>
+#include <iostream>
+
+#include "fbbe/stacktrace.h"
+
+#define FBBE_TEST_COUNT_ALLOCATIONS
+#include "check.h"
+
+namespace demo {
+template <typename T> struct widget {
+  [[gnu::noinline]] static fbbe::stacktrace capture() {
+    return fbbe::stacktrace::current();
+  }
+};
+} // namespace demo
+
+auto main() -> int {
+  const auto trace = demo::widget<int>::capture();
+  CHECK(trace.size() >= 2);
+
+  for (const auto &entry : trace) {
+    CHECK(entry.description_view() == entry.description());
+    CHECK(entry.source_file_view() == entry.source_file());
+  }
+  CHECK(trace[0].description_view() == "demo::widget<int>::capture()");
+  CHECK(trace[1].description_view() == "main");
+
+  // Names are demangled once; later queries return the same storage.
+  CHECK(trace[0].description_view().data() ==
+        trace[0].description_view().data());
+
+  const long before = g_allocations;
+  for (int i = 0; i < 100; ++i)
+    for (const auto &entry : trace) {
+      (void)entry.description_view();
+      (void)entry.source_file_view();
+    }
+  CHECK(g_allocations == before);
+
+  // The same holds with the symbol cache enabled.
+  fbbe::symbol_cache::enable(1 << 20);
+  for (const auto &entry : trace)
+    CHECK(entry.description_view() == entry.description());
+  const long cached = g_allocations;
+  for (const auto &entry : trace)
+    (void)entry.description_view();
+  CHECK(g_allocations == cached);
+
+  fbbe::stacktrace_entry empty;
+  CHECK(empty.description_view().empty());
+  CHECK(empty.source_file_view().empty());
+  return 0;
+}
@@ -0,0 +1,157 @@
+// The table based unwinder must produce the same entries as the default
+// unwinder, also for code without frame pointers, and drop the tables of
+// modules unloaded with dlclose(). Walks through built tables must ask the
+// loader at most once per 10 ms.
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+
+#include <dlfcn.h>
+#include <link.h>
+#if __has_include(<zlib.h>)
+#include <zlib.h>
+#endif
+
+#include "check.h"
+#include "fbbe/stacktrace.h"
+
+static volatile int g_sink = 0;
+static std::atomic<int> g_loader_calls{0};
+
+extern "C" int dl_iterate_phdr(int (*callback)(dl_phdr_info *, size_t, void *),
+                               void *data) {
+  static const auto next = reinterpret_cast<decltype(&dl_iterate_phdr)>(
+      dlsym(RTLD_NEXT, "dl_iterate_phdr"));
+  ++g_loader_calls;
+  return next(callback, data);
+}
+
+struct traces {
+  fbbe::stacktrace by_default;
+  fbbe::stacktrace by_orc;
+  fbbe::stacktrace limited;
+};
+
+[[gnu::noinline]] static void descend(int depth, traces &out) {
+  if (depth == 0) {
+    out.by_default = fbbe::stacktrace::current();
+    out.by_orc = fbbe::stacktrace::current(fbbe::orc_unwinder);
+    out.limited = fbbe::stacktrace::current(fbbe::orc_unwinder, 1, 2);
+  } else {
+    descend(depth - 1, out);
+  }
+  g_sink = g_sink + 1; // no tail call
+}
+
+static traces g_in_handler;
+
+// The signal trampoline has no table row, the default unwinder continues.
+extern "C" void on_signal(int) { descend(0, g_in_handler); }
+
+static void check(const traces &t, size_t min_size) {
+  // All frames, including those of the C library, are identical except
+  // for the call site in the innermost frame.
+  CHECK(t.by_default.size() >= min_size);
+  CHECK(t.by_default.size() == t.by_orc.size());
+  CHECK(t.by_default[0].description() == t.by_orc[0].description());
+  for (size_t i = 1; i < t.by_default.size(); ++i)
+    CHECK(t.by_default[i] == t.by_orc[i]);
+
+  CHECK(t.limited.size() == 2);
+  CHECK(t.limited[0] == t.by_default[1]);
+  CHECK(t.limited[1] == t.by_default[2]);
+}
+
+#if __has_include(<zlib.h>) && defined(__GLIBC__)
+static traces g_in_zlib;
+
+// Called by deflateInit_, so the traces walk through libz.
+extern "C" void *z_alloc(void *, unsigned n, unsigned size) {
+  descend(0, g_in_zlib);
+  return std::calloc(n, size);
+}
+
+extern "C" void z_free(void *, void *p) { std::free(p); }
+
+// Returns the address of deflateInit_, 0 if libz could not be loaded.
+static std::uintptr_t trace_in_zlib() {
+  void *handle = dlopen("libz.so.1", RTLD_NOW | RTLD_LOCAL);
+  if (!handle)
+    return 0;
+  auto init = reinterpret_cast<decltype(&deflateInit_)>(
+      dlsym(handle, "deflateInit_"));
+  auto end = reinterpret_cast<decltype(&deflateEnd)>(
+      dlsym(handle, "deflateEnd"));
+  CHECK(init && end);
+  z_stream z{};
+  z.zalloc = z_alloc;
+  z.zfree = z_free;
+  g_in_zlib = {};
+  CHECK(init(&z, 1, ZLIB_VERSION, int(sizeof(z))) == Z_OK);
+  end(&z);
+  const auto &modules = fbbe::module_map::current();
+  CHECK(std::any_of(g_in_zlib.by_orc.begin(), g_in_zlib.by_orc.end(),
+                    [&](const fbbe::stacktrace_entry &f) {
+                      const auto *m = modules.find(f.native_handle());
+                      return m && m->path.find("libz") != std::string::npos;
+                    }));
+  auto &registry = fbbe::__detail::_Orc_registry::_S_instance();
+  const auto pc = reinterpret_cast<std::uintptr_t>(init);
+  CHECK(registry._M_find_loaded(pc) != nullptr);
+  dlclose(handle);
+  return pc;
+}
+#endif
+
+auto main() -> int {
+  constexpr int depth = 10;
+  for (int run = 0; run < 2; ++run) { // building and using the tables
+    traces t;
+    descend(depth, t);
+    check(t, depth + 2);
+  }
+
+  {
+    using namespace std::chrono;
+    const int calls = g_loader_calls;
+    const auto start = steady_clock::now();
+    for (int i = 0; i < 1000; ++i) {
+      traces t;
+      descend(depth, t);
+    }
+    const auto elapsed = steady_clock::now() - start;
+    // One more for the coarse clock lagging behind.
+    CHECK(g_loader_calls - calls <=
+          2 + duration_cast<milliseconds>(elapsed).count() / 10);
+  }
+
+  std::signal(SIGUSR1, on_signal);
+  std::raise(SIGUSR1);
+  check(g_in_handler, 4);
+
+#if __has_include(<zlib.h>) && defined(__GLIBC__)
+  // The same library is likely mapped at the same address again, after its
+  // table was dropped.
+  auto &registry = fbbe::__detail::_Orc_registry::_S_instance();
+  for (int run = 0; run < 2; ++run) {
+    if (const auto pc = trace_in_zlib()) {
+      check(g_in_zlib, 4);
+      if (run == 0) {
+        registry._M_drop_unloaded();
+      } else {
+        // The next walk after the interval notices the unload.
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        registry._M_refresh();
+      }
+      CHECK(registry._M_find_loaded(pc) == nullptr);
+    }
+  }
+#endif
+  return 0;
+}
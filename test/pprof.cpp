@@ -0,0 +1,258 @@
+// pprof_builder must write a gzipped profile.proto message whose samples,
+// locations, functions and mappings describe the stacks that were added.
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined(FBBE_USE_ZLIB)
+#include <zlib.h>
+#endif
+
+#include "check.h"
+#include "fbbe/stacktrace.h"
+
+// A decoded message: the varint and the length-delimited fields by number.
+struct message {
+  std::multimap<unsigned, std::uint64_t> ints;
+  std::multimap<unsigned, std::string> bytes;
+
+  std::uint64_t get(unsigned field) const {
+    auto it = ints.find(field);
+    return it == ints.end() ? 0 : it->second;
+  }
+};
+
+static std::uint64_t read_varint(const std::string &s, size_t &pos) {
+  std::uint64_t v = 0;
+  for (unsigned shift = 0;; shift += 7) {
+    CHECK(pos < s.size());
+    const auto byte = static_cast<unsigned char>(s[pos++]);
+    v |= std::uint64_t(byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+      return v;
+  }
+}
+
+static message parse(const std::string &s) {
+  message m;
+  for (size_t pos = 0; pos < s.size();) {
+    const auto key = read_varint(s, pos);
+    const auto field = unsigned(key >> 3);
+    if ((key & 7) == 0) {
+      m.ints.emplace(field, read_varint(s, pos));
+    } else {
+      CHECK((key & 7) == 2);
+      const auto size = read_varint(s, pos);
+      CHECK(pos + size <= s.size());
+      m.bytes.emplace(field, s.substr(pos, size));
+      pos += size;
+    }
+  }
+  return m;
+}
+
+static std::vector<std::uint64_t> packed(const message &m, unsigned field) {
+  std::vector<std::uint64_t> values;
+  auto range = m.bytes.equal_range(field);
+  for (auto it = range.first; it != range.second; ++it)
+    for (size_t pos = 0; pos < it->second.size();)
+      values.push_back(read_varint(it->second, pos));
+  return values;
+}
+
+static std::vector<message> repeated(const message &m, unsigned field) {
+  std::vector<message> messages;
+  auto range = m.bytes.equal_range(field);
+  for (auto it = range.first; it != range.second; ++it)
+    messages.push_back(parse(it->second));
+  return messages;
+}
+
+static std::string gunzip(const std::string &gz) {
+  CHECK(gz.size() >= 18 && gz.compare(0, 3, "\x1f\x8b\x08") == 0);
+  std::string out;
+#if defined(FBBE_USE_ZLIB)
+  z_stream z{};
+  CHECK(inflateInit2(&z, 16 + 15) == Z_OK);
+  z.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(gz.data()));
+  z.avail_in = uInt(gz.size());
+  char buf[4096];
+  int r;
+  do {
+    z.next_out = reinterpret_cast<Bytef *>(buf);
+    z.avail_out = sizeof(buf);
+    r = inflate(&z, Z_NO_FLUSH);
+    CHECK(r == Z_OK || r == Z_STREAM_END);
+    out.append(buf, sizeof(buf) - z.avail_out);
+  } while (r != Z_STREAM_END);
+  inflateEnd(&z);
+  // Compressed, not stored.
+  CHECK(gz[10] != '\0' && gz[10] != '\1');
+#else
+  // Stored blocks only.
+  size_t pos = 10;
+  for (bool last = false; !last;) {
+    last = gz[pos] & 1;
+    CHECK((gz[pos] & 6) == 0);
+    const auto len = unsigned(static_cast<unsigned char>(gz[pos + 1])) |
+                     unsigned(static_cast<unsigned char>(gz[pos + 2])) << 8;
+    out.append(gz, pos + 5, len);
+    pos += 5 + len;
+  }
+  CHECK(pos + 8 == gz.size());
+#endif
+  std::uint32_t size = 0;
+  for (int i = 0; i < 4; ++i)
+    size |= std::uint32_t(static_cast<unsigned char>(gz[gz.size() - 4 + i]))
+            << (8 * i);
+  CHECK(size == out.size());
+  return out;
+}
+
+[[gnu::noinline]] static fbbe::stacktrace leaf() {
+  return fbbe::stacktrace::current();
+}
+
+[[gnu::noinline]] static fbbe::stacktrace caller() {
+  auto st = leaf();
+  asm volatile("");
+  return st;
+}
+
+auto main() -> int {
+  const auto a = leaf();
+  const auto b = caller();
+  CHECK(!a.empty() && !b.empty());
+
+  fbbe::stack_table table;
+  const auto id = table.intern(b);
+
+  fbbe::pprof_builder builder;
+  builder.add(a, 3);
+  builder.add(table, id, 5);
+  builder.add(fbbe::stacktrace_view(), 1);
+  CHECK(builder.size() == 3);
+  bool threw = false;
+  try {
+    builder.add(a, {1, 2});
+  } catch (const std::invalid_argument &) {
+    threw = true;
+  }
+  CHECK(threw && builder.size() == 3);
+
+  const auto p = parse(gunzip(builder.serialize()));
+  std::vector<std::string> strings;
+  for (auto range = p.bytes.equal_range(6); range.first != range.second;
+       ++range.first)
+    strings.push_back(range.first->second);
+  CHECK(!strings.empty() && strings[0].empty());
+  auto str = [&](std::uint64_t i) {
+    CHECK(i < strings.size());
+    return strings[i];
+  };
+
+  const auto types = repeated(p, 1);
+  CHECK(types.size() == 1);
+  CHECK(str(types[0].get(1)) == "samples");
+  CHECK(str(types[0].get(2)) == "count");
+  CHECK(p.get(9) != 0);
+
+  // Every distinct program counter is one location.
+  std::map<std::uint64_t, message> locations;
+  std::map<std::uint64_t, std::uint64_t> addresses;
+  for (auto &l : repeated(p, 4)) {
+    CHECK(!addresses.count(l.get(3)));
+    addresses[l.get(3)] = l.get(1);
+    locations[l.get(1)] = l;
+  }
+  std::map<std::uint64_t, message> functions;
+  for (auto &f : repeated(p, 5))
+    functions[f.get(1)] = f;
+  std::map<std::uint64_t, message> mappings;
+  for (auto &m : repeated(p, 3))
+    mappings[m.get(1)] = m;
+
+  const auto samples = repeated(p, 2);
+  CHECK(samples.size() == 3);
+  const fbbe::stacktrace *traces[] = {&a, &b, nullptr};
+  const std::uint64_t values[] = {3, 5, 1};
+  for (int i = 0; i < 3; ++i) {
+    CHECK(packed(samples[i], 2) == std::vector<std::uint64_t>{values[i]});
+    const auto ids = packed(samples[i], 1);
+    CHECK(ids.size() == (traces[i] ? traces[i]->size() : 0));
+    for (size_t j = 0; j < ids.size(); ++j) {
+      CHECK(locations.count(ids[j]));
+      CHECK(locations[ids[j]].get(3) == (*traces[i])[j].native_handle());
+    }
+  }
+  // a and b share the frames of main and below.
+  CHECK(locations.size() < a.size() + b.size());
+
+  auto name_of = [&](std::uint64_t address) {
+    const auto &l = locations[addresses[address]];
+    auto lines = repeated(l, 4);
+    CHECK(lines.size() == 1);
+    CHECK(functions.count(lines[0].get(1)));
+    const auto &f = functions[lines[0].get(1)];
+    CHECK(f.get(2) == f.get(3));
+    CHECK(mappings.count(l.get(2)));
+    const auto &m = mappings[l.get(2)];
+    CHECK(m.get(2) <= address && address < m.get(3));
+    return str(f.get(2));
+  };
+  CHECK(name_of(a[0].native_handle()) == "leaf");
+  CHECK(name_of(a[1].native_handle()) == "main");
+  CHECK(name_of(b[1].native_handle()) == "caller");
+
+  // The executable is the first mapping.
+  CHECK(!mappings.empty());
+  const auto exe = str(mappings.begin()->second.get(5));
+  CHECK(exe.size() >= 11 &&
+        exe.find("/test_pprof") != std::string::npos);
+  CHECK(mappings.begin()->second.get(7) == 1);
+
+  // Without compression, with two values and a period.
+  fbbe::pprof_options options;
+  options.compress = false;
+  options.sample_types = {{"alloc_objects", "count"},
+                          {"alloc_space", "bytes"}};
+  options.period_type = {"space", "bytes"};
+  options.period = 512;
+  options.duration = std::chrono::seconds(2);
+  fbbe::pprof_builder bytes(options);
+  bytes.add(a, {2, -4096});
+  const auto q = parse(bytes.serialize());
+  CHECK(repeated(q, 1).size() == 2);
+  CHECK(packed(repeated(q, 2)[0], 2) ==
+        (std::vector<std::uint64_t>{2, std::uint64_t(-4096)}));
+  strings.clear();
+  for (auto range = q.bytes.equal_range(6); range.first != range.second;
+       ++range.first)
+    strings.push_back(range.first->second);
+  CHECK(str(repeated(q, 11)[0].get(1)) == "space");
+  CHECK(q.get(12) == 512);
+  CHECK(q.get(10) == 2000000000);
+
+#if _FBBE_PROFILER
+  fbbe::profile prof;
+  prof.period = std::chrono::milliseconds(10);
+  prof.stacks.push_back({fbbe::stacktrace_view(a), 7});
+  prof.samples = 7;
+  const auto r = parse(gunzip(fbbe::to_pprof(prof)));
+  strings.clear();
+  for (auto range = r.bytes.equal_range(6); range.first != range.second;
+       ++range.first)
+    strings.push_back(range.first->second);
+  const auto cpu = repeated(r, 1);
+  CHECK(cpu.size() == 2);
+  CHECK(str(cpu[1].get(1)) == "cpu" && str(cpu[1].get(2)) == "nanoseconds");
+  CHECK(packed(repeated(r, 2)[0], 2) ==
+        (std::vector<std::uint64_t>{7, 70000000}));
+  CHECK(r.get(12) == 10000000);
+#endif
+  return 0;
+}
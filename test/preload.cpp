@@ -0,0 +1,31 @@
+// Symbolizing while stacktrace_preload() runs must wait for the warm-up and
+// give the same results as afterwards.
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "check.h"
+#include "fbbe/stacktrace.h"
+
+auto main() -> int {
+  const auto trace = fbbe::stacktrace::current();
+  fbbe::stacktrace_preload();
+  fbbe::stacktrace_preload(); // no effect
+
+  std::vector<std::string> results(4);
+  std::vector<std::thread> threads;
+  for (auto &result : results)
+    threads.emplace_back([&] { result = fbbe::to_string(trace); });
+  for (auto &thread : threads)
+    thread.join();
+
+  fbbe::stacktrace_preload_wait();
+  const auto expected = fbbe::to_string(trace);
+  CHECK(expected.find("main") != std::string::npos);
+  for (const auto &result : results)
+    CHECK(result == expected);
+  CHECK(trace[0].description() == "main");
+  return 0;
+}
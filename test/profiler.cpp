@@ -0,0 +1,155 @@
+// The profiler must count samples of the threads that use CPU time, by
+// stack, with both kinds of timers, and keep them after stop(). Its signal
+// handler must not look for modules loaded after start(), and threads that
+// exited must give their buffers to new threads.
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <iostream>
+#include <string_view>
+#include <thread>
+
+#include <dlfcn.h>
+#include <link.h>
+#include <signal.h>
+
+#include "check.h"
+#include "fbbe/stacktrace.h"
+
+static volatile unsigned long g_sink = 0;
+
+[[gnu::noinline]] static void burn(std::chrono::milliseconds duration) {
+  const auto end = std::chrono::steady_clock::now() + duration;
+  while (std::chrono::steady_clock::now() < end)
+    for (int i = 0; i < 1000; ++i)
+      g_sink = g_sink + i;
+}
+
+[[gnu::noinline]] static void burn_in_thread() {
+  burn(std::chrono::milliseconds(200));
+}
+
+[[gnu::noinline]] static void burn_in_last_thread() {
+  burn(std::chrono::milliseconds(100));
+}
+
+static bool has_frame(fbbe::stacktrace_view frames, std::string_view name) {
+  return std::any_of(frames.begin(), frames.end(), [&](const auto &f) {
+    return f.description_view() == name;
+  });
+}
+
+static std::uint64_t samples_in(const fbbe::profile &p,
+                                std::string_view name) {
+  std::uint64_t n = 0;
+  for (const auto &s : p.stacks)
+    if (has_frame(s.frames, name))
+      n += s.count;
+  return n;
+}
+
+static std::thread::id g_main;
+static std::atomic<int> g_lookups_in_handler{0};
+
+// Counts the calls made by the profiler's handler on the main thread, while
+// SIGPROF is blocked.
+extern "C" int dl_iterate_phdr(int (*callback)(dl_phdr_info *, size_t, void *),
+                               void *data) {
+  static const auto next = reinterpret_cast<decltype(&dl_iterate_phdr)>(
+      dlsym(RTLD_NEXT, "dl_iterate_phdr"));
+  sigset_t blocked;
+  pthread_sigmask(SIG_BLOCK, nullptr, &blocked);
+  if (sigismember(&blocked, SIGPROF) && std::this_thread::get_id() == g_main)
+    ++g_lookups_in_handler;
+  return next(callback, data);
+}
+
+auto main() -> int {
+  g_main = std::this_thread::get_id();
+  CHECK(!fbbe::profiler::running());
+  CHECK(fbbe::profiler::snapshot().samples == 0);
+
+  fbbe::profiler_options options;
+  options.frequency = 1000;
+  options.collect_interval = std::chrono::milliseconds(20);
+  CHECK(fbbe::profiler::start(options));
+  CHECK(fbbe::profiler::running());
+  CHECK(!fbbe::profiler::start(options));
+
+  // The worker starts after start() and is found by the collector.
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  std::thread worker([] {
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    burn_in_thread();
+  });
+  burn(std::chrono::milliseconds(300));
+  worker.join();
+
+  auto p = fbbe::profiler::snapshot();
+  CHECK(p.period == std::chrono::milliseconds(1));
+  CHECK(p.samples > 20);
+  CHECK(std::is_sorted(p.stacks.begin(), p.stacks.end(),
+                       [](const auto &x, const auto &y) {
+                         return x.count > y.count;
+                       }));
+  std::uint64_t total = 0;
+  for (const auto &s : p.stacks)
+    total += s.count;
+  CHECK(total == p.samples);
+  CHECK(samples_in(p, "burn") > 10);
+  CHECK(samples_in(p, "burn_in_thread") > 0);
+  CHECK(samples_in(p, "main") > 0);
+
+  fbbe::profiler::stop();
+  CHECK(!fbbe::profiler::running());
+  burn(std::chrono::milliseconds(50));
+  const auto after = fbbe::profiler::snapshot(true);
+  CHECK(after.samples >= p.samples);
+  CHECK(samples_in(after, "burn") >= samples_in(p, "burn"));
+  CHECK(fbbe::profiler::snapshot().samples == 0);
+
+  // One process-wide timer.
+  options.per_thread_timers = false;
+  options.frequency = 500;
+  CHECK(fbbe::profiler::start(options));
+  burn(std::chrono::milliseconds(200));
+  fbbe::profiler::stop();
+  p = fbbe::profiler::snapshot();
+  CHECK(p.period == std::chrono::milliseconds(2));
+  CHECK(samples_in(p, "burn") > 10);
+
+  // A module loaded after start() is picked up by the collector, not by
+  // the handler.
+  options.per_thread_timers = true;
+  CHECK(fbbe::profiler::start(options));
+  if (void *handle = dlopen("libz.so.1", RTLD_NOW | RTLD_LOCAL)) {
+    using crc32_t = unsigned long (*)(unsigned long, const unsigned char *,
+                                      unsigned);
+    const auto crc32 = reinterpret_cast<crc32_t>(dlsym(handle, "crc32"));
+    CHECK(crc32);
+    static const unsigned char data[4096] = {};
+    const auto end =
+        std::chrono::steady_clock::now() + std::chrono::milliseconds(200);
+    while (std::chrono::steady_clock::now() < end)
+      g_sink = g_sink + crc32(0, data, sizeof(data));
+    fbbe::profiler::stop();
+    dlclose(handle);
+  } else {
+    fbbe::profiler::stop();
+  }
+  CHECK(g_lookups_in_handler == 0);
+
+  // Many more short-lived threads than max_threads, one after the other.
+  options.max_threads = 4;
+  options.collect_interval = std::chrono::milliseconds(5);
+  CHECK(fbbe::profiler::start(options));
+  for (int i = 0; i < 4 * int(options.max_threads); ++i)
+    std::thread([] { burn(std::chrono::milliseconds(20)); }).join();
+  std::thread(burn_in_last_thread).join();
+  fbbe::profiler::stop();
+  p = fbbe::profiler::snapshot();
+  CHECK(samples_in(p, "burn_in_last_thread") > 0);
+  return 0;
+}
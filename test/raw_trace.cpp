@@ -0,0 +1,97 @@
+// A trace written by fbbe::to_raw_string() and resolved by fbbe_symbolize
+// must match the trace symbolized in-process.
+// usage: raw_trace <path to fbbe_symbolize>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "check.h"
+#include "fbbe/stacktrace.h"
+
+static volatile int g_sink = 0;
+
+[[gnu::noinline]] static fbbe::stacktrace capture() {
+  auto trace = fbbe::stacktrace::current();
+  g_sink = g_sink + 1; // no tail call
+  return trace;
+}
+
+static std::vector<std::string> lines(const std::string &text) {
+  std::vector<std::string> result;
+  std::istringstream in(text);
+  for (std::string line; std::getline(in, line);)
+    result.push_back(line);
+  return result;
+}
+
+// Runs fbbe_symbolize on a file holding log, returns its output.
+static std::string symbolize(const std::string &self, const std::string &tool,
+                             const std::string &log) {
+  const auto path = self + ".log";
+  std::ofstream(path) << log;
+  const auto command = tool + " " + path;
+  FILE *pipe = popen(command.c_str(), "r");
+  CHECK(pipe);
+  std::string output;
+  char buf[4096];
+  for (size_t n; (n = std::fread(buf, 1, sizeof(buf), pipe)) > 0;)
+    output.append(buf, n);
+  CHECK(pclose(pipe) == 0);
+  std::remove(path.c_str());
+  return output;
+}
+
+auto main(int argc, char **argv) -> int {
+  CHECK(argc == 2);
+  const auto trace = capture();
+  const auto raw = fbbe::to_raw_string(trace);
+
+  // One line per frame, plus the header, the modules and the trailer.
+  const auto record = lines(raw);
+  CHECK(record.front() == "fbbe-raw begin 1 " + std::to_string(trace.size()));
+  CHECK(record.back() == "fbbe-raw end");
+  CHECK(record[1].rfind("fbbe-raw module 0 0x", 0) == 0);
+
+  std::string log = "unrelated line\n";
+  for (const auto &line : record)
+    log += "[log] " + line + '\n';
+  const auto symbolized = lines(symbolize(argv[0], argv[1], log));
+  const auto expected = lines(fbbe::to_string(trace));
+  CHECK(symbolized.size() == size_t(trace.size()) + 1);
+  CHECK(symbolized[0] == "unrelated line");
+  // Frames with debug information resolve exactly as in-process.
+  for (size_t i = 0; i < trace.size(); ++i)
+    if (!trace[i].source_file().empty())
+      CHECK(symbolized[i + 1] == "[log] " + expected[i]);
+  CHECK(symbolized[1].find("capture") != std::string::npos);
+  CHECK(symbolized[2].find("main") != std::string::npos);
+
+  // Lines that cannot be parsed pass through unchanged.
+  const std::vector<std::string> malformed = {
+      "fbbe-raw begin 1 x",
+      "fbbe-raw begin 1 2",
+      "fbbe-raw module 18446744073709551615 0x0 - /lib/none.so",
+      "fbbe-raw module 99999999999999999999999 0x0 - /lib/none.so",
+      "fbbe-raw module 0 zz - /lib/none.so",
+      "fbbe-raw frame 0",
+      "fbbe-raw frame 99999999999999999999 0x10",
+      "fbbe-raw frame -1 0x10",
+      "fbbe-raw frame - 10",
+      "fbbe-raw frame - 0x10",
+      "fbbe-raw end",
+  };
+  log.clear();
+  for (const auto &line : malformed)
+    log += line + '\n';
+  const auto passed = lines(symbolize(argv[0], argv[1], log));
+  CHECK(passed.size() == 9);
+  CHECK(passed[0] == malformed[0]);
+  for (size_t i = 1; i < 8; ++i)
+    CHECK(passed[i] == malformed[i + 1]);
+  CHECK(passed[8] == "   0# 0x10");
+  return 0;
+}
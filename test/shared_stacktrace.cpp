@@ -0,0 +1,88 @@
+// shared_stacktrace copies must share the frames without allocating, and
+// hashing and comparison must agree with basic_stacktrace.
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "fbbe/stacktrace.h"
+
+#define FBBE_TEST_COUNT_ALLOCATIONS
+#include "check.h"
+
+[[gnu::noinline]] static fbbe::stacktrace nested(int depth) {
+  if (depth == 0)
+    return fbbe::stacktrace::current();
+  auto st = nested(depth - 1);
+  return st;
+}
+
+[[gnu::noinline]] static fbbe::shared_stacktrace shared_here() {
+  return fbbe::shared_stacktrace::current();
+}
+
+auto main() -> int {
+  const auto st = nested(5);
+  const fbbe::shared_stacktrace a(st);
+  CHECK(a.size() == st.size());
+  CHECK(std::equal(a.begin(), a.end(), st.begin(), st.end()));
+  CHECK(a.use_count() == 1);
+  CHECK(std::hash<fbbe::shared_stacktrace>{}(a) ==
+        std::hash<fbbe::stacktrace>{}(st));
+  CHECK(a.to_stacktrace() == st);
+
+  // Copies, moves and assignments only touch the count.
+  const long before = g_allocations;
+  {
+    auto b = a;
+    auto c = std::move(b);
+    fbbe::shared_stacktrace d;
+    d = c;
+    d = a;
+    CHECK(a.use_count() == 3 && b.empty() && b.use_count() == 0);
+    CHECK(c == a && d == a && c.begin() == a.begin());
+    std::vector<fbbe::shared_stacktrace> copies(100, a);
+    CHECK(a.use_count() == 103);
+  }
+  CHECK(g_allocations == before + 1); // the vector
+  CHECK(a.use_count() == 1);
+
+  // Equal frames in different blocks.
+  const fbbe::shared_stacktrace e(st);
+  CHECK(e == a && e.begin() != a.begin());
+  const fbbe::shared_stacktrace other(nested(6));
+  CHECK(other != a);
+  fbbe::shared_stacktrace empty;
+  CHECK(empty.empty() && empty.size() == 0 && empty != a);
+  CHECK(empty == fbbe::shared_stacktrace());
+  CHECK(std::hash<fbbe::shared_stacktrace>{}(empty) ==
+        std::hash<fbbe::stacktrace>{}(fbbe::stacktrace()));
+
+  // current() starts at its caller.
+  const auto here = shared_here();
+  CHECK(!here.empty() && here[0].description_view() == "shared_here");
+  CHECK(here.at(0) == here[0]);
+  CHECK(fbbe::shared_stacktrace::current(0, 2).size() == 2);
+
+  std::ostringstream os;
+  os << a;
+  CHECK(os.str() == fbbe::to_string(a));
+  CHECK(fbbe::to_string(a) == fbbe::to_string(st));
+
+  // Threads copy and drop the same block concurrently.
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; ++i)
+    threads.emplace_back([&a] {
+      for (int j = 0; j < 10000; ++j) {
+        auto copy = a;
+        CHECK(copy.size() == a.size());
+      }
+    });
+  for (auto &t : threads)
+    t.join();
+  CHECK(a.use_count() == 1);
+  return 0;
+}
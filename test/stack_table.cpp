@@ -0,0 +1,103 @@
+// stack_table must return the same id for equal frames, different ids for
+// different frames, and give back the frames of an id, also when threads
+// intern the same traces concurrently.
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "check.h"
+#include "fbbe/stacktrace.h"
+
+using pc_t = fbbe::stacktrace_entry::native_handle_type;
+
+[[gnu::noinline]] static fbbe::stacktrace nested(int depth) {
+  if (depth == 0)
+    return fbbe::stacktrace::current();
+  auto st = nested(depth - 1);
+  return st;
+}
+
+static bool same(fbbe::stacktrace_view view, const std::vector<pc_t> &pcs) {
+  if (view.size() != pcs.size())
+    return false;
+  for (std::size_t i = 0; i < pcs.size(); ++i)
+    if (view[i].native_handle() != pcs[i])
+      return false;
+  return true;
+}
+
+// Distinct synthetic traces, some of them longer than the first chunk.
+static std::vector<pc_t> synthetic(unsigned i) {
+  std::vector<pc_t> pcs(i % 7 == 0 ? 5000 + i : 1 + i % 40);
+  for (std::size_t j = 0; j < pcs.size(); ++j)
+    pcs[j] = 0x400000 + i * 16 + j;
+  return pcs;
+}
+
+auto main() -> int {
+  fbbe::stack_table table;
+  CHECK(table.size() == 0);
+
+  const auto a = nested(3);
+  const auto b = nested(5);
+  const auto ia = table.intern(a);
+  const auto ib = table.intern(b);
+  CHECK(ia != fbbe::invalid_stack_id);
+  CHECK(ib != fbbe::invalid_stack_id);
+  CHECK(ia != ib);
+  CHECK(table.intern(a) == ia);
+  CHECK(table.intern(fbbe::stacktrace(a)) == ia);
+  CHECK(table.find(b) == ib);
+  CHECK(table.size() == 2);
+  CHECK(table.find(nested(4)) == fbbe::invalid_stack_id);
+
+  const auto view = table[ia];
+  CHECK(view.size() == a.size());
+  CHECK(std::equal(view.begin(), view.end(), a.begin(), a.end()));
+  CHECK(view[0].description_view() == a[0].description_view());
+
+  // Program counters from capture_current() and empty traces.
+  pc_t pcs[64];
+  const auto n = fbbe::capture_current(pcs, 64);
+  const auto ic = table.intern(pcs, n);
+  CHECK(same(table[ic], std::vector<pc_t>(pcs, pcs + n)));
+  const auto ie = table.intern(fbbe::stacktrace());
+  CHECK(table[ie].empty());
+  CHECK(table.intern(pcs, 0) == ie);
+
+  // Concurrent interning yields one id per distinct trace.
+  constexpr unsigned traces = 2000;
+  fbbe::stack_table shared(traces);
+  std::vector<std::atomic<fbbe::stack_id>> ids(traces);
+  for (auto &id : ids)
+    id = fbbe::invalid_stack_id;
+  std::atomic<bool> ok{true};
+  std::vector<std::thread> threads;
+  for (unsigned t = 0; t < 4; ++t)
+    threads.emplace_back([&, t] {
+      for (unsigned k = 0; k < traces; ++k) {
+        const unsigned i = (k * 7 + t * 501) % traces;
+        const auto pcs = synthetic(i);
+        const auto id = shared.intern(pcs.data(), pcs.size());
+        auto expected = fbbe::invalid_stack_id;
+        if (id == fbbe::invalid_stack_id ||
+            (!ids[i].compare_exchange_strong(expected, id) && expected != id))
+          ok = false;
+      }
+    });
+  for (auto &t : threads)
+    t.join();
+  CHECK(ok);
+  CHECK(shared.size() == traces);
+  for (unsigned i = 0; i < traces; ++i)
+    CHECK(same(shared[ids[i]], synthetic(i)));
+
+  // A full table still finds what it holds.
+  const auto extra = synthetic(traces);
+  CHECK(shared.intern(extra.data(), extra.size()) == fbbe::invalid_stack_id);
+  const auto first = synthetic(0);
+  CHECK(shared.intern(first.data(), first.size()) == ids[0]);
+  return 0;
+}
@@ -0,0 +1,107 @@
+// stacktrace_view must observe, compare, hash and print frames owned
+// elsewhere, entries or raw program counters, like basic_stacktrace does.
+#include <algorithm>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "check.h"
+#include "fbbe/stacktrace.h"
+
+[[gnu::noinline]] static fbbe::stacktrace nested(int depth) {
+  if (depth == 0)
+    return fbbe::stacktrace::current();
+  auto st = nested(depth - 1);
+  return st;
+}
+
+static size_t count_frames(fbbe::stacktrace_view view) { return view.size(); }
+
+auto main() -> int {
+  const auto st = nested(4);
+  CHECK(st.size() > 6);
+
+  // basic_stacktrace converts implicitly.
+  const fbbe::stacktrace_view view = st;
+  CHECK(count_frames(st) == st.size());
+  CHECK(view.size() == st.size() &&
+        std::equal(view.begin(), view.end(), st.begin()));
+  CHECK(view == st && st == view && !(view != st));
+  CHECK(view.at(1) == st[1]);
+  bool thrown = false;
+  try {
+    (void)view.at(view.size());
+  } catch (const std::out_of_range &) {
+    thrown = true;
+  }
+  CHECK(thrown);
+
+  // A view over program counters, e.g. in a ring buffer.
+  std::vector<fbbe::stacktrace_entry::native_handle_type> pcs;
+  for (const auto &f : st)
+    pcs.push_back(f.native_handle());
+  const fbbe::stacktrace_view raw(pcs.data(), pcs.size());
+  CHECK(raw == view);
+  CHECK(raw[0].description_view() == st[0].description_view());
+  CHECK(raw.begin()->native_handle() == pcs[0]);
+  CHECK(raw.end() - raw.begin() == std::ptrdiff_t(pcs.size()));
+  CHECK(raw.begin()[2] == st[2] && *(raw.end() - 1) == st[st.size() - 1]);
+  CHECK(std::equal(raw.rbegin(), raw.rend(), st.rbegin()));
+
+  // subview
+  const auto inner = raw.subview(0, 2);
+  CHECK(inner.size() == 2 && inner[1] == st[1]);
+  const auto outer = raw.subview(2);
+  CHECK(outer.size() == size_t(st.size()) - 2 && outer[0] == st[2]);
+  CHECK(raw.subview(raw.size()).empty());
+  CHECK(raw.subview(1, 1000).size() == raw.size() - 1);
+  thrown = false;
+  try {
+    (void)raw.subview(raw.size() + 1);
+  } catch (const std::out_of_range &) {
+    thrown = true;
+  }
+  CHECK(thrown);
+
+  // Ordered by size, then frame by frame.
+  CHECK(inner < outer && outer > inner && inner <= inner && inner >= inner);
+  CHECK(raw.subview(0, 2) != raw.subview(1, 2));
+  CHECK((raw.subview(0, 2) < raw.subview(1, 2)) ==
+        (raw[0] < raw[1] || (raw[0] == raw[1] && raw[1] < raw[2])));
+
+  // Hashing agrees with basic_stacktrace.
+  CHECK(std::hash<fbbe::stacktrace_view>{}(raw) ==
+        std::hash<fbbe::stacktrace>{}(st));
+  CHECK(std::hash<fbbe::stacktrace_view>{}(fbbe::stacktrace_view()) ==
+        std::hash<fbbe::stacktrace>{}(fbbe::stacktrace()));
+
+  // Formatting prints the same as for basic_stacktrace.
+  std::ostringstream by_view, by_trace;
+  by_view << raw;
+  by_trace << st;
+  CHECK(by_view.str() == by_trace.str());
+  CHECK(fbbe::to_string(raw) == fbbe::to_string(st));
+  std::string formatted;
+  fbbe::format_to(std::back_inserter(formatted), raw);
+  CHECK(formatted == fbbe::to_string(raw));
+  char buffer[16];
+  const auto result = fbbe::format_to_n(buffer, sizeof(buffer), raw);
+  CHECK(result.size == std::ptrdiff_t(formatted.size()));
+  CHECK(std::string(buffer, sizeof(buffer)) == formatted.substr(0, 16));
+  const auto symbols = fbbe::symbolize(raw);
+  CHECK(symbols.size() == raw.size() && symbols[0].description ==
+                                            st[0].description());
+  CHECK(fbbe::to_raw_string(raw) == fbbe::to_raw_string(st));
+
+  // Shared and interned traces are views as well.
+  const fbbe::shared_stacktrace shared(raw);
+  CHECK(fbbe::stacktrace_view(shared) == raw);
+  fbbe::stack_table table;
+  CHECK(table[table.intern(pcs.data(), pcs.size())] == raw);
+  return 0;
+}
@@ -0,0 +1,116 @@
+// The symbol cache must return the same information as uncached queries,
+// stay within its memory limit and be dropped when a module is unloaded.
+// Queries of cached entries ask the loader only for its unload counter.
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <dlfcn.h>
+#include <link.h>
+
+#include "check.h"
+#include "fbbe/stacktrace.h"
+
+static std::atomic<int> g_loader_calls{0};
+static std::atomic<int> g_loader_modules{0};
+
+extern "C" int dl_iterate_phdr(int (*callback)(dl_phdr_info *, size_t, void *),
+                               void *data) {
+  static const auto next = reinterpret_cast<decltype(&dl_iterate_phdr)>(
+      dlsym(RTLD_NEXT, "dl_iterate_phdr"));
+  struct forward {
+    int (*callback)(dl_phdr_info *, size_t, void *);
+    void *data;
+  } f = {callback, data};
+  ++g_loader_calls;
+  return next(
+      [](dl_phdr_info *info, size_t size, void *data) {
+        ++g_loader_modules;
+        const auto &f = *static_cast<forward *>(data);
+        return f.callback(info, size, f.data);
+      },
+      &f);
+}
+
+auto main() -> int {
+  const auto trace = fbbe::stacktrace::current();
+  CHECK(!fbbe::symbol_cache::enabled());
+  const auto uncached = fbbe::to_string(trace);
+  std::vector<std::string> descriptions, entries;
+  for (const auto &entry : trace) {
+    descriptions.push_back(entry.description());
+    entries.push_back(fbbe::to_string(entry));
+  }
+  CHECK(fbbe::symbol_cache::memory_usage() == 0);
+
+  fbbe::symbol_cache::enable(1 << 20);
+  CHECK(fbbe::symbol_cache::enabled());
+  CHECK(fbbe::to_string(trace) == uncached); // cold
+  CHECK(fbbe::symbol_cache::memory_usage() > 0);
+  CHECK(fbbe::to_string(trace) == uncached); // warm
+  const int calls = g_loader_calls, modules = g_loader_modules;
+  for (std::size_t i = 0; i < trace.size(); ++i) {
+    CHECK(trace[i].description() == descriptions[i]);
+    CHECK(fbbe::to_string(trace[i]) == entries[i]);
+  }
+  // At most one call per query, stopping at the first module.
+  CHECK(g_loader_calls - calls <= int(2 * trace.size()));
+  CHECK(g_loader_modules - modules == g_loader_calls - calls);
+  CHECK(trace[0].description() == "main");
+  CHECK(trace[0].source_line() != 0);
+
+  // Shrinking evicts entries.
+  const auto used = fbbe::symbol_cache::memory_usage();
+  fbbe::symbol_cache::enable(used / 2);
+  CHECK(fbbe::symbol_cache::memory_usage() <= used / 2);
+  CHECK(fbbe::to_string(trace) == uncached);
+
+  fbbe::symbol_cache::clear();
+  CHECK(fbbe::symbol_cache::memory_usage() == 0);
+  CHECK(fbbe::to_string(trace) == uncached);
+
+#if defined(__GLIBC__)
+  fbbe::symbol_cache::enable(1 << 20);
+  if (void *handle = dlopen("libz.so.1", RTLD_NOW | RTLD_LOCAL)) {
+    auto pc = reinterpret_cast<std::uintptr_t>(dlsym(handle, "zlibVersion"));
+    CHECK(pc != 0);
+    fbbe::symbol_cache::clear();
+    fbbe::symbolize(trace);
+    const auto own = fbbe::symbol_cache::memory_usage();
+    fbbe::symbolize(fbbe::stacktrace_view(&pc, 1));
+    const auto with_zlib = fbbe::symbol_cache::memory_usage();
+    CHECK(with_zlib > own);
+
+    // A whole trace notices the unload.
+    dlclose(handle);
+    CHECK(fbbe::to_string(trace) == uncached);
+    CHECK(fbbe::symbol_cache::memory_usage() == own);
+
+    // So does a single entry, without a new module_map snapshot, also when
+    // the module was loaded again at the same address since.
+    handle = dlopen("libz.so.1", RTLD_NOW | RTLD_LOCAL);
+    CHECK(handle);
+    pc = reinterpret_cast<std::uintptr_t>(dlsym(handle, "zlibVersion"));
+    fbbe::module_map::current();
+    const auto entry = fbbe::stacktrace_view(&pc, 1)[0];
+    const auto description = entry.description();
+    CHECK(fbbe::symbol_cache::memory_usage() == with_zlib);
+    const auto *snapshot = fbbe::module_map::last();
+    dlclose(handle);
+    handle = dlopen("libz.so.1", RTLD_NOW | RTLD_LOCAL);
+    CHECK(handle);
+    CHECK(entry.description() == description);
+    CHECK(fbbe::symbol_cache::memory_usage() == with_zlib - own);
+    CHECK(fbbe::module_map::last() == snapshot);
+    dlclose(handle);
+  }
+#endif
+
+  fbbe::symbol_cache::disable();
+  CHECK(!fbbe::symbol_cache::enabled());
+  CHECK(fbbe::symbol_cache::memory_usage() == 0);
+  CHECK(fbbe::to_string(trace) == uncached);
+  return 0;
+}
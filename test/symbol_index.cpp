@@ -0,0 +1,49 @@
+// With the .symidx file written by fbbe_generate_symbol_index(), queries
+// must give the same results as libbacktrace.
+#include <cstdlib>
+#include <iostream>
+
+#include "check.h"
+#include "fbbe/stacktrace.h"
+
+static volatile int g_sink = 0;
+
+namespace demo {
+template <typename T> struct widget {
+  [[gnu::noinline]] static fbbe::stacktrace capture() {
+    auto trace = fbbe::stacktrace::current();
+    g_sink = g_sink + 1; // no tail call
+    return trace;
+  }
+};
+} // namespace demo
+
+auto main() -> int {
+  const auto trace = demo::widget<int>::capture();
+  CHECK(trace.size() >= 2);
+  CHECK(fbbe::symbol_index::enabled());
+  CHECK(fbbe::symbol_index::available(trace[0].native_handle()));
+
+  struct info {
+    std::string description;
+    std::string file;
+    unsigned line;
+  };
+  std::vector<info> indexed;
+  for (const auto &entry : trace)
+    indexed.push_back(
+        {entry.description(), entry.source_file(), entry.source_line()});
+  CHECK(indexed[0].description == "demo::widget<int>::capture()");
+  CHECK(indexed[1].description == "main");
+  CHECK(indexed[0].line != 0);
+
+  fbbe::symbol_index::disable();
+  CHECK(!fbbe::symbol_index::enabled());
+  for (size_t i = 0; i < trace.size(); ++i) {
+    CHECK(indexed[i].description == trace[i].description());
+    CHECK(indexed[i].file == trace[i].source_file());
+    CHECK(indexed[i].line == trace[i].source_line());
+  }
+  fbbe::symbol_index::enable();
+  return 0;
+}
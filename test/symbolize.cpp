@@ -0,0 +1,37 @@
+// fbbe::symbolize must resolve the same information as the per entry
+// queries, also for traces with repeated frames.
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+
+#include "check.h"
+#include "fbbe/stacktrace.h"
+
+static volatile int g_sink = 0;
+
+[[gnu::noinline]] static fbbe::stacktrace descend(int depth) {
+  auto trace = depth == 0 ? fbbe::stacktrace::current() : descend(depth - 1);
+  g_sink = g_sink + 1; // no tail call
+  return trace;
+}
+
+auto main() -> int {
+  const auto trace = descend(5);
+  const auto symbols = fbbe::symbolize(trace);
+  CHECK(symbols.size() == trace.size());
+  CHECK(symbols[0].description.find("descend") != std::string::npos);
+
+  std::ostringstream expected;
+  for (size_t i = 0; i < trace.size(); ++i) {
+    CHECK(symbols[i].description == trace[i].description());
+    CHECK(symbols[i].source_file == trace[i].source_file());
+    CHECK(symbols[i].source_line == trace[i].source_line());
+    CHECK(symbols[i].resolved == static_cast<bool>(trace[i]));
+    expected.width(4);
+    expected << i << "# " << trace[i] << '\n';
+  }
+  CHECK(fbbe::to_string(trace) == expected.str());
+
+  CHECK(fbbe::symbolize(fbbe::stacktrace()).empty());
+  return 0;
+}
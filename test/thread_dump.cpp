@@ -0,0 +1,155 @@
+// capture_all_threads() must return the stack of every thread, empty for
+// threads that block the signal, and thread_dump_handler must write the dump
+// when its signal arrives. The handler must not look up stack bounds.
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dlfcn.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "check.h"
+#include "fbbe/stacktrace.h"
+
+static std::mutex g_mutex;
+// Not destroyed, a failed check exits while the workers wait on it.
+static std::condition_variable &g_cv = *new std::condition_variable;
+static bool g_stop = false;
+static std::atomic<int> g_parked{0};
+
+static std::atomic<int> g_lookups_in_handler{0};
+
+// Counts the calls made while the dump signal is blocked, i.e. by its
+// handler.
+extern "C" int pthread_getattr_np(pthread_t thread,
+                                  pthread_attr_t *attr) noexcept {
+  static const auto next = reinterpret_cast<decltype(&pthread_getattr_np)>(
+      dlsym(RTLD_NEXT, "pthread_getattr_np"));
+  sigset_t blocked;
+  pthread_sigmask(SIG_BLOCK, nullptr, &blocked);
+  if (sigismember(&blocked, SIGRTMAX - 1))
+    ++g_lookups_in_handler;
+  return next(thread, attr);
+}
+
+static pid_t gettid_() { return pid_t(syscall(SYS_gettid)); }
+
+[[gnu::noinline]] static void park() {
+  std::unique_lock<std::mutex> lock(g_mutex);
+  ++g_parked;
+  g_cv.wait(lock, [] { return g_stop; });
+}
+
+static void worker(std::atomic<pid_t> *tid, bool block) {
+  if (block) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGRTMAX - 1);
+    pthread_sigmask(SIG_BLOCK, &set, nullptr);
+  }
+  *tid = gettid_();
+  park();
+}
+
+static bool has_frame(const fbbe::stacktrace &trace, const char *name) {
+  return std::any_of(trace.begin(), trace.end(), [&](const auto &f) {
+    return f.description_view() == name;
+  });
+}
+
+static void wait_parked(int n) {
+  while (g_parked != n)
+    std::this_thread::yield();
+}
+
+auto main() -> int {
+  constexpr int workers = 3;
+  std::atomic<pid_t> tids[workers + 1] = {};
+  std::vector<std::thread> threads;
+  for (int i = 0; i < workers; ++i)
+    threads.emplace_back(worker, &tids[i], false);
+  wait_parked(workers);
+
+  // Every thread answers, long before the timeout.
+  fbbe::thread_dump_options options;
+  options.timeout = std::chrono::seconds(5);
+  const auto start = std::chrono::steady_clock::now();
+  auto dump = fbbe::capture_all_threads(options);
+  CHECK(std::chrono::steady_clock::now() - start < std::chrono::seconds(1));
+  CHECK(dump.size() == workers + 1);
+  CHECK(!dump[gettid_()].empty());
+  CHECK(dump[gettid_()][0].description_view() == "main");
+  for (int i = 0; i < workers; ++i) {
+    CHECK(dump.count(tids[i]));
+    CHECK(has_frame(dump[tids[i]], "park"));
+  }
+  CHECK(g_lookups_in_handler == 0);
+
+  // A thread that blocks the signal does not answer.
+  threads.emplace_back(worker, &tids[workers], true);
+  wait_parked(workers + 1);
+  options.timeout = std::chrono::milliseconds(50);
+  dump = fbbe::capture_all_threads(options);
+  CHECK(dump.size() == workers + 2);
+  CHECK(dump[tids[workers]].empty());
+  CHECK(has_frame(dump[tids[0]], "park"));
+
+  options.max_frames = 1;
+  dump = fbbe::capture_all_threads(options);
+  CHECK(dump[gettid_()].size() == 1);
+  CHECK(dump[tids[0]].size() == 1);
+
+  // SIGQUIT appends a symbolized dump to the file.
+  char path[] = "/tmp/fbbe_thread_dump_XXXXXX";
+  const int fd = mkstemp(path);
+  CHECK(fd >= 0);
+  close(fd);
+  fbbe::thread_dump_handler_options handler;
+  handler.path = path;
+  handler.dump.timeout = std::chrono::milliseconds(50);
+  CHECK(fbbe::thread_dump_handler::install(handler));
+  std::raise(SIGQUIT);
+  std::string text;
+  for (int i = 0; i < 500 && text.find("no answer") == std::string::npos;
+       ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    std::ifstream in(path);
+    std::stringstream ss;
+    ss << in.rdbuf();
+    text = ss.str();
+  }
+  fbbe::thread_dump_handler::uninstall();
+  std::remove(path);
+  CHECK(text.rfind("*** pid " + std::to_string(getpid()) + ", " +
+                       std::to_string(workers + 2) + " threads ***\n",
+                   0) == 0);
+  CHECK(text.find("\nthread " + std::to_string(tids[0]) + " \"") !=
+        std::string::npos);
+  CHECK(text.find(" park") != std::string::npos);
+  // The name of the process, truncated to 15 characters.
+  CHECK(text.find("\nthread " + std::to_string(tids[workers]) +
+                  " \"test_thread_dum\": no answer\n") != std::string::npos);
+
+  {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    g_stop = true;
+  }
+  g_cv.notify_all();
+  for (auto &t : threads)
+    t.join();
+  return 0;
+}
@@ -0,0 +1,83 @@
+// write_stacktrace() must write what operator<< writes, and in raw mode the
+// module offsets, without allocating.
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#include "fbbe/stacktrace.h"
+
+#define FBBE_TEST_COUNT_ALLOCATIONS
+#include "check.h"
+
+static volatile int g_sink = 0;
+
+// Deep enough for the output to exceed the buffer of the writer.
+[[gnu::noinline]] static fbbe::stacktrace capture(int depth) {
+  if (depth == 0)
+    return fbbe::stacktrace::current();
+  auto trace = capture(depth - 1);
+  g_sink = g_sink + 1; // no tail call
+  return trace;
+}
+
+template <typename F> static std::string written(F write) {
+  std::FILE *file = std::tmpfile();
+  CHECK(file);
+  CHECK(write(fileno(file)));
+  std::rewind(file);
+  std::string text;
+  char buf[4096];
+  for (std::size_t n; (n = std::fread(buf, 1, sizeof(buf), file)) > 0;)
+    text.append(buf, n);
+  std::fclose(file);
+  return text;
+}
+
+auto main() -> int {
+  const auto trace = capture(40);
+  CHECK(trace.size() > 40);
+
+  const auto text = written(
+      [&](int fd) { return fbbe::write_stacktrace(fd, trace); });
+  CHECK(text.size() > 512);
+  CHECK(text == fbbe::to_string(trace));
+
+  fbbe::write_options options;
+  options.max_frames = 2;
+  const auto two = written(
+      [&](int fd) { return fbbe::write_stacktrace(fd, trace, options); });
+  CHECK(two == text.substr(0, text.find('\n', text.find('\n') + 1) + 1));
+
+  // Raw: "0x<pc> <module>+0x<offset>" from the last module map snapshot.
+  const auto &modules = fbbe::module_map::current();
+  options = {};
+  options.raw = true;
+  std::string raw;
+  const long before = g_allocations;
+  {
+    std::FILE *file = std::tmpfile();
+    CHECK(fbbe::write_stacktrace(fileno(file), trace, options));
+    CHECK(g_allocations == before);
+    std::rewind(file);
+    char buf[4096];
+    for (std::size_t n; (n = std::fread(buf, 1, sizeof(buf), file)) > 0;)
+      raw.append(buf, n);
+    std::fclose(file);
+  }
+  std::istringstream lines(raw);
+  std::string line;
+  for (const auto &entry : trace) {
+    CHECK(std::getline(lines, line));
+    std::ostringstream expected;
+    expected << "0x" << std::hex << entry.native_handle();
+    if (const auto *m = modules.find(entry.native_handle()))
+      expected << ' ' << m->path << "+0x" << entry.native_handle() - m->base;
+    CHECK(line == expected.str());
+  }
+  CHECK(!std::getline(lines, line));
+
+  CHECK(!fbbe::write_stacktrace(-1, trace));
+  return 0;
+}
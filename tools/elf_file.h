@@ -0,0 +1,297 @@
+// Reading ELF files and symbolizing their addresses, shared by the tools.
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <elf.h>
+#include <link.h>
+
+#include "fbbe/stacktrace.h"
+
+namespace fbbe::tools {
+
+struct elf_section {
+  std::string name;
+  std::uint32_t type = 0;
+  std::uint64_t flags = 0;
+  std::uint64_t addr = 0;
+  std::uint64_t offset = 0;
+  std::uint64_t size = 0;
+  std::uint32_t link = 0;
+};
+
+struct elf_symbol {
+  std::uint64_t value = 0;
+  std::uint64_t size = 0;
+  std::string name;
+};
+
+class elf_file {
+public:
+  std::string path;
+  bool is_64 = true;
+  std::uint16_t type = 0;
+  std::string build_id;
+  std::vector<elf_section> sections;
+  // Link-time address ranges of the executable segments.
+  std::vector<std::pair<std::uint64_t, std::uint64_t>> code;
+
+  // Reads the headers of the ELF file at path.
+  bool open(std::string file) {
+    path = std::move(file);
+    in_.open(path, std::ios::binary);
+    unsigned char ident[EI_NIDENT];
+    if (!in_.read(reinterpret_cast<char *>(ident), sizeof(ident)) ||
+        std::string_view(reinterpret_cast<char *>(ident), 4) != ELFMAG)
+      return false;
+    is_64 = ident[EI_CLASS] == ELFCLASS64;
+    return is_64 ? read_headers<Elf64_Ehdr, Elf64_Phdr, Elf64_Shdr>()
+                 : read_headers<Elf32_Ehdr, Elf32_Phdr, Elf32_Shdr>();
+  }
+
+  std::vector<unsigned char> read(std::uint64_t offset, std::uint64_t size) {
+    std::vector<unsigned char> data(size);
+    if (!in_.seekg(offset).read(reinterpret_cast<char *>(data.data()), size))
+      data.clear();
+    return data;
+  }
+
+  const elf_section *section(std::string_view name) const {
+    for (const auto &s : sections)
+      if (s.name == name)
+        return &s;
+    return nullptr;
+  }
+
+  // Start and size of the defined functions, from .symtab or else .dynsym.
+  std::vector<elf_symbol> functions() {
+    const auto *table = section(".symtab");
+    if (!table)
+      table = section(".dynsym");
+    if (!table)
+      return {};
+    return is_64 ? read_functions<Elf64_Sym>(*table)
+                 : read_functions<Elf32_Sym>(*table);
+  }
+
+private:
+  std::ifstream in_;
+
+  template <typename Ehdr, typename Phdr, typename Shdr> bool read_headers() {
+    Ehdr ehdr;
+    if (!in_.seekg(0).read(reinterpret_cast<char *>(&ehdr), sizeof(ehdr)))
+      return false;
+    type = ehdr.e_type;
+    if (type != ET_EXEC && type != ET_DYN)
+      return false;
+    for (unsigned i = 0; i < ehdr.e_phnum; ++i) {
+      Phdr phdr;
+      if (!in_.seekg(ehdr.e_phoff + i * ehdr.e_phentsize)
+               .read(reinterpret_cast<char *>(&phdr), sizeof(phdr)))
+        return false;
+      if (phdr.p_type == PT_LOAD && (phdr.p_flags & PF_X))
+        code.emplace_back(phdr.p_vaddr, phdr.p_vaddr + phdr.p_memsz);
+      if (phdr.p_type == PT_NOTE && build_id.empty()) {
+        const auto notes = read(phdr.p_offset, phdr.p_filesz);
+        build_id = fbbe::__detail::_S_build_id(notes.data(), notes.size());
+      }
+    }
+
+    std::vector<Shdr> shdrs(ehdr.e_shnum);
+    for (unsigned i = 0; i < ehdr.e_shnum; ++i)
+      if (!in_.seekg(ehdr.e_shoff + i * ehdr.e_shentsize)
+               .read(reinterpret_cast<char *>(&shdrs[i]), sizeof(Shdr)))
+        return false;
+    std::vector<unsigned char> names;
+    if (ehdr.e_shstrndx < shdrs.size())
+      names = read(shdrs[ehdr.e_shstrndx].sh_offset,
+                   shdrs[ehdr.e_shstrndx].sh_size);
+    for (const auto &shdr : shdrs) {
+      elf_section s;
+      if (shdr.sh_name < names.size())
+        s.name = reinterpret_cast<const char *>(names.data() + shdr.sh_name);
+      s.type = shdr.sh_type;
+      s.flags = shdr.sh_flags;
+      s.addr = shdr.sh_addr;
+      s.offset = shdr.sh_offset;
+      s.size = shdr.sh_type == SHT_NOBITS ? 0 : shdr.sh_size;
+      s.link = shdr.sh_link;
+      sections.push_back(std::move(s));
+    }
+    return true;
+  }
+
+  template <typename Sym>
+  std::vector<elf_symbol> read_functions(const elf_section &table) {
+    std::vector<elf_symbol> result;
+    const auto data = read(table.offset, table.size);
+    std::vector<unsigned char> names;
+    if (table.link < sections.size())
+      names = read(sections[table.link].offset, sections[table.link].size);
+    for (std::size_t pos = 0; pos + sizeof(Sym) <= data.size();
+         pos += sizeof(Sym)) {
+      Sym sym;
+      std::memcpy(&sym, data.data() + pos, sizeof(sym));
+      if ((sym.st_info & 0xf) == STT_FUNC && sym.st_shndx != SHN_UNDEF &&
+          sym.st_value != 0) {
+        elf_symbol f = {sym.st_value, sym.st_size, {}};
+        if (sym.st_name < names.size())
+          f.name = std::string(
+              reinterpret_cast<const char *>(names.data() + sym.st_name),
+              strnlen(reinterpret_cast<const char *>(names.data()) +
+                          sym.st_name,
+                      names.size() - sym.st_name));
+        result.push_back(std::move(f));
+      }
+    }
+    return result;
+  }
+};
+
+// Up to count named functions, spread over the symbol table. Left out are
+// functions that share their address with another, since libbacktrace
+// reports either name, those without a size, which it skips, and clones
+// such as "f.cold" or "f.isra.0", whose debug information names "f".
+inline std::vector<elf_symbol> sample_functions(std::vector<elf_symbol> all,
+                                                std::size_t count) {
+  std::sort(all.begin(), all.end(),
+            [](const auto &x, const auto &y) { return x.value < y.value; });
+  std::vector<elf_symbol> unique;
+  for (std::size_t i = 0; i < all.size(); ++i)
+    if (!all[i].name.empty() && all[i].size != 0 &&
+        all[i].name.find('.') == std::string::npos &&
+        (i == 0 || all[i - 1].value != all[i].value) &&
+        (i + 1 == all.size() || all[i + 1].value != all[i].value))
+      unique.push_back(std::move(all[i]));
+  std::vector<elf_symbol> sample;
+  const std::size_t step = std::max<std::size_t>(unique.size() / count, 1);
+  for (std::size_t i = 0; i < unique.size() && sample.size() < count;
+       i += step)
+    sample.push_back(std::move(unique[i]));
+  return sample;
+}
+
+struct symbol {
+  // The innermost function, which may have been inlined into enclosing.
+  std::string_view function;
+  std::string_view enclosing;
+  const char *file = nullptr;
+  int line = 0;
+};
+
+// Symbolizes link-time addresses of an ELF file with libbacktrace.
+class file_symbolizer {
+public:
+  file_symbolizer() = default;
+  file_symbolizer(const file_symbolizer &) = delete;
+  file_symbolizer &operator=(const file_symbolizer &) = delete;
+
+  // Where libbacktrace places a file given by name is up to its version: a
+  // position independent file may end up at its link-time addresses or at
+  // the load address of a module of the running process. So the functions
+  // of the symbol table are looked up at every such bias, and the one at
+  // which libbacktrace reports all of them by name and start address is
+  // used. Fails if there is none, rather than guess.
+  bool open(elf_file &elf) {
+    path_ = elf.path;
+    state_ = backtrace_create_state(path_.c_str(), 0, ignore_error, nullptr);
+    if (!state_)
+      return false;
+    const auto probes = sample_functions(elf.functions(), 8);
+    if (probes.empty())
+      return elf.type == ET_EXEC; // only link-time addresses make sense
+    std::vector<std::uintptr_t> biases = {0};
+    if (elf.type == ET_DYN)
+      dl_iterate_phdr(
+          [](dl_phdr_info *info, size_t, void *data) {
+            static_cast<std::vector<std::uintptr_t> *>(data)->push_back(
+                info->dlpi_addr);
+            return 0;
+          },
+          &biases);
+    for (const auto bias : biases)
+      if (std::all_of(probes.begin(), probes.end(), [&](const auto &f) {
+            return at(bias, f);
+          })) {
+        bias_ = bias;
+        return true;
+      }
+    return false;
+  }
+
+  // Returns the innermost function at the link-time address, like
+  // stacktrace_entry::description() does at run time, and the function it
+  // was inlined into.
+  symbol resolve(std::uint64_t address) const {
+    struct inlined {
+      symbol result;
+      bool first = true;
+    } frames;
+    const std::uintptr_t pc = bias_ + address;
+    backtrace_pcinfo(
+        state_, pc,
+        [](void *data, std::uintptr_t, const char *filename, int lineno,
+           const char *function) -> int {
+          auto &f = *static_cast<inlined *>(data);
+          if (function)
+            f.result.enclosing = demangle(function);
+          if (f.first) {
+            f.result.function = f.result.enclosing;
+            f.result.file = filename;
+            f.result.line = lineno;
+            f.first = false;
+          }
+          return 0; // continue to the outermost function
+        },
+        ignore_error, &frames);
+    symbol &result = frames.result;
+    if (result.function.empty()) {
+      const char *name = nullptr;
+      backtrace_syminfo(
+          state_, pc,
+          [](void *data, std::uintptr_t, const char *symname, std::uintptr_t,
+             std::uintptr_t) { *static_cast<const char **>(data) = symname; },
+          ignore_error, &name);
+      if (name)
+        result.function = result.enclosing = demangle(name);
+    }
+    return result;
+  }
+
+private:
+  std::string path_; // referenced by state_
+  backtrace_state *state_ = nullptr;
+  std::uintptr_t bias_ = 0;
+
+  static void ignore_error(void *, const char *, int) {}
+
+  // Whether libbacktrace finds f at its link-time address plus bias.
+  bool at(std::uintptr_t bias, const elf_symbol &f) const {
+    struct found {
+      const char *name = nullptr;
+      std::uintptr_t start = 0;
+    } result;
+    backtrace_syminfo(
+        state_, bias + f.value,
+        [](void *data, std::uintptr_t, const char *symname,
+           std::uintptr_t symval, std::uintptr_t) {
+          *static_cast<found *>(data) = {symname, symval};
+        },
+        ignore_error, &result);
+    return result.name && result.name == f.name &&
+           result.start == bias + f.value;
+  }
+
+  static std::string_view demangle(const char *name) {
+    return fbbe::__detail::_Name_pool::_S_instance()._M_demangle(name);
+  }
+};
+
+} // namespace fbbe::tools
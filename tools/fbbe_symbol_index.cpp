@@ -0,0 +1,420 @@
+// Writes the symbol index of an ELF file, which the itanium backend maps at
+// run time instead of reading the debug information. See
+// fbbe_generate_symbol_index() in CMakeLists.txt.
+//
+// usage: fbbe_symbol_index <binary> <output>
+//
+// Between the start of two rows of the DWARF line tables, or of two
+// functions of the symbol table, libbacktrace reports the same function,
+// file and line. So every such boundary is resolved once, and neighbouring
+// ranges with the same result are merged.
+//
+// Before the index replaces the old one, it is read back like the backend
+// reads it, at the start of some functions of the symbol table. The
+// function found there must be the one the symbol table names, or the
+// index is not written.
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "elf_file.h"
+
+namespace {
+
+using fbbe::__detail::_Address_node;
+using fbbe::__detail::_Address_table;
+using fbbe::__detail::_Cached_symbol;
+using fbbe::__detail::_Symbol_index;
+using fbbe::__detail::_Symbol_index_header;
+using fbbe::__detail::_Symbol_index_range;
+
+class reader {
+public:
+  reader(const unsigned char *first, const unsigned char *last)
+      : pos_(first), end_(last) {}
+
+  bool ok() const { return ok_; }
+  const unsigned char *pos() const { return pos_; }
+  std::size_t left() const { return end_ - pos_; }
+
+  template <typename T> T fixed(std::size_t size = sizeof(T)) {
+    T value = 0;
+    if (left() < size) {
+      ok_ = false;
+      pos_ = end_;
+      return value;
+    }
+    for (std::size_t i = 0; i < size; ++i) // little endian
+      value |= T(pos_[i]) << (8 * i);
+    pos_ += size;
+    return value;
+  }
+
+  std::uint64_t uleb() {
+    std::uint64_t value = 0;
+    for (unsigned shift = 0; pos_ < end_; shift += 7) {
+      const auto byte = *pos_++;
+      if (shift < 64)
+        value |= std::uint64_t(byte & 0x7f) << shift;
+      if (!(byte & 0x80))
+        return value;
+    }
+    ok_ = false;
+    return value;
+  }
+
+  std::int64_t sleb() {
+    std::int64_t value = 0;
+    unsigned shift = 0;
+    for (; pos_ < end_; shift += 7) {
+      const auto byte = *pos_++;
+      if (shift < 64)
+        value |= std::int64_t(byte & 0x7f) << shift;
+      if (!(byte & 0x80)) {
+        if (shift + 7 < 64 && (byte & 0x40))
+          value |= -(std::int64_t(1) << (shift + 7));
+        return value;
+      }
+    }
+    ok_ = false;
+    return value;
+  }
+
+  void skip(std::uint64_t size) {
+    if (left() < size) {
+      ok_ = false;
+      size = left();
+    }
+    pos_ += size;
+  }
+
+private:
+  const unsigned char *pos_;
+  const unsigned char *end_;
+  bool ok_ = true;
+};
+
+// Runs the line number programs of .debug_line (DWARF 2 to 5) and collects
+// the address of every row. Only the addresses are needed, so the file and
+// directory tables are skipped over using header_length.
+bool line_table_addresses(const std::vector<unsigned char> &section,
+                          std::vector<std::uint64_t> &out) {
+  reader units(section.data(), section.data() + section.size());
+  while (units.left() > 0) {
+    std::uint64_t length = units.fixed<std::uint32_t>();
+    unsigned offset_size = 4;
+    if (length == 0xffffffff) {
+      length = units.fixed<std::uint64_t>();
+      offset_size = 8;
+    }
+    if (!units.ok() || length > units.left())
+      return false;
+    reader unit(units.pos(), units.pos() + length);
+    units.skip(length);
+
+    const auto version = unit.fixed<std::uint16_t>();
+    if (version < 2 || version > 5)
+      continue;
+    if (version >= 5)
+      unit.skip(2); // address_size, segment_selector_size
+    const auto header_length = unit.fixed<std::uint64_t>(offset_size);
+    reader header(unit.pos(), unit.pos() + std::min<std::uint64_t>(
+                                               header_length, unit.left()));
+    unit.skip(header_length);
+    const unsigned min_length = header.fixed<std::uint8_t>();
+    if (version >= 4)
+      header.skip(1); // maximum_operations_per_instruction
+    header.skip(1);   // default_is_stmt
+    header.skip(1);   // line_base
+    const unsigned line_range = header.fixed<std::uint8_t>();
+    const unsigned opcode_base = header.fixed<std::uint8_t>();
+    std::vector<std::uint8_t> lengths(opcode_base > 0 ? opcode_base - 1 : 0);
+    for (auto &l : lengths)
+      l = header.fixed<std::uint8_t>();
+    if (!header.ok() || !unit.ok() || line_range == 0)
+      return false;
+
+    std::uint64_t address = 0;
+    while (unit.left() > 0 && unit.ok()) {
+      const unsigned op = unit.fixed<std::uint8_t>();
+      if (op >= opcode_base) {
+        address += (op - opcode_base) / line_range * min_length;
+        out.push_back(address);
+        continue;
+      }
+      switch (op) {
+      case 0: { // extended
+        const auto size = unit.uleb();
+        if (size == 0)
+          break;
+        const unsigned sub = unit.fixed<std::uint8_t>();
+        if (sub == 1) { // DW_LNE_end_sequence
+          out.push_back(address);
+          address = 0;
+        } else if (sub == 2) { // DW_LNE_set_address
+          const auto n = std::min<std::uint64_t>(size - 1, 8);
+          address = unit.fixed<std::uint64_t>(n);
+          unit.skip(size - 1 - n);
+        } else {
+          unit.skip(size - 1);
+        }
+        break;
+      }
+      case 1: // DW_LNS_copy
+        out.push_back(address);
+        break;
+      case 2: // DW_LNS_advance_pc
+        address += unit.uleb() * min_length;
+        break;
+      case 3: // DW_LNS_advance_line
+        unit.sleb();
+        break;
+      case 8: // DW_LNS_const_add_pc
+        address += (255 - opcode_base) / line_range * min_length;
+        break;
+      case 9: // DW_LNS_fixed_advance_pc
+        address += unit.fixed<std::uint16_t>();
+        break;
+      default: // operands are ULEB128 numbers
+        for (unsigned i = 0; i < lengths[op - 1]; ++i)
+          unit.uleb();
+      }
+    }
+  }
+  return true;
+}
+
+class string_table {
+public:
+  std::uint32_t add(std::string_view s) {
+    const auto [it, inserted] =
+        offsets_.try_emplace(std::string(s), std::uint32_t(data_.size()));
+    if (inserted) {
+      data_.append(s);
+      data_ += '\0';
+    }
+    return it->second;
+  }
+
+  std::uint32_t add(const char *s) {
+    return s ? add(std::string_view(s)) : _Symbol_index_header::_S_none;
+  }
+
+  const std::string &data() const { return data_; }
+
+private:
+  std::string data_;
+  std::unordered_map<std::string, std::uint32_t> offsets_;
+};
+
+// Drops template arguments, which the debug information and the demangler
+// spell differently, e.g. "f<main()::info>" and "f<main::info>".
+std::string without_templates(std::string_view name) {
+  std::string result;
+  int depth = 0;
+  for (std::size_t i = 0; i < name.size(); ++i) {
+    if (name.compare(i, 8, "operator") == 0) { // operator<, operator->, ...
+      std::size_t end = i + 8;
+      while (end < name.size() &&
+             std::string_view("<>=-").find(name[end]) != std::string_view::npos)
+        ++end;
+      if (depth == 0)
+        result.append(name.substr(i, end - i));
+      i = end - 1;
+    } else if (name[i] == '<') {
+      ++depth;
+    } else if (name[i] == '>' && depth > 0) {
+      --depth;
+    } else if (depth == 0) {
+      result += name[i];
+    }
+  }
+  return result;
+}
+
+// Whether the debug information names the function that the symbol table
+// calls symtab. Without a linkage name it only has the unqualified name,
+// e.g. "print" for "(anonymous namespace)::printer::print(int) const".
+bool same_function(std::string_view debug, std::string_view symtab) {
+  if (debug == symtab)
+    return true;
+  const auto name = without_templates(debug) + '(';
+  const auto full = without_templates(symtab);
+  for (auto pos = full.find(name); pos != std::string::npos;
+       pos = full.find(name, pos + 1))
+    if (pos == 0 || full[pos - 1] == ':' || full[pos - 1] == ' ')
+      return true;
+  return false;
+}
+
+// Looks the starts of functions of elf up in the index at path and compares
+// the result with the symbol table and with libbacktrace. A function may
+// start with code inlined into it, so the symbol table names the function
+// it was inlined into.
+bool check(const std::string &path, const fbbe::tools::elf_file &elf,
+           const fbbe::tools::file_symbolizer &symbolizer,
+           const std::vector<fbbe::tools::elf_symbol> &functions) {
+  const auto index = _Symbol_index::_S_open(path, elf.build_id);
+  if (!index) {
+    std::cerr << "fbbe_symbol_index: cannot read back " << path << '\n';
+    return false;
+  }
+  if (functions.empty()) {
+    std::cerr << "fbbe_symbol_index: " << elf.path
+              << ": no function of the symbol table to check against\n";
+    return false;
+  }
+  auto &names = fbbe::__detail::_Name_pool::_S_instance();
+  for (const auto &f : functions) {
+    const auto symbol = symbolizer.resolve(f.value);
+    const auto expected = names._M_demangle(f.name.c_str());
+    _Cached_symbol found;
+    if (!index->_M_find(f.value, found) || found._M_desc != symbol.function ||
+        !same_function(symbol.enclosing, expected)) {
+      std::cerr << "fbbe_symbol_index: " << elf.path << ": 0x" << std::hex
+                << f.value << std::dec << " is " << expected
+                << " in the symbol table, but "
+                << (found._M_desc.empty() ? "<none>" : found._M_desc)
+                << " in the index";
+      if (symbol.enclosing != symbol.function)
+        std::cerr << ", inlined into " << symbol.enclosing;
+      std::cerr << "; the index was not written\n";
+      return false;
+    }
+  }
+  return true;
+}
+
+} // namespace
+
+auto main(int argc, char **argv) -> int {
+  if (argc != 3) {
+    std::cerr << "usage: " << argv[0] << " <binary> <output>\n";
+    return 2;
+  }
+  fbbe::tools::elf_file elf;
+  fbbe::tools::file_symbolizer symbolizer;
+  if (!elf.open(argv[1]) || !symbolizer.open(elf)) {
+    std::cerr << "fbbe_symbol_index: cannot read " << argv[1] << '\n';
+    return 1;
+  }
+
+  std::vector<std::uint64_t> boundaries;
+  for (const auto &[start, end] : elf.code) {
+    boundaries.push_back(start);
+    boundaries.push_back(end);
+  }
+  const auto functions = elf.functions();
+  for (const auto &f : functions) {
+    boundaries.push_back(f.value);
+    boundaries.push_back(f.value + f.size);
+  }
+  if (const auto *s = elf.section(".debug_line")) {
+    if (s->flags & SHF_COMPRESSED)
+      std::cerr << "fbbe_symbol_index: " << argv[1]
+                << ": compressed .debug_line is not supported, using the "
+                   "symbol table only\n";
+    else if (!line_table_addresses(elf.read(s->offset, s->size), boundaries))
+      std::cerr << "fbbe_symbol_index: " << argv[1]
+                << ": malformed .debug_line\n";
+  }
+
+  const auto in_code = [&elf](std::uint64_t address) {
+    return std::any_of(elf.code.begin(), elf.code.end(), [&](const auto &r) {
+      return r.first <= address && address <= r.second;
+    });
+  };
+  boundaries.erase(std::remove_if(boundaries.begin(), boundaries.end(),
+                                  [&](auto a) { return !in_code(a); }),
+                   boundaries.end());
+  std::sort(boundaries.begin(), boundaries.end());
+  boundaries.erase(std::unique(boundaries.begin(), boundaries.end()),
+                   boundaries.end());
+
+  string_table strings;
+  _Symbol_index_header header = {};
+  std::copy(std::begin(_Symbol_index_header::_S_magic),
+            std::end(_Symbol_index_header::_S_magic), header._M_magic);
+  header._M_version = _Symbol_index_header::_S_version;
+  header._M_build_id = elf.build_id.empty() ? _Symbol_index_header::_S_none
+                                            : strings.add(elf.build_id);
+
+  std::vector<_Symbol_index_range> ranges;
+  for (const auto address : boundaries) {
+    const auto symbol = symbolizer.resolve(address);
+    _Symbol_index_range range = {};
+    range._M_start = address;
+    range._M_function = symbol.function.empty()
+                            ? _Symbol_index_header::_S_none
+                            : strings.add(symbol.function);
+    range._M_file = strings.add(symbol.file);
+    range._M_line = symbol.line;
+    if (!ranges.empty() && ranges.back()._M_function == range._M_function &&
+        ranges.back()._M_file == range._M_file &&
+        ranges.back()._M_line == range._M_line)
+      continue;
+    ranges.push_back(range);
+  }
+  if (strings.data().empty())
+    strings.add("");
+
+  // Searched in place by the readers.
+  _Address_table tree;
+  tree._M_assign(ranges.size(),
+                 [&](std::size_t i) { return ranges[i]._M_start; });
+  const auto &nodes = tree._M_node_data();
+  const auto &ranks = tree._M_rank_data();
+
+  auto align = [](std::uint64_t offset, std::uint64_t alignment) {
+    return (offset + alignment - 1) / alignment * alignment;
+  };
+  header._M_count = ranges.size();
+  header._M_tree = align(sizeof(header), alignof(_Address_node));
+  header._M_tree_ranks = header._M_tree + nodes.size() * sizeof(nodes[0]);
+  header._M_ranges =
+      align(header._M_tree_ranks + ranks.size() * sizeof(ranks[0]),
+            alignof(_Symbol_index_range));
+  header._M_strings = header._M_ranges + ranges.size() * sizeof(ranges[0]);
+  header._M_strings_size = strings.data().size();
+
+  // Processes may map the old index while it is replaced.
+  const std::string output = argv[2];
+  const std::string temporary = output + ".tmp";
+  {
+    std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+    auto pad = [&out](std::uint64_t offset) {
+      while (std::uint64_t(out.tellp()) < offset)
+        out.put('\0');
+    };
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    pad(header._M_tree);
+    out.write(reinterpret_cast<const char *>(nodes.data()),
+              nodes.size() * sizeof(nodes[0]));
+    out.write(reinterpret_cast<const char *>(ranks.data()),
+              ranks.size() * sizeof(ranks[0]));
+    pad(header._M_ranges);
+    out.write(reinterpret_cast<const char *>(ranges.data()),
+              ranges.size() * sizeof(ranges[0]));
+    out.write(strings.data().data(), strings.data().size());
+    if (!out) {
+      std::cerr << "fbbe_symbol_index: cannot write " << temporary << '\n';
+      return 1;
+    }
+  }
+  if (!check(temporary, elf, symbolizer,
+             fbbe::tools::sample_functions(functions, 64))) {
+    std::remove(temporary.c_str());
+    return 1;
+  }
+  if (std::rename(temporary.c_str(), output.c_str()) != 0) {
+    std::cerr << "fbbe_symbol_index: cannot write " << output << '\n';
+    return 1;
+  }
+  return 0;
+}
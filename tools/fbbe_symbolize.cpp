@@ -0,0 +1,215 @@
+// Resolves the raw stacktraces written by fbbe::to_raw_string() against the
+// binaries on disk.
+//
+// usage: fbbe_symbolize [--sysroot <dir>] [<file>...]
+//
+// Copies the files, or stdin, to stdout and replaces every record by the
+// symbolized trace, in the format of operator<<. Text in front of the record
+// markers, e.g. a log prefix, is kept. Other lines, and record lines that
+// cannot be parsed, pass through unchanged.
+#include <charconv>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "elf_file.h"
+
+namespace {
+
+constexpr std::string_view marker = "fbbe-raw ";
+
+// Frames of a basic_stacktrace, which bound the frames and modules of a
+// record.
+constexpr std::size_t max_frames = 0xffff;
+
+// Parses the whole of text as a number, hexadecimal ones with "0x".
+template <typename T> bool parse(std::string_view text, T &value, int base) {
+  if (base == 16) {
+    if (text.substr(0, 2) != "0x")
+      return false;
+    text.remove_prefix(2);
+  }
+  const auto end = text.data() + text.size();
+  const auto [ptr, ec] = std::from_chars(text.data(), end, value, base);
+  return !text.empty() && ec == std::errc() && ptr == end;
+}
+
+// A binary opened for symbolization.
+struct module_file {
+  fbbe::tools::elf_file elf;
+  fbbe::tools::file_symbolizer symbolizer;
+  bool ok = false;
+};
+
+class symbolizer {
+public:
+  std::string sysroot;
+
+  void run(std::istream &in) {
+    for (std::string line; std::getline(in, line);)
+      process(line);
+    if (in_record_)
+      flush(); // truncated record
+  }
+
+private:
+  struct record_module {
+    const module_file *file = nullptr;
+    std::string path;
+  };
+  struct record_frame {
+    long module = -1;
+    std::uintptr_t address = 0;
+  };
+
+  std::map<std::string, module_file> files_;
+  bool in_record_ = false;
+  std::string prefix_;
+  std::vector<record_module> modules_;
+  std::vector<record_frame> frames_;
+
+  const module_file *file(const std::string &path,
+                          const std::string &build_id) {
+    auto [it, inserted] = files_.try_emplace(path);
+    auto &module = it->second;
+    if (inserted) {
+      module.ok = module.elf.open(sysroot + path) &&
+                  module.symbolizer.open(module.elf);
+      if (!module.ok)
+        std::cerr << "fbbe_symbolize: cannot read " << sysroot << path
+                  << '\n';
+      else if (build_id != "-" && build_id != module.elf.build_id)
+        std::cerr << "fbbe_symbolize: build-id mismatch for " << sysroot
+                  << path << '\n';
+    }
+    return module.ok ? &module : nullptr;
+  }
+
+  void process(const std::string &line) {
+    const auto pos = line.find(marker);
+    if (pos == std::string::npos) {
+      std::cout << line << '\n';
+      return;
+    }
+    std::istringstream fields(line.substr(pos + marker.size()));
+    std::string kind;
+    fields >> kind;
+    if (kind == "begin") {
+      std::string version, size;
+      fields >> version >> size;
+      std::size_t frames;
+      if (version != "1" || !parse(size, frames, 10) || frames > max_frames) {
+        std::cout << line << '\n';
+        return;
+      }
+      if (in_record_)
+        flush();
+      in_record_ = true;
+      prefix_ = line.substr(0, pos);
+    } else if (!in_record_) {
+      std::cout << line << '\n';
+    } else if (kind == "module") {
+      std::string index_text, base_text, build_id, path;
+      fields >> index_text >> base_text >> build_id;
+      std::getline(fields >> std::ws, path);
+      std::size_t index;
+      std::uintptr_t base;
+      if (!parse(index_text, index, 10) || index >= max_frames ||
+          !parse(base_text, base, 16) || build_id.empty() || path.empty()) {
+        std::cout << line << '\n';
+        return;
+      }
+      if (modules_.size() <= index)
+        modules_.resize(index + 1);
+      modules_[index] = {file(path, build_id), path};
+    } else if (kind == "frame") {
+      std::string module, address, rest;
+      fields >> module >> address >> rest;
+      record_frame frame;
+      if ((module != "-" &&
+           (!parse(module, frame.module, 10) || frame.module < 0 ||
+            frame.module >= long(max_frames))) ||
+          !parse(address, frame.address, 16) || !rest.empty() ||
+          frames_.size() >= max_frames) {
+        std::cout << line << '\n';
+        return;
+      }
+      frames_.push_back(frame);
+    } else if (kind == "end") {
+      flush();
+    }
+  }
+
+  void flush() {
+    for (std::size_t i = 0; i < frames_.size(); ++i) {
+      std::cout << prefix_ << std::setw(4) << i << "# ";
+      print(frames_[i]);
+      std::cout << '\n';
+    }
+    in_record_ = false;
+    modules_.clear();
+    frames_.clear();
+  }
+
+  void print(const record_frame &frame) {
+    const auto hex = [](std::uintptr_t value) {
+      std::ostringstream os;
+      os << "0x" << std::hex << value;
+      return os.str();
+    };
+    if (frame.module < 0 ||
+        static_cast<std::size_t>(frame.module) >= modules_.size()) {
+      std::cout << hex(frame.address);
+      return;
+    }
+    const auto &module = modules_[frame.module];
+    fbbe::tools::symbol symbol;
+    if (module.file)
+      symbol = module.file->symbolizer.resolve(frame.address);
+    if (!symbol.function.empty() && symbol.file)
+      std::cout << symbol.function << " at " << symbol.file << ':'
+                << symbol.line;
+    else if (!symbol.function.empty())
+      std::cout << symbol.function << " in " << module.path;
+    else
+      std::cout << hex(frame.address) << " in " << module.path;
+  }
+};
+
+} // namespace
+
+auto main(int argc, char **argv) -> int {
+  symbolizer s;
+  std::vector<std::string> files;
+  for (int i = 1; i < argc; ++i) {
+    const std::string_view arg = argv[i];
+    if (arg == "--sysroot" && i + 1 < argc) {
+      s.sysroot = argv[++i];
+    } else if (arg == "-h" || arg == "--help") {
+      std::cout << "usage: " << argv[0] << " [--sysroot <dir>] [<file>...]\n";
+      return 0;
+    } else {
+      files.emplace_back(arg);
+    }
+  }
+
+  if (files.empty()) {
+    s.run(std::cin);
+    return 0;
+  }
+  for (const auto &name : files) {
+    std::ifstream in(name);
+    if (!in) {
+      std::cerr << "fbbe_symbolize: cannot open " << name << '\n';
+      return 1;
+    }
+    s.run(in);
+  }
+  return 0;
+}